@@ -7,14 +7,70 @@
  * Description: Safe ejection tool for external drives
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <spawn.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/swap.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#include <linux/cdrom.h>
+#include <linux/dm-ioctl.h>
+#include <linux/loop.h>
+#include <linux/major.h>
+#include <linux/nbd.h>
+#include <linux/netlink.h>
+#include <linux/raid/md_u.h>
+#include <scsi/scsi_ioctl.h>
 
-// Colors and styling
+// Colors and styling. The mini build (-DCEJECT_MINI) writes plain text for
+// serial consoles and logs.
+#ifdef CEJECT_MINI
+#define RED ""
+#define GREEN ""
+#define YELLOW ""
+#define BLUE ""
+#define CYAN ""
+#define MAGENTA ""
+#define BOLD ""
+#define DIM ""
+#define NC ""
+
+#define ICON_DRIVE ""
+#define ICON_USB ""
+#define ICON_MOUNTED "*"
+#define ICON_UNMOUNTED "-"
+#define ICON_SUCCESS "ok"
+#define ICON_ERROR "error:"
+#define ICON_WARNING "warning:"
+#define ICON_EJECT "=="
+#define ICON_CRITICAL "*"
+#define ARROW "->"
+#define AT_MOST "<="
+#define RULE "------------------------------------------------------------"
+#else
 #define RED "\033[0;31m"
 #define GREEN "\033[0;32m"
 #define YELLOW "\033[1;33m"
@@ -34,11 +90,20 @@
 #define ICON_ERROR "❌"
 #define ICON_WARNING "⚠️"
 #define ICON_EJECT "⏏️"
+#define ICON_CRITICAL "★"
+#define ARROW "→"
+#define AT_MOST "≤"
+#define RULE "────────────────────────────────────────────────────────────"
+#endif
 
 #define MAX_DRIVES 32
 #define MAX_PATH 256
 #define MAX_LINE 1024
 #define MAX_PARTITIONS 16
+#define MAX_SWAPS 32
+#define MAX_HOLDERS 16
+#define MAX_PLAN_NODES 64
+#define MAX_PLAN_DEPS 32
 
 typedef struct {
     char path[MAX_PATH];
@@ -48,262 +113,7783 @@ typedef struct {
     char transport[32];
     int mount_count;
     char mountpoints[8][MAX_PATH];
+    int label_count;
+    char labels[8][64];
+    double link_mbps;
+    double device_mbps;
+    double port_mbps;
+    char usb_version[8];
+    char usb_driver[32];
+    unsigned long long size_bytes;
+    unsigned long long policy_mask;
+    unsigned int policy_actions;
 } DriveInfo;
 
+typedef struct {
+    int id;
+    unsigned int major;
+    unsigned int minor;
+    char mountpoint[MAX_PATH];
+    char fstype[32];
+    char source[MAX_PATH];
+} MountEntry;
+
+typedef struct {
+    char path[MAX_PATH];
+    bool is_file;
+    dev_t dev;
+    unsigned long long used_kb;
+} SwapEntry;
+
+typedef struct {
+    unsigned long long dirty;
+    unsigned long long writeback;
+    unsigned long long write_bw;
+    bool exact;
+} BdiStats;
+
+// Whether a drive can be ejected right now, and how soon: at once, after a
+// flush, once the I/O in flight drains, or only after files on it are closed
+typedef enum { READY_INSTANT, READY_NEEDS_FLUSH, READY_BUSY, READY_BLOCKED } ReadyState;
+
+static const char* ready_names[] = {"instant", "needs-flush", "busy", "blocked"};
+
+typedef struct {
+    ReadyState state;
+    unsigned long long dirty;      // dirty and writeback bytes
+    unsigned long long inflight;   // requests in flight
+    int open_files;                // on its filesystems, -1 if not scanned
+    char holder[48];               // who holds them ("rsync and 2 others")
+    char reason[96];
+} Readiness;
+
+// Teardown steps, in the order they are listed in a plan
+typedef enum {
+    STEP_FLUSH,
+    STEP_SWAPOFF,
+    STEP_UNMOUNT,
+    STEP_FUSE_WAIT,
+    STEP_LOOP_DETACH,
+    STEP_DM_REMOVE,
+    STEP_MD_STOP,
+    STEP_RELEASE,
+    STEP_POWER_OFF,
+    STEP_NBD_DISCONNECT,
+    STEP_MEDIA_EJECT
+} StepType;
+
+static const char* step_names[] = {
+    "flush", "swapoff", "unmount", "fuse-wait", "loop-detach", "dm-remove", "md-stop", "release", "power-off", "nbd-disconnect",
+    "media-eject"
+};
+
+// The final step of a plan, which takes the drive (or its medium) away
+bool step_detaches(StepType type) {
+    return type == STEP_POWER_OFF || type == STEP_NBD_DISCONNECT || type == STEP_MEDIA_EJECT;
+}
+
+typedef enum {
+    NODE_PENDING,
+    NODE_RUNNING,
+    NODE_DONE,
+    NODE_FAILED,
+    NODE_SKIPPED
+} NodeStatus;
+
+typedef struct {
+    StepType type;
+    char target[MAX_PATH];
+    char device[64];
+    unsigned long long bytes;
+    int deps[MAX_PLAN_DEPS];
+    int dep_count;
+    double est_ms;
+    double finish_ms;
+    bool critical;
+    NodeStatus status;
+    int err;
+    int attempts;
+    double start_ms;
+    double end_ms;
+} PlanNode;
+
+typedef struct {
+    char drive[MAX_PATH];
+    char identity[128];
+    PlanNode nodes[MAX_PLAN_NODES];
+    int node_count;
+    double total_ms;
+    int critical_path[MAX_PLAN_NODES];
+    int critical_count;
+    bool has_flush;
+    bool dirty_exact;
+    bool truncated;
+} EjectPlan;
+
+#ifndef CEJECT_MINI
 // Display header
 void show_header(void) {
-    system("clear");
+    printf("\033[H\033[2J");
     printf("\n%s%s%sCeject %s External Drive Ejector%s\n", 
            BOLD, MAGENTA, ICON_EJECT, ICON_EJECT, NC);
     printf("%sSafe removal tool for external drives%s\n\n", DIM, NC);
 }
+#endif
 
-// Execute command and get output
-char* exec_cmd(const char* cmd) {
-    static char buffer[MAX_LINE * 10];
-    buffer[0] = '\0';
-    
-    FILE* fp = popen(cmd, "r");
-    if (fp == NULL) return buffer;
-    
-    char line[MAX_LINE];
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        strncat(buffer, line, sizeof(buffer) - strlen(buffer) - 1);
+// Base name of a device path ("/dev/sdb" -> "sdb")
+const char* dev_name(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Heap allocation counters, for checking that refreshes stay off the heap
+// (--bench-refresh). glibc's allocator is wrapped, so everything the
+// process allocates is counted, including inside libc and aligned buffers
+// (posix_memalign and friends). A static glibc link
+// cannot wrap it that way; build those with -DCEJECT_NO_ALLOC_STATS.
+// Sanitizer builds, the fuzz targets among them, keep the sanitizer's own
+// allocator and go without the counters.
+typedef struct {
+    unsigned long long calls;
+    unsigned long long bytes;
+} AllocStats;
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer) || __has_feature(thread_sanitizer)
+#define CEJECT_SANITIZER 1
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__) || defined(CEJECT_FUZZ)
+#define CEJECT_SANITIZER 1
+#endif
+
+#if defined(__GLIBC__) && !defined(CEJECT_MINI) && !defined(CEJECT_NO_ALLOC_STATS) && !defined(CEJECT_SANITIZER)
+#define ALLOC_STATS 1
+
+static AllocStats alloc_stats;
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+
+static void alloc_count(size_t bytes) {
+    __atomic_fetch_add(&alloc_stats.calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_stats.bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void* malloc(size_t size) {
+    alloc_count(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    alloc_count(count * size);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    alloc_count(size);
+    return __libc_realloc(ptr, size);
+}
+
+// The aligned allocators are replaced too: glibc would otherwise serve
+// them from its own allocator without passing through the wrappers above
+void* memalign(size_t alignment, size_t size) {
+    alloc_count(size);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0) return EINVAL;
+    void* mem = memalign(alignment, size);
+    if (mem == NULL) return ENOMEM;
+    *ptr = mem;
+    return 0;
+}
+
+void* valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void free(void* ptr) {
+    __libc_free(ptr);
+}
+#else
+#define ALLOC_STATS 0
+
+static AllocStats alloc_stats;
+#endif
+
+AllocStats get_alloc_stats(void) {
+    AllocStats stats;
+    stats.calls = __atomic_load_n(&alloc_stats.calls, __ATOMIC_RELAXED);
+    stats.bytes = __atomic_load_n(&alloc_stats.bytes, __ATOMIC_RELAXED);
+    return stats;
+}
+
+// Bump allocator for data rebuilt on every refresh (the mount table).
+// arena_reset drops everything at once; if a refresh overflowed into extra
+// blocks they are merged into one that fits it, so later refreshes of the
+// same size reuse that block without calling malloc.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;
+} Arena;
+
+#define ARENA_BLOCK (64 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void* arena_alloc(Arena* arena, size_t size) {
+    ArenaBlock* block = arena->head;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = block ? block->size * 2 : ARENA_BLOCK;
+        while (block_size < size) block_size *= 2;
+
+        ArenaBlock* grown = malloc(ARENA_HEADER + block_size);
+        if (grown == NULL) return NULL;
+        *grown = (ArenaBlock){block, block_size, 0};
+        arena->head = block = grown;
     }
-    
-    pclose(fp);
-    return buffer;
+
+    void* p = (char*)block + ARENA_HEADER + block->used;
+    block->used += size;
+    return p;
 }
 
-// Get root drive
-void get_root_drive(char* root_drive, size_t size) {
-    char cmd[MAX_LINE];
-    snprintf(cmd, sizeof(cmd), "lsblk -no PKNAME \"$(findmnt -n -o SOURCE /)\" 2>/dev/null");
-    char* result = exec_cmd(cmd);
-    
-    // Remove newline
-    char* newline = strchr(result, '\n');
-    if (newline) *newline = '\0';
-    
-    strncpy(root_drive, result, size - 1);
-    root_drive[size - 1] = '\0';
+void arena_reset(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    if (block == NULL) return;
+    if (block->next == NULL) {
+        block->used = 0;
+        return;
+    }
+
+    size_t total = 0;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        total += block->size;
+        free(block);
+        block = next;
+    }
+    arena->head = malloc(ARENA_HEADER + total);
+    if (arena->head != NULL) *arena->head = (ArenaBlock){NULL, total, 0};
 }
 
-// Get drive information
-void get_drive_info(const char* drive, DriveInfo* info) {
-    char cmd[MAX_LINE];
-    
-    // Initialize
-    strcpy(info->path, drive);
-    info->mount_count = 0;
-    
-    // Get size, model, vendor, transport
-    snprintf(cmd, sizeof(cmd), "lsblk -no SIZE,MODEL,VENDOR,TRAN \"%s\" 2>/dev/null | head -1", drive);
-    char* result = exec_cmd(cmd);
-    
-    sscanf(result, "%63s %127s %127s %31s", 
-           info->size, info->model, info->vendor, info->transport);
-    
-    // Get mount points
-    snprintf(cmd, sizeof(cmd), "lsblk -no MOUNTPOINT \"%s\" 2>/dev/null", drive);
-    result = exec_cmd(cmd);
-    
-    char* line = strtok(result, "\n");
-    while (line != NULL && info->mount_count < 8) {
-        if (line[0] == '/') {
-            strncpy(info->mountpoints[info->mount_count], line, MAX_PATH - 1);
-            info->mountpoints[info->mount_count][MAX_PATH - 1] = '\0';
-            info->mount_count++;
+size_t arena_capacity(const Arena* arena) {
+    size_t total = 0;
+    for (const ArenaBlock* block = arena->head; block != NULL; block = block->next) total += block->size;
+    return total;
+}
+
+// Read a whole file into the arena, NUL-terminated. procfs files have no
+// size up front, so the buffer doubles until a read reaches end of file.
+char* arena_read_file(Arena* arena, const char* path, size_t* len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    size_t size = 16 * 1024, used = 0;
+    char* buf = arena_alloc(arena, size);
+    while (buf != NULL) {
+        ssize_t n = read(fd, buf + used, size - 1 - used);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        used += n;
+
+        if (used == size - 1) {
+            char* bigger = arena_alloc(arena, size * 2);
+            if (bigger != NULL) memcpy(bigger, buf, used);
+            buf = bigger;
+            size *= 2;
         }
-        line = strtok(NULL, "\n");
     }
+    close(fd);
+
+    if (buf == NULL) return NULL;
+    buf[used] = '\0';
+    *len = used;
+    return buf;
 }
 
-// Get all external drives
-int get_drives(DriveInfo drives[], int max_drives) {
-    char root_drive[64] = "";
-    get_root_drive(root_drive, sizeof(root_drive));
-    
-    char cmd[MAX_LINE];
-    snprintf(cmd, sizeof(cmd), 
-             "lsblk -ndo NAME,TYPE | awk -v rd=\"%s\" '$2==\"disk\" && $1!=rd {print \"/dev/\"$1}'",
-             root_drive);
+// Line-by-line reading through a caller's buffer. Unlike stdio this needs
+// no heap; lines longer than the buffer are cut short.
+typedef struct {
+    int fd;
+    char* buf;
+    size_t size;
+    size_t start;
+    size_t end;
+    bool eof;
+    bool skipping;
+} LineReader;
+
+bool line_reader_open(LineReader* r, const char* path, char* buf, size_t size) {
+    *r = (LineReader){open(path, O_RDONLY | O_CLOEXEC), buf, size, 0, 0, false, false};
+    return r->fd >= 0;
+}
+
+// Next line without its newline, or NULL at end of file
+char* line_reader_next(LineReader* r) {
+    while (true) {
+        char* line = r->buf + r->start;
+        char* nl = memchr(line, '\n', r->end - r->start);
+
+        if (nl != NULL) {
+            *nl = '\0';
+            r->start = nl - r->buf + 1;
+            if (!r->skipping) return line;
+            r->skipping = false;   // end of a line that was cut short
+            continue;
+        }
+        if (r->skipping) {
+            r->start = r->end;
+        } else if (r->eof && r->start < r->end) {
+            r->buf[r->end] = '\0';
+            r->start = r->end;
+            return line;
+        } else if (r->start == 0 && r->end == r->size - 1) {
+            r->buf[r->end] = '\0';
+            r->start = r->end;
+            r->skipping = true;
+            return line;
+        }
+        if (r->eof) return NULL;
+
+        // Keep the partial line and read more after it
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+        ssize_t n = read(r->fd, r->buf + r->end, r->size - 1 - r->end);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) r->eof = true;
+        else r->end += n;
+    }
+}
+
+void line_reader_close(LineReader* r) {
+    if (r->fd >= 0) close(r->fd);
+    r->fd = -1;
+}
+
+// Read a single-line sysfs/procfs attribute, trailing whitespace removed
+bool read_sysfs_attr(const char* path, char* buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    ssize_t n;
+    while ((n = read(fd, buf, size - 1)) < 0 && errno == EINTR) {}
+    close(fd);
+    if (n <= 0) return false;
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
     
-    char* result = exec_cmd(cmd);
+    size_t len = strlen(buf);
+    while (len > 0 && isspace((unsigned char)buf[len - 1])) buf[--len] = '\0';
+    return true;
+}
+
+// Check whether a path exists
+bool path_exists(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+// Record layout returned by getdents64
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} RawDirent;
+
+// List directory entries (skipping dot entries). Uses getdents64 directly,
+// since opendir allocates its buffer on the heap.
+int list_dir(const char* path, char names[][64], int max_names) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0;
     
+    long buf[1024];
+    long n;
     int count = 0;
-    char* line = strtok(result, "\n");
-    
-    while (line != NULL && count < max_drives) {
-        get_drive_info(line, &drives[count]);
-        count++;
-        line = strtok(NULL, "\n");
+    while (count < max_names && (n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long off = 0; off < n && count < max_names;) {
+            RawDirent* entry = (RawDirent*)((char*)buf + off);
+            off += entry->d_reclen;
+            // A cut name would address a different entry; none is that long
+            if (entry->d_name[0] == '.' || strlen(entry->d_name) > 63) continue;
+            strcpy(names[count++], entry->d_name);
+        }
     }
     
+    close(fd);
     return count;
 }
 
-// Display drives
-void show_drives(DriveInfo drives[], int count) {
-    show_header();
-    
-    if (count == 0) {
-        printf("%s%s No external drives found.%s\n\n", RED, ICON_ERROR, NC);
-        printf("Press Enter to exit...");
-        getchar();
-        exit(1);
+// Kernel text parsing. Fields are separated by whitespace, as sscanf's %s
+// splits them, and numbers are plain decimal (octal for open flags): a sign,
+// stray characters or overflow reject the input. These replace every sscanf
+// call on kernel text, which is slow per call; --bench-parsers and the
+// CEJECT_FUZZ targets compare them with it.
+static inline bool is_field_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Decimal digits at *p up to max, advancing past them
+bool parse_number(const char** p, unsigned long long max, unsigned long long* value) {
+    const char* s = *p;
+    unsigned long long v = 0;
+    if (*s < '0' || *s > '9') return false;
+    for (; *s >= '0' && *s <= '9'; s++) {
+        unsigned int digit = *s - '0';
+        if (v > (max - digit) / 10) return false;
+        v = v * 10 + digit;
+    }
+    *value = v;
+    *p = s;
+    return true;
+}
+
+// Skip whitespace, then copy the next field into out (out may be NULL to
+// skip it). False if there is no field, or if it does not fit in out; *p
+// is then left where it was.
+bool next_field(const char** p, char* out, size_t size) {
+    const char* s = *p;
+    while (is_field_space(*s)) s++;
+    if (*s == '\0') return false;
+
+    const char* start = s;
+    while (*s && !is_field_space(*s)) s++;
+    if (out != NULL) {
+        size_t len = (size_t)(s - start);
+        if (len >= size) return false;
+        memcpy(out, start, len);
+        out[len] = '\0';
+    }
+    *p = s;
+    return true;
+}
+
+// A whole field holding a decimal number up to max
+bool next_number(const char** p, unsigned long long max, unsigned long long* value) {
+    const char* s = *p;
+    while (is_field_space(*s)) s++;
+    if (!parse_number(&s, max, value) || (*s && !is_field_space(*s))) return false;
+    *p = s;
+    return true;
+}
+
+// "major:minor" and nothing else
+bool parse_devnum(const char* s, unsigned int* major, unsigned int* minor) {
+    unsigned long long ma, mi;
+    if (!parse_number(&s, UINT_MAX, &ma) || *s++ != ':' || !parse_number(&s, UINT_MAX, &mi) || *s) return false;
+    *major = (unsigned int)ma;
+    *minor = (unsigned int)mi;
+    return true;
+}
+
+// A "Key: 123 kB" line of meminfo, debugfs bdi stats, /proc/<pid>/io or
+// /proc/<pid>/status
+bool parse_stat_line(const char* line, const char* key, unsigned long long* value) {
+    size_t len = strlen(key);
+    if (strncmp(line, key, len) != 0 || line[len] != ':') return false;
+    const char* s = line + len + 1;
+    while (is_field_space(*s)) s++;
+    return parse_number(&s, ULLONG_MAX, value);
+}
+
+// A block device's inflight attribute: "reads writes"
+bool parse_inflight(const char* s, unsigned long long* reads, unsigned long long* writes) {
+    return next_number(&s, ULLONG_MAX, reads) && next_number(&s, ULLONG_MAX, writes);
+}
+
+// The "flags:" line of /proc/<pid>/fdinfo/<fd>, which the kernel writes in octal
+bool parse_fdinfo_flags(const char* line, unsigned int* flags) {
+    if (strncmp(line, "flags:", 6) != 0) return false;
+    const char* s = line + 6;
+    while (is_field_space(*s)) s++;
+    if (*s < '0' || *s > '7') return false;
+
+    unsigned int v = 0;
+    for (; *s >= '0' && *s <= '7'; s++) {
+        if (v > UINT_MAX >> 3) return false;
+        v = v << 3 | (unsigned int)(*s - '0');
+    }
+    *flags = v;
+    return true;
+}
+
+// Read major:minor of a block device from sysfs
+bool get_block_devnum(const char* name, unsigned int* major, unsigned int* minor) {
+    char path[MAX_PATH], buf[32];
+    if (snprintf(path, sizeof(path), "/sys/class/block/%s/dev", name) >= (int)sizeof(path)) return false;
+    if (!read_sysfs_attr(path, buf, sizeof(buf))) return false;
+    return parse_devnum(buf, major, minor);
+}
+
+// Decode the \ooo escapes the kernel uses in mountinfo and /proc/swaps
+void unescape_octal(char* s) {
+    char* out = s;
+    while (*s) {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+            s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+            *out++ = (char)(((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0'));
+            s += 4;
+        } else {
+            *out++ = *s++;
+        }
+    }
+    *out = '\0';
+}
+
+// Encode s the way the kernel writes mountinfo paths, with space, tab,
+// newline and backslash as \ooo, so it reads back as one field. False if
+// it does not fit.
+bool escape_octal(const char* s, char* out, size_t size) {
+    size_t len = 0;
+    for (; *s; s++) {
+        bool special = *s == ' ' || *s == '\t' || *s == '\n' || *s == '\\';
+        if (len + (special ? 4 : 1) >= size) return false;
+        if (special) len += snprintf(out + len, size - len, "\\%03o", (unsigned char)*s);
+        else out[len++] = *s;
+    }
+    out[len] = '\0';
+    return true;
+}
+
+// One line of /proc/self/mountinfo:
+//   36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+// A line with a mountpoint, type or source too long for MountEntry is
+// rejected rather than cut short.
+bool parse_mountinfo_line(const char* line, MountEntry* m) {
+    const char* p = line;
+    unsigned long long id, parent;
+    char devnum[32];
+
+    if (!next_number(&p, INT_MAX, &id) || !next_number(&p, INT_MAX, &parent) ||
+        !next_field(&p, devnum, sizeof(devnum)) || !parse_devnum(devnum, &m->major, &m->minor) ||
+        !next_field(&p, NULL, 0) || !next_field(&p, m->mountpoint, sizeof(m->mountpoint))) {
+        return false;
     }
+    m->id = (int)id;
+
+    // Optional fields end with a lone "-"
+    const char* sep = strstr(p, " - ");
+    if (sep == NULL) return false;
+
+    p = sep + 3;
+    if (!next_field(&p, m->fstype, sizeof(m->fstype)) || !next_field(&p, m->source, sizeof(m->source))) return false;
+    unescape_octal(m->mountpoint);
+    unescape_octal(m->source);
+    return true;
+}
+
+// Load the mount table from /proc/self/mountinfo into the arena. Lines that
+// cannot be read are left out and set *truncated.
+MountEntry* read_mountinfo(Arena* arena, int* count, bool* truncated) {
+    size_t len;
+    *count = 0;
+    char* text = arena_read_file(arena, "/proc/self/mountinfo", &len);
+    if (text == NULL) return NULL;
     
-    printf("%s%sAvailable Drives:%s\n", BOLD, GREEN, NC);
-    printf("%s────────────────────────────────────────────────────────────%s\n\n", DIM, NC);
+    int lines = 0;
+    for (char* p = text; (p = memchr(p, '\n', text + len - p)) != NULL; p++) lines++;
+    MountEntry* mounts = arena_alloc(arena, (lines + 1) * sizeof(MountEntry));
+    if (mounts == NULL) return NULL;
     
-    for (int i = 0; i < count; i++) {
-        DriveInfo* drive = &drives[i];
-        
-        // Build friendly name
-        char friendly_name[256];
-        if (strlen(drive->vendor) > 0 || strlen(drive->model) > 0) {
-            snprintf(friendly_name, sizeof(friendly_name), "%s%s%s", 
-                    strlen(drive->vendor) > 0 ? drive->vendor : "",
-                    strlen(drive->vendor) > 0 ? " " : "",
-                    strlen(drive->model) > 0 ? drive->model : "Unknown Drive");
-        } else {
-            strcpy(friendly_name, "Unknown Drive");
+    for (char *line = text, *next; line < text + len; line = next) {
+        char* nl = memchr(line, '\n', text + len - line);
+        next = nl ? nl + 1 : text + len;
+        if (nl) *nl = '\0';
+
+        MountEntry* m = &mounts[*count];
+        if (!parse_mountinfo_line(line, m)) {
+            if (*line) *truncated = true;
+            continue;
         }
         
-        // Mount info
-        const char* mount_info;
-        char mount_extra[64] = "";
-        
-        if (drive->mount_count > 0) {
-            mount_info = GREEN ICON_MOUNTED " Mounted" NC;
-            if (drive->mount_count > 3) {
-                snprintf(mount_extra, sizeof(mount_extra), " (%d locations)", drive->mount_count);
-            }
-        } else {
-            mount_info = DIM ICON_UNMOUNTED " Not mounted" NC;
+        // Unprivileged FUSE mounts (ntfs-3g, exfat-fuse) sit on an anonymous
+        // device; attribute them to the block device their daemon serves
+        struct stat st;
+        if (m->major == 0 && strncmp(m->fstype, "fuse", 4) == 0 && stat(m->source, &st) == 0 &&
+            S_ISBLK(st.st_mode)) {
+            m->major = major(st.st_rdev);
+            m->minor = minor(st.st_rdev);
         }
-        
-        // Connection type
-        const char* conn_icon = ICON_USB;
-        const char* conn_type = "USB";
-        
-        if (strcmp(drive->transport, "sata") == 0) {
-            conn_icon = "💿";
-            conn_type = "SATA";
-        } else if (strcmp(drive->transport, "nvme") == 0) {
-            conn_icon = "⚡";
-            conn_type = "NVMe";
+        (*count)++;
+    }
+    
+    return mounts;
+}
+
+// One line of /proc/swaps: path, type, size and used (KiB), priority
+bool parse_swaps_line(const char* line, SwapEntry* sw) {
+    const char* p = line;
+    unsigned long long size_kb;
+    if (!next_field(&p, sw->path, sizeof(sw->path)) || !next_field(&p, NULL, 0) ||
+        !next_number(&p, ULLONG_MAX, &size_kb) || !next_number(&p, ULLONG_MAX, &sw->used_kb)) {
+        return false;
+    }
+    unescape_octal(sw->path);
+    return true;
+}
+
+// Load active swap areas from /proc/swaps. Lines that cannot be read are
+// left out and set *truncated.
+int read_swaps(SwapEntry swaps[], int max_swaps, bool* truncated) {
+    LineReader reader;
+    char buf[MAX_LINE], *line;
+    if (!line_reader_open(&reader, "/proc/swaps", buf, sizeof(buf))) return 0;
+    
+    int count = 0;
+    
+    // Skip header
+    if (line_reader_next(&reader) == NULL) {
+        line_reader_close(&reader);
+        return 0;
+    }
+    
+    while (count < max_swaps && (line = line_reader_next(&reader)) != NULL) {
+        SwapEntry* sw = &swaps[count];
+        if (!parse_swaps_line(line, sw)) {
+            if (*line) *truncated = true;
+            continue;
         }
         
-        // Display drive info
-        printf("%s%s[%d]%s %s %s%s%s\n", BOLD, YELLOW, i + 1, NC, conn_icon, BOLD, friendly_name, NC);
-        printf("    %s├─%s %sDevice:%s %s\n", DIM, NC, CYAN, NC, drive->path);
-        printf("    %s├─%s %sSize:%s %s\n", DIM, NC, CYAN, NC, drive->size);
-        printf("    %s├─%s %sType:%s %s\n", DIM, NC, CYAN, NC, conn_type);
-        printf("    %s└─%s %sStatus:%s %s%s\n", DIM, NC, CYAN, NC, mount_info, mount_extra);
-        
-        // Show mount points if mounted and count <= 3
-        if (drive->mount_count > 0 && drive->mount_count <= 3) {
-            for (int j = 0; j < drive->mount_count; j++) {
-                printf("       %s→%s %s\n", DIM, NC, drive->mountpoints[j]);
-            }
-        }
-        printf("\n");
+        struct stat st;
+        if (stat(sw->path, &st) != 0) continue;
+        sw->is_file = !S_ISBLK(st.st_mode);
+        sw->dev = sw->is_file ? st.st_dev : st.st_rdev;
+        count++;
     }
     
-    printf("%s────────────────────────────────────────────────────────────%s\n", DIM, NC);
+    line_reader_close(&reader);
+    return count;
 }
 
-// Unmount drive
-bool unmount_drive(const char* drive_path) {
-    char cmd[MAX_LINE];
+// Read per-bdi dirty/writeback counters (debugfs), falling back to the
+// system-wide totals in /proc/meminfo as an upper bound
+void read_bdi_stats(unsigned int major, unsigned int minor, BdiStats* stats) {
+    char path[MAX_PATH], buf[MAX_LINE], *line;
+    LineReader reader;
+    memset(stats, 0, sizeof(*stats));
     
-    show_header();
-    printf("%s%s%s Selected: %s%s\n\n", BOLD, YELLOW, ICON_WARNING, drive_path, NC);
-    printf("%s%s Unmounting all partitions...%s\n\n", CYAN, ICON_DRIVE, NC);
+    snprintf(path, sizeof(path), "/sys/kernel/debug/bdi/%u:%u/stats", major, minor);
+    if (line_reader_open(&reader, path, buf, sizeof(buf))) {
+        unsigned long long kb;
+        while ((line = line_reader_next(&reader)) != NULL) {
+            if (parse_stat_line(line, "BdiWriteback", &kb)) stats->writeback = kb * 1024;
+            else if (parse_stat_line(line, "BdiReclaimable", &kb)) stats->dirty = kb * 1024;
+            else if (parse_stat_line(line, "BdiWriteBandwidth", &kb)) stats->write_bw = kb * 1024;
+        }
+        line_reader_close(&reader);
+        stats->exact = true;
+        return;
+    }
     
-    // Get all partitions
-    snprintf(cmd, sizeof(cmd), "lsblk -lno NAME \"%s\" | tail -n +2", drive_path);
-    char* result = exec_cmd(cmd);
+    if (!line_reader_open(&reader, "/proc/meminfo", buf, sizeof(buf))) return;
     
-    bool unmount_failed = false;
-    char* partition = strtok(result, "\n");
+    unsigned long long kb;
+    while ((line = line_reader_next(&reader)) != NULL) {
+        if (parse_stat_line(line, "Dirty", &kb)) stats->dirty = kb * 1024;
+        else if (parse_stat_line(line, "Writeback", &kb)) stats->writeback = kb * 1024;
+    }
+    line_reader_close(&reader);
+}
+
+// Stable identity for a drive: WWID, then USB serial, then model and size
+void get_drive_identity(const char* name, char* identity, size_t size) {
+    char path[MAX_PATH], buf[128];
     
-    while (partition != NULL) {
-        char part_path[MAX_PATH];
-        snprintf(part_path, sizeof(part_path), "/dev/%s", partition);
-        
-        // Check if mounted
-        snprintf(cmd, sizeof(cmd), "lsblk -no MOUNTPOINT \"%s\" 2>/dev/null", part_path);
-        char* mountpoint = exec_cmd(cmd);
-        
-        // Remove newline
-        char* newline = strchr(mountpoint, '\n');
-        if (newline) *newline = '\0';
-        
-        if (strlen(mountpoint) > 0) {
-            printf("  %s→%s Unmounting %s (%s)...\n", DIM, NC, part_path, mountpoint);
-            
-            snprintf(cmd, sizeof(cmd), "udisksctl unmount -b \"%s\" &>/dev/null", part_path);
-            int ret = system(cmd);
-            
-            if (ret == 0) {
-                printf("    %s%s Success%s\n", GREEN, ICON_SUCCESS, NC);
-            } else {
-                printf("    %s%s Failed%s\n", RED, ICON_ERROR, NC);
-                unmount_failed = true;
+    snprintf(path, sizeof(path), "/sys/block/%s/device/wwid", name);
+    if (!read_sysfs_attr(path, buf, sizeof(buf))) {
+        snprintf(path, sizeof(path), "/sys/block/%s/wwid", name);
+        if (!read_sysfs_attr(path, buf, sizeof(buf))) buf[0] = '\0';
+    }
+    
+    // Walk up to the USB device node, which carries the serial number
+    if (buf[0] == '\0') {
+        char real[PATH_MAX];
+        snprintf(path, sizeof(path), "/sys/block/%s", name);
+        if (realpath(path, real) != NULL) {
+            char* slash;
+            while ((slash = strrchr(real, '/')) != NULL && slash != real) {
+                *slash = '\0';
+                char serial_path[PATH_MAX + 16];
+                snprintf(serial_path, sizeof(serial_path), "%s/serial", real);
+                if (read_sysfs_attr(serial_path, buf, sizeof(buf)) && buf[0] != '\0') break;
+                buf[0] = '\0';
             }
         }
-        
-        partition = strtok(NULL, "\n");
     }
     
-    if (unmount_failed) {
-        printf("\n%s%s Some partitions failed to unmount.%s\n", RED, ICON_ERROR, NC);
-        printf("%s%s The drive may still be in use.%s\n\n", YELLOW, ICON_WARNING, NC);
-        printf("Press Enter to continue...");
-        getchar();
-        return false;
+    if (buf[0] == '\0') {
+        char model[64] = "", sectors[32] = "";
+        snprintf(path, sizeof(path), "/sys/block/%s/device/model", name);
+        read_sysfs_attr(path, model, sizeof(model));
+        snprintf(path, sizeof(path), "/sys/block/%s/size", name);
+        read_sysfs_attr(path, sectors, sizeof(sectors));
+        snprintf(buf, sizeof(buf), "%s:%s", model[0] ? model : name, sectors);
     }
     
-    // Power off the drive
-    printf("\n%s%s Powering off the drive...%s\n\n", CYAN, ICON_EJECT, NC);
-    snprintf(cmd, sizeof(cmd), "udisksctl power-off -b \"%s\" &>/dev/null", drive_path);
-    int ret = system(cmd);
+    // Identities are stored as whitespace-separated tokens
+    size_t i;
+    for (i = 0; buf[i] && i < size - 1; i++) {
+        identity[i] = isspace((unsigned char)buf[i]) ? '_' : buf[i];
+    }
+    identity[i] = '\0';
+}
+
+// Create the directories leading up to a file
+void mkdir_parents(const char* path) {
+    char dir[MAX_PATH];
+    if (snprintf(dir, sizeof(dir), "%s", path) >= (int)sizeof(dir)) return;
     
-    if (ret == 0) {
-        printf("%s%s Drive %s has been safely ejected!%s\n", GREEN, ICON_SUCCESS, drive_path, NC);
-        printf("%s%s You can now safely remove the drive.%s\n\n", GREEN, ICON_SUCCESS, NC);
+    for (char* p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    }
+}
+
+// Location of ceject's persistent per-device state
+void get_state_path(const char* file, char* path, size_t size) {
+    const char* dir = getenv("CEJECT_STATE_DIR");
+    if (dir != NULL) {
+        snprintf(path, size, "%s/%s", dir, file);
+    } else if ((dir = getenv("XDG_STATE_HOME")) != NULL) {
+        snprintf(path, size, "%s/ceject/%s", dir, file);
     } else {
-        printf("%s%s Failed to power off the drive.%s\n\n", RED, ICON_ERROR, NC);
+        const char* home = getenv("HOME");
+        snprintf(path, size, "%s/.local/state/ceject/%s", home ? home : "/root", file);
     }
-    
-    printf("Press Enter to continue...");
-    getchar();
-    return true;
 }
 
-int main(void) {
-    DriveInfo drives[MAX_DRIVES];
-    int drive_count;
-    char input[16];
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Look up a learned value ("<identity> key=value ...") for a device
+bool state_get(const char* identity, const char* key, double* value) {
+    char path[MAX_PATH], buf[MAX_LINE], *line;
+    LineReader reader;
+    get_state_path("devices", path, sizeof(path));
     
-    while (true) {
-        drive_count = get_drives(drives, MAX_DRIVES);
-        show_drives(drives, drive_count);
-        
-        printf("\n%s%sOptions:%s\n", BOLD, CYAN, NC);
-        printf("  %s[1-%d]%s Select a drive to eject\n", YELLOW, drive_count, NC);
-        printf("  %s[r]%s Refresh drive list\n", YELLOW, NC);
-        printf("  %s[q]%s Quit\n\n", YELLOW, NC);
-        printf("%s%sYour choice: %s", BOLD, GREEN, NC);
-        
-        if (fgets(input, sizeof(input), stdin) == NULL) break;
+    pthread_mutex_lock(&state_lock);
+    if (!line_reader_open(&reader, path, buf, sizeof(buf))) {
+        pthread_mutex_unlock(&state_lock);
+        return false;
+    }
+    
+    size_t id_len = strlen(identity), key_len = strlen(key);
+    bool found = false;
+    
+    while (!found && (line = line_reader_next(&reader)) != NULL) {
+        if (strncmp(line, identity, id_len) != 0 || line[id_len] != ' ') continue;
+        
+        for (char* tok = strtok(line + id_len, " \n"); tok != NULL; tok = strtok(NULL, " \n")) {
+            if (strncmp(tok, key, key_len) == 0 && tok[key_len] == '=') {
+                *value = atof(tok + key_len + 1);
+                found = true;
+                break;
+            }
+        }
+    }
+    
+    line_reader_close(&reader);
+    pthread_mutex_unlock(&state_lock);
+    return found;
+}
+
+// Write a learned value for a device, creating the state file if needed
+void state_set(const char* identity, const char* key, double value) {
+    char path[MAX_PATH], tmp_path[MAX_PATH + 8], line[MAX_LINE];
+    get_state_path("devices", path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    pthread_mutex_lock(&state_lock);
+    mkdir_parents(path);
+
+    FILE* out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        pthread_mutex_unlock(&state_lock);
+        return;
+    }
+
+    FILE* in = fopen(path, "r");
+    size_t id_len = strlen(identity), key_len = strlen(key);
+    bool written = false;
+
+    while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+        if (strncmp(line, identity, id_len) != 0 || line[id_len] != ' ') {
+            fputs(line, out);
+            continue;
+        }
+
+        fputs(identity, out);
+        for (char* tok = strtok(line + id_len, " \n"); tok != NULL; tok = strtok(NULL, " \n")) {
+            if (strncmp(tok, key, key_len) != 0 || tok[key_len] != '=') fprintf(out, " %s", tok);
+        }
+        fprintf(out, " %s=%.6g\n", key, value);
+        written = true;
+    }
+
+    if (!written) fprintf(out, "%s %s=%.6g\n", identity, key, value);
+    if (in != NULL) fclose(in);
+    fclose(out);
+    rename(tmp_path, path);
+    pthread_mutex_unlock(&state_lock);
+}
+
+// Blend a new measurement into a learned value
+void state_learn(const char* identity, const char* key, double sample) {
+    double old;
+    if (state_get(identity, key, &old)) sample = old * 0.7 + sample * 0.3;
+    state_set(identity, key, sample);
+}
+
+// Event stream: every event is appended to the event log; depending on the
+// mode it is also echoed as text (interactive) or as JSON lines (batch)
+typedef enum { EVENTS_QUIET, EVENTS_TEXT, EVENTS_JSON } EventEcho;
+
+#define EVENT_LOG_MAX_BYTES (1024 * 1024)
+
+static EventEcho event_echo = EVENTS_QUIET;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void json_string(FILE* out, const char* s);
+
+// Append an event to the log, and optionally echo it
+void emit_event(bool echo, const char* drive, const char* type, const char* fmt, va_list args) {
+    char msg[MAX_LINE], path[MAX_PATH], rotated[MAX_PATH + 4], stamp[32];
+    vsnprintf(msg, sizeof(msg), fmt, args);
+
+    struct timespec ts;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    pthread_mutex_lock(&output_lock);
+
+    get_state_path("events.log", path, sizeof(path));
+    mkdir_parents(path);
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_size > EVENT_LOG_MAX_BYTES) {
+        snprintf(rotated, sizeof(rotated), "%s.1", path);
+        rename(path, rotated);
+    }
+    FILE* log = fopen(path, "a");
+    if (log != NULL) {
+        fprintf(log, "%s.%03ld %s %s %s\n", stamp, ts.tv_nsec / 1000000, drive, type, msg);
+        fclose(log);
+    }
+
+    if (event_echo == EVENTS_JSON) {
+        printf("{\"event\":");
+        json_string(stdout, type);
+        printf(",\"drive\":");
+        json_string(stdout, drive);
+        printf(",\"msg\":");
+        json_string(stdout, msg);
+        printf("}\n");
+        fflush(stdout);
+    } else if (event_echo == EVENTS_TEXT && echo) {
+        printf("  %s[%s]%s %s\n", DIM, dev_name(drive), NC, msg);
+        fflush(stdout);
+    }
+
+    pthread_mutex_unlock(&output_lock);
+}
+
+// Log an event the user should see
+void log_event(const char* drive, const char* type, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    emit_event(true, drive, type, fmt, args);
+    va_end(args);
+}
+
+// Log an event the interactive screen already shows another way
+void record_event(const char* drive, const char* type, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    emit_event(false, drive, type, fmt, args);
+    va_end(args);
+}
+
+// Location of ceject's configuration files
+void get_config_path(const char* file, char* path, size_t size) {
+    const char* dir = getenv("CEJECT_CONFIG_DIR");
+    snprintf(path, size, "%s/%s", dir ? dir : "/etc/ceject", file);
+}
+
+// Read an INI-style file ("[section]" headers, "key = value" lines, "#"
+// comments), calling handler for every key
+typedef void (*ConfigHandler)(const char* section, const char* key, const char* value, void* ctx);
+
+// File and line read_config() is at, for handlers reporting an entry
+static __thread const char* config_file;
+static __thread int config_line;
+
+// Report a malformed entry of the file being read, with its line number
+void config_error(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "ceject: %s:%d: ", config_file, config_line);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+bool read_config(const char* file, ConfigHandler handler, void* ctx) {
+    char path[MAX_PATH], line[MAX_LINE], section[64] = "";
+    get_config_path(file, path, sizeof(path));
+
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) return false;
+
+    config_file = file;
+    config_line = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        config_line++;
+        char* start = line;
+        while (isspace((unsigned char)*start)) start++;
+        char* end = start + strlen(start);
+        while (end > start && isspace((unsigned char)end[-1])) *--end = '\0';
+        if (*start == '\0' || *start == '#' || *start == ';') continue;
+
+        if (*start == '[' && end[-1] == ']') {
+            end[-1] = '\0';
+            snprintf(section, sizeof(section), "%s", start + 1);
+            continue;
+        }
+
+        char* eq = strchr(start, '=');
+        if (eq == NULL) continue;
+        char* key_end = eq;
+        while (key_end > start && isspace((unsigned char)key_end[-1])) key_end--;
+        *key_end = '\0';
+        char* value = eq + 1;
+        while (isspace((unsigned char)*value)) value++;
+
+        handler(section, start, value, ctx);
+    }
+
+    fclose(fp);
+    return true;
+}
+
+// System mount and swap tables, reloaded when the kernel signals a change.
+// The mount table lives in table_arena and is replaced wholesale on reload.
+// Truncated if an entry had to be left out, such as a mountpoint too long
+// to hold; plans built from such tables may be missing steps.
+static Arena table_arena;
+static MountEntry* mount_table;
+static int mount_table_count;
+static SwapEntry swap_table[MAX_SWAPS];
+static int swap_table_count;
+static bool system_tables_truncated;
+
+void load_system_tables(void) {
+    arena_reset(&table_arena);
+    system_tables_truncated = false;
+    mount_table = read_mountinfo(&table_arena, &mount_table_count, &system_tables_truncated);
+    swap_table_count = read_swaps(swap_table, MAX_SWAPS, &system_tables_truncated);
+}
+
+// Check whether a block device is a partition
+bool is_partition(const char* name) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "/sys/class/block/%s/partition", name);
+    return path_exists(path);
+}
+
+// Whole disks underneath a block device, following partitions and dm/md slaves
+int get_backing_disks(const char* name, char disks[][64], int count, int max_disks) {
+    char path[MAX_PATH], real[PATH_MAX];
+
+    if (is_partition(name)) {
+        snprintf(path, sizeof(path), "/sys/class/block/%s", name);
+        if (realpath(path, real) == NULL) return count;
+        *strrchr(real, '/') = '\0';
+        return get_backing_disks(strrchr(real, '/') + 1, disks, count, max_disks);
+    }
+
+    char slaves[MAX_HOLDERS][64];
+    snprintf(path, sizeof(path), "/sys/class/block/%s/slaves", name);
+    int slave_count = list_dir(path, slaves, MAX_HOLDERS);
+    for (int i = 0; i < slave_count; i++) {
+        count = get_backing_disks(slaves[i], disks, count, max_disks);
+    }
+
+    if (slave_count == 0 && count < max_disks) {
+        for (int i = 0; i < count; i++) {
+            if (strcmp(disks[i], name) == 0) return count;
+        }
+        strcpy(disks[count++], name);
+    }
+    return count;
+}
+
+// Get root drives (all disks under the root filesystem, through LVM/LUKS/RAID)
+int get_root_drives(char drives[][64], int max_drives) {
+    struct stat st;
+    dev_t root_dev = 0;
+
+    // Filesystems such as btrfs report an anonymous st_dev; prefer the source device
+    for (int i = 0; i < mount_table_count; i++) {
+        if (strcmp(mount_table[i].mountpoint, "/") == 0 &&
+            stat(mount_table[i].source, &st) == 0 && S_ISBLK(st.st_mode)) {
+            root_dev = st.st_rdev;
+        }
+    }
+    if (root_dev == 0) {
+        if (stat("/", &st) != 0) return 0;
+        root_dev = st.st_dev;
+    }
+
+    char path[MAX_PATH], real[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(root_dev), minor(root_dev));
+    if (realpath(path, real) == NULL) return 0;
+    return get_backing_disks(strrchr(real, '/') + 1, drives, 0, max_drives);
+}
+
+// Device numbers of a drive: the disk, its partitions and everything stacked on them
+int get_drive_devices(const char* name, dev_t devs[], int count, int max_devs) {
+    unsigned int major, minor;
+    if (count >= max_devs || !get_block_devnum(name, &major, &minor)) return count;
+    devs[count++] = makedev(major, minor);
+
+    char path[MAX_PATH], check[MAX_PATH + 80];
+    char entries[MAX_PARTITIONS * 4][64];
+    if (!is_partition(name)) {
+        snprintf(path, sizeof(path), "/sys/class/block/%s", name);
+        int entry_count = list_dir(path, entries, MAX_PARTITIONS * 4);
+        for (int i = 0; i < entry_count; i++) {
+            if (snprintf(check, sizeof(check), "%s/%s/partition", path, entries[i]) >= (int)sizeof(check)) continue;
+            if (path_exists(check)) count = get_drive_devices(entries[i], devs, count, max_devs);
+        }
+    }
+
+    snprintf(path, sizeof(path), "/sys/class/block/%s/holders", name);
+    int holder_count = list_dir(path, entries, MAX_HOLDERS);
+    for (int i = 0; i < holder_count; i++) {
+        count = get_drive_devices(entries[i], devs, count, max_devs);
+    }
+    return count;
+}
+
+// Bus the drive hangs off, named like lsblk's TRAN column
+void get_transport(const char* name, char* transport, size_t size) {
+    char path[MAX_PATH], real[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/block/%s", name);
+    transport[0] = '\0';
+    if (realpath(path, real) == NULL) return;
+
+    if (strstr(real, "/usb") != NULL) snprintf(transport, size, "usb");
+    else if (strncmp(name, "nvme", 4) == 0) snprintf(transport, size, "nvme");
+    else if (strstr(real, "/ata") != NULL) snprintf(transport, size, "sata");
+    else if (strncmp(name, "mmcblk", 6) == 0) snprintf(transport, size, "mmc");
+    else if (strncmp(name, "nbd", 3) == 0) snprintf(transport, size, "nbd");
+}
+
+// Speed of the hub a USB port belongs to (port dir: .../usb2/2-0:1.0/usb2-port1)
+double get_hub_speed(const char* port_dir) {
+    char hub[PATH_MAX], path[PATH_MAX + 16], buf[32];
+    snprintf(hub, sizeof(hub), "%s", port_dir);
+
+    for (int up = 0; up < 2; up++) {
+        char* slash = strrchr(hub, '/');
+        if (slash == NULL) return 0;
+        *slash = '\0';
+    }
+    snprintf(path, sizeof(path), "%s/speed", hub);
+    return read_sysfs_attr(path, buf, sizeof(buf)) ? atof(buf) : 0;
+}
+
+// Negotiated USB link speed, storage driver and what the device and its
+// port could do, all read from sysfs
+void get_usb_link(const char* name, DriveInfo* info) {
+    char path[MAX_PATH], real[PATH_MAX], interface[PATH_MAX] = "", check[PATH_MAX + 16], buf[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/block/%s", name);
+    if (realpath(path, real) == NULL) return;
+
+    // Walk up to the USB device node; the directory just below it on the
+    // way is the mass-storage interface
+    while (true) {
+        snprintf(check, sizeof(check), "%s/idVendor", real);
+        if (path_exists(check)) break;
+
+        char* slash = strrchr(real, '/');
+        if (slash == NULL || slash == real) return;
+        strcpy(interface, real);
+        *slash = '\0';
+    }
+
+    snprintf(check, sizeof(check), "%s/speed", real);
+    if (read_sysfs_attr(check, buf, sizeof(buf))) info->link_mbps = atof(buf);
+
+    snprintf(check, sizeof(check), "%s/version", real);
+    if (read_sysfs_attr(check, buf, sizeof(buf))) {
+        char* version = buf;
+        while (isspace((unsigned char)*version)) version++;
+        // A version that does not fit is not one the kernel writes
+        if (snprintf(info->usb_version, sizeof(info->usb_version), "%s", version) >= (int)sizeof(info->usb_version)) {
+            info->usb_version[0] = '\0';
+        }
+        double bcd = atof(version);
+        info->device_mbps = bcd >= 3 ? 5000 : bcd >= 2 ? 480 : 12;
+    }
+
+    snprintf(check, sizeof(check), "%s/driver", interface);
+    ssize_t len = readlink(check, buf, sizeof(buf) - 1);
+    if (len > 0) {
+        buf[len] = '\0';
+        if (snprintf(info->usb_driver, sizeof(info->usb_driver), "%s", dev_name(buf)) >= (int)sizeof(info->usb_driver)) {
+            info->usb_driver[0] = '\0';
+        }
+    }
+
+    // A USB 3 port shows up twice, on a USB 2 and a SuperSpeed root hub,
+    // linked through "peer"; its capability is the faster of the two
+    char port[PATH_MAX];
+    snprintf(check, sizeof(check), "%s/port", real);
+    if (realpath(check, port) != NULL) {
+        info->port_mbps = get_hub_speed(port);
+
+        char peer[PATH_MAX];
+        snprintf(check, sizeof(check), "%s/peer", port);
+        if (realpath(check, peer) != NULL) {
+            double peer_mbps = get_hub_speed(peer);
+            if (peer_mbps > info->port_mbps) info->port_mbps = peer_mbps;
+        }
+    }
+}
+
+// Check whether a USB drive negotiated less than both it and its port support
+bool usb_link_degraded(const DriveInfo* drive) {
+    double expected = drive->device_mbps;
+    if (drive->port_mbps > 0 && drive->port_mbps < expected) expected = drive->port_mbps;
+    return drive->link_mbps > 0 && drive->link_mbps < expected;
+}
+
+// Human-readable USB signalling rate
+void format_link_speed(double mbps, char* buf, size_t size) {
+    if (mbps >= 1000) snprintf(buf, size, "%g Gbps", mbps / 1000);
+    else snprintf(buf, size, "%g Mbps", mbps);
+}
+
+// Human-readable size in lsblk's style ("14.9G")
+void format_size(unsigned long long bytes, char* buf, size_t size) {
+    const char* units = "BKMGTP";
+    double value = (double)bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 5) {
+        value /= 1024;
+        unit++;
+    }
+    if (value == (double)(unsigned long long)value) snprintf(buf, size, "%.0f%c", value, units[unit]);
+    else snprintf(buf, size, "%.1f%c", value, units[unit]);
+}
+
+// Per-device policy from policy.conf, one section per rule:
+//
+//   [backup-disks]
+//   identity = 0x5000c500a1b2c3d4   (exact, or a prefix ending in "*")
+//   vendor = WD                      (likewise vendor, model, transport and
+//   model = My Passport*              label; case-insensitive)
+//   size = 1T-8T                     (also "<64G" or ">1T")
+//   action = preflush                (hide, preflush, media-eject)
+//   dirty_limit = 32M                (preflush: dirty data allowed, default 32M)
+//
+// Every key a rule sets must match, and a drive gets the actions of all the
+// rules it matches. Rules are compiled once, when first needed, into a hash
+// table of exact values and prefixes that maps each to the set of rules
+// (a bit mask) it satisfies, and a sorted table of size intervals. Matching
+// a drive is a fixed number of lookups, however many rules there are.
+#define MAX_POLICY_RULES 64
+#define POLICY_SLOTS 512
+#define POLICY_KEY_MAX 128
+#define POLICY_DIRTY_LIMIT (32ULL * 1024 * 1024)
+
+#define POLICY_HIDE 1u
+#define POLICY_PREFLUSH 2u
+#define POLICY_MEDIA_EJECT 4u
+
+typedef enum { FIELD_IDENTITY, FIELD_VENDOR, FIELD_MODEL, FIELD_TRANSPORT, FIELD_LABEL, FIELD_COUNT } PolicyField;
+
+static const char* policy_fields[FIELD_COUNT] = {"identity", "vendor", "model", "transport", "label"};
+static const char* policy_action_names[] = {"hide", "preflush", "media-eject"};
+
+typedef struct {
+    char name[64];
+    char values[FIELD_COUNT][POLICY_KEY_MAX];
+    unsigned long long min_size;
+    unsigned long long max_size;
+    unsigned long long dirty_limit;
+    unsigned int actions;
+    bool invalid;   // a malformed key; the rule matches nothing
+} PolicyRule;
+
+// One exact value or prefix of a field, and the rules it satisfies
+typedef struct {
+    uint64_t mask;
+    uint32_t hash;
+    unsigned char field;
+    unsigned char prefix;
+    unsigned char len;
+    char key[POLICY_KEY_MAX];
+} PolicySlot;
+
+static PolicyRule policy_rules[MAX_POLICY_RULES];
+static int policy_rule_count;
+static PolicySlot policy_slots[POLICY_SLOTS];
+static uint64_t policy_any[FIELD_COUNT];                  // rules that leave a field open
+static unsigned char policy_prefix_lens[FIELD_COUNT][MAX_POLICY_RULES];
+static int policy_prefix_len_count[FIELD_COUNT];
+static unsigned long long policy_bounds[2 * MAX_POLICY_RULES];
+static uint64_t policy_size_masks[2 * MAX_POLICY_RULES + 1];   // rules matching below each bound
+static int policy_bound_count;
+static pthread_once_t policy_once = PTHREAD_ONCE_INIT;
+
+// Bytes from a size such as "64G", "1.5T" or "512M"
+unsigned long long parse_size(const char* s) {
+    char* end;
+    double value = strtod(s, &end);
+    while (isspace((unsigned char)*end)) end++;
+    static const char units[] = "KMGTP";
+    const char* unit = *end ? strchr(units, toupper((unsigned char)*end)) : NULL;
+    if (unit != NULL) value *= (double)(1ULL << (10 * (unit - units + 1)));
+    return value > 0 ? (unsigned long long)value : 0;
+}
+
+void policy_config_entry(const char* section, const char* key, const char* value, void* ctx) {
+    (void)ctx;
+    if (section[0] == '\0') return;
+
+    if (policy_rule_count == 0 || strcmp(policy_rules[policy_rule_count - 1].name, section) != 0) {
+        if (policy_rule_count >= MAX_POLICY_RULES) return;
+        PolicyRule* rule = &policy_rules[policy_rule_count++];
+        memset(rule, 0, sizeof(*rule));
+        snprintf(rule->name, sizeof(rule->name), "%s", section);
+        rule->max_size = ULLONG_MAX;
+        rule->dirty_limit = POLICY_DIRTY_LIMIT;
+    }
+
+    PolicyRule* rule = &policy_rules[policy_rule_count - 1];
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        if (strcmp(key, policy_fields[f]) == 0) snprintf(rule->values[f], POLICY_KEY_MAX, "%s", value);
+    }
+
+    if (strcmp(key, "size") == 0) {
+        // A bare size has no obvious meaning (exact? at least?); rather than
+        // guess, the rule is dropped
+        const char* dash = strchr(value, '-');
+        if (value[0] == '<') rule->max_size = parse_size(value + 1);
+        else if (value[0] == '>') rule->min_size = parse_size(value + 1);
+        else if (dash != NULL) {
+            rule->min_size = parse_size(value);
+            rule->max_size = parse_size(dash + 1);
+        }
+        if (dash == NULL && value[0] != '<' && value[0] != '>') {
+            config_error("size \"%s\" needs \"<\", \">\" or a range; rule [%s] ignored", value, section);
+            rule->invalid = true;
+        } else if (rule->min_size > rule->max_size || rule->max_size == 0) {
+            config_error("size \"%s\" matches no drive; rule [%s] ignored", value, section);
+            rule->invalid = true;
+        }
+    } else if (strcmp(key, "dirty_limit") == 0) {
+        rule->dirty_limit = parse_size(value);
+        if (rule->dirty_limit == 0) rule->dirty_limit = POLICY_DIRTY_LIMIT;
+    } else if (strcmp(key, "action") == 0) {
+        char list[MAX_LINE], *save;
+        snprintf(list, sizeof(list), "%s", value);
+        for (char* word = strtok_r(list, ", \t", &save); word != NULL; word = strtok_r(NULL, ", \t", &save)) {
+            for (size_t a = 0; a < sizeof(policy_action_names) / sizeof(policy_action_names[0]); a++) {
+                if (strcasecmp(word, policy_action_names[a]) == 0) rule->actions |= 1u << a;
+            }
+        }
+    }
+}
+
+// FNV-1a over the lowercased key, seeded with the field and kind
+uint32_t policy_hash(int field, bool prefix, const char* s, size_t len) {
+    uint32_t hash = 2166136261u ^ (uint32_t)(field * 2 + prefix);
+    for (size_t i = 0; i < len; i++) hash = (hash ^ (unsigned char)tolower((unsigned char)s[i])) * 16777619u;
+    return hash;
+}
+
+// Slot holding a key, or the empty slot where it belongs
+PolicySlot* policy_slot(int field, bool prefix, const char* s, size_t len) {
+    uint32_t hash = policy_hash(field, prefix, s, len);
+    for (uint32_t i = 0; i < POLICY_SLOTS; i++) {
+        PolicySlot* slot = &policy_slots[(hash + i) % POLICY_SLOTS];
+        if (slot->mask == 0) return slot;
+        if (slot->hash == hash && slot->field == field && slot->prefix == prefix && slot->len == len &&
+            strncasecmp(slot->key, s, len) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+void policy_add_key(int field, int rule, const char* value) {
+    size_t len = strlen(value);
+    bool prefix = len > 0 && value[len - 1] == '*';
+    if (prefix) len--;
+
+    PolicySlot* slot = policy_slot(field, prefix, value, len);
+    if (slot == NULL) return;   // cannot happen: there are more slots than keys
+    if (slot->mask == 0) {
+        slot->hash = policy_hash(field, prefix, value, len);
+        slot->field = (unsigned char)field;
+        slot->prefix = prefix;
+        slot->len = (unsigned char)len;
+        memcpy(slot->key, value, len);
+    }
+    slot->mask |= 1ULL << rule;
+
+    // Prefix lookups try each distinct prefix length of the field
+    if (!prefix) return;
+    for (int i = 0; i < policy_prefix_len_count[field]; i++) {
+        if (policy_prefix_lens[field][i] == len) return;
+    }
+    policy_prefix_lens[field][policy_prefix_len_count[field]++] = (unsigned char)len;
+}
+
+int compare_sizes(const void* a, const void* b) {
+    unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Read policy.conf and build the lookup tables
+void load_policy(void) {
+    read_config("policy.conf", policy_config_entry, NULL);
+
+    for (int r = 0; r < policy_rule_count; r++) {
+        PolicyRule* rule = &policy_rules[r];
+        if (rule->invalid) continue;
+        for (int f = 0; f < FIELD_COUNT; f++) {
+            if (rule->values[f][0]) policy_add_key(f, r, rule->values[f]);
+            else policy_any[f] |= 1ULL << r;
+        }
+
+        // Size ranges become half-open intervals [min, max + 1)
+        if (rule->min_size > 0) policy_bounds[policy_bound_count++] = rule->min_size;
+        if (rule->max_size < ULLONG_MAX) policy_bounds[policy_bound_count++] = rule->max_size + 1;
+    }
+
+    qsort(policy_bounds, policy_bound_count, sizeof(policy_bounds[0]), compare_sizes);
+    for (int i = 0; i <= policy_bound_count; i++) {
+        unsigned long long size = i == 0 ? 0 : policy_bounds[i - 1];
+        for (int r = 0; r < policy_rule_count; r++) {
+            if (size >= policy_rules[r].min_size && size <= policy_rules[r].max_size) {
+                policy_size_masks[i] |= 1ULL << r;
+            }
+        }
+    }
+}
+
+// Rules a field value satisfies: its exact entry, any matching prefix, and
+// the rules that do not constrain the field
+uint64_t policy_field_mask(int field, const char* value) {
+    uint64_t mask = policy_any[field];
+    size_t len = strlen(value);
+
+    PolicySlot* slot = policy_slot(field, false, value, len);
+    if (slot != NULL) mask |= slot->mask;
+    for (int i = 0; i < policy_prefix_len_count[field]; i++) {
+        if (policy_prefix_lens[field][i] > len) continue;
+        slot = policy_slot(field, true, value, policy_prefix_lens[field][i]);
+        if (slot != NULL) mask |= slot->mask;
+    }
+    return mask;
+}
+
+// Match a drive against the policy, setting its policy mask and actions
+void policy_match(DriveInfo* info) {
+    pthread_once(&policy_once, load_policy);
+    info->policy_mask = 0;
+    info->policy_actions = 0;
+    if (policy_rule_count == 0) return;
+
+    uint64_t mask = policy_field_mask(FIELD_VENDOR, info->vendor) & policy_field_mask(FIELD_MODEL, info->model) &
+                    policy_field_mask(FIELD_TRANSPORT, info->transport);
+
+    uint64_t labels = policy_any[FIELD_LABEL];
+    for (int i = 0; i < info->label_count; i++) labels |= policy_field_mask(FIELD_LABEL, info->labels[i]);
+    mask &= labels;
+
+    // Upper bound of the interval the size falls in
+    int lo = 0, hi = policy_bound_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (policy_bounds[mid] <= info->size_bytes) lo = mid + 1;
+        else hi = mid;
+    }
+    mask &= policy_size_masks[lo];
+
+    // The identity costs a few sysfs reads; only look it up if it matters
+    if (mask & ~policy_any[FIELD_IDENTITY]) {
+        char identity[128];
+        get_drive_identity(dev_name(info->path), identity, sizeof(identity));
+        mask &= policy_field_mask(FIELD_IDENTITY, identity);
+    }
+
+    info->policy_mask = mask;
+    for (int r = 0; r < policy_rule_count; r++) {
+        if (mask & (1ULL << r)) info->policy_actions |= policy_rules[r].actions;
+    }
+}
+
+// First rule in a policy mask that has one of the given actions (any, if 0)
+const PolicyRule* policy_rule(uint64_t mask, unsigned int actions) {
+    for (int r = 0; r < policy_rule_count; r++) {
+        if ((mask & (1ULL << r)) && (actions == 0 || (policy_rules[r].actions & actions))) return &policy_rules[r];
+    }
+    return NULL;
+}
+
+// Comma-separated action names
+void format_policy_actions(unsigned int actions, char* buf, size_t size) {
+    buf[0] = '\0';
+    for (size_t a = 0; a < sizeof(policy_action_names) / sizeof(policy_action_names[0]); a++) {
+        if (!(actions & (1u << a))) continue;
+        size_t len = strlen(buf);
+        snprintf(buf + len, size - len, "%s%s", len ? ", " : "", policy_action_names[a]);
+    }
+}
+
+// Write a sysfs attribute
+bool write_sysfs_attr(const char* path, const char* value) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+    close(fd);
+    return ok;
+}
+
+// Keep a preflush drive's dirty data small while it is in use, so writeback
+// keeps up and an eject has little left to flush: cap the dirty bytes of
+// its backing device, and of dm devices stacked on it (each has its own),
+// even below the system-wide threshold. Writing the same values again is
+// harmless, so this is simply reapplied whenever the drive changes.
+void preflush_drive(const DriveInfo* drive) {
+    const PolicyRule* rule = policy_rule(drive->policy_mask, POLICY_PREFLUSH);
+    if (rule == NULL) return;
+
+    dev_t devs[MAX_PLAN_NODES];
+    int dev_count = get_drive_devices(dev_name(drive->path), devs, 0, MAX_PLAN_NODES);
+    char limit[32], current[32];
+    snprintf(limit, sizeof(limit), "%llu", rule->dirty_limit);
+
+    for (int i = 0; i < dev_count; i++) {
+        char bdi[64], attr[MAX_PATH], strict[MAX_PATH];
+        snprintf(bdi, sizeof(bdi), "/sys/class/bdi/%u:%u", major(devs[i]), minor(devs[i]));
+        if (!path_exists(bdi)) continue;   // partitions share the disk's
+
+        // max_bytes is new in 6.2; older kernels only take a percentage
+        snprintf(attr, sizeof(attr), "%s/max_bytes", bdi);
+        bool bytes = path_exists(attr);
+        if (!bytes) snprintf(attr, sizeof(attr), "%s/max_ratio", bdi);
+        const char* value = bytes ? limit : "1";
+
+        // The kernel stores the byte limit rounded down to whole pages
+        snprintf(strict, sizeof(strict), "%s/strict_limit", bdi);
+        char applied[8] = "";
+        if (bytes) read_sysfs_attr(strict, applied, sizeof(applied));
+        if (read_sysfs_attr(attr, current, sizeof(current)) && strtoull(current, NULL, 10) <= strtoull(value, NULL, 10) &&
+            (!bytes || strcmp(applied, "1") == 0)) {
+            continue;
+        }
+
+        if (write_sysfs_attr(attr, value) && (write_sysfs_attr(strict, "1") || !bytes)) {
+            record_event(drive->path, "policy", "%s: dirty data on %u:%u capped at %s%s", rule->name,
+                         major(devs[i]), minor(devs[i]), bytes ? limit : "1%", bytes ? " bytes" : "");
+        } else {
+            record_event(drive->path, "policy", "%s: cannot cap dirty data on %u:%u: %s", rule->name,
+                         major(devs[i]), minor(devs[i]), strerror(errno));
+        }
+    }
+}
+
+// Get drive information
+void get_drive_info(const char* drive, DriveInfo* info) {
+    const char* name = dev_name(drive);
+    char path[MAX_PATH], buf[64];
+
+    // Initialize
+    memset(info, 0, sizeof(*info));
+    snprintf(info->path, sizeof(info->path), "%s", drive);
+
+    // Get size, model, vendor, transport
+    snprintf(path, sizeof(path), "/sys/block/%s/size", name);
+    if (read_sysfs_attr(path, buf, sizeof(buf))) {
+        info->size_bytes = strtoull(buf, NULL, 10) * 512;
+        format_size(info->size_bytes, info->size, sizeof(info->size));
+    }
+    snprintf(path, sizeof(path), "/sys/block/%s/device/model", name);
+    read_sysfs_attr(path, info->model, sizeof(info->model));
+    snprintf(path, sizeof(path), "/sys/block/%s/device/vendor", name);
+    read_sysfs_attr(path, info->vendor, sizeof(info->vendor));
+    if (strncmp(info->vendor, "0x", 2) == 0) info->vendor[0] = '\0';   // PCI id, not a name
+    get_transport(name, info->transport, sizeof(info->transport));
+    if (strcmp(info->transport, "usb") == 0) get_usb_link(name, info);
+
+    // Get mount points of the disk, its partitions and stacked devices
+    dev_t devs[MAX_PLAN_NODES];
+    int dev_count = get_drive_devices(name, devs, 0, MAX_PLAN_NODES);
+
+    // Filesystem labels as recorded by udev
+    for (int i = 0; i < dev_count && info->label_count < 8; i++) {
+        char buf[MAX_LINE], *line;
+        LineReader reader;
+        snprintf(path, sizeof(path), "/run/udev/data/b%u:%u", major(devs[i]), minor(devs[i]));
+        if (!line_reader_open(&reader, path, buf, sizeof(buf))) continue;
+        while ((line = line_reader_next(&reader)) != NULL && info->label_count < 8) {
+            if (strncmp(line, "E:ID_FS_LABEL=", 14) != 0) continue;
+            snprintf(info->labels[info->label_count++], 64, "%s", line + 14);
+        }
+        line_reader_close(&reader);
+    }
+
+    for (int i = 0; i < mount_table_count && info->mount_count < 8; i++) {
+        MountEntry* m = &mount_table[i];
+        for (int j = 0; j < dev_count; j++) {
+            if (major(devs[j]) == m->major && minor(devs[j]) == m->minor) {
+                snprintf(info->mountpoints[info->mount_count++], MAX_PATH, "%s", m->mountpoint);
+                break;
+            }
+        }
+    }
+
+    policy_match(info);
+}
+
+// Check whether a /sys/block entry is a physical disk ceject may eject
+bool is_external_candidate(const char* name, char roots[][64], int root_count) {
+    char path[MAX_PATH], type[8];
+
+    for (int i = 0; i < root_count; i++) {
+        if (strcmp(roots[i], name) == 0) return false;
+    }
+
+    // Network block devices count while connected: the kernel exposes the
+    // pid of the connection's owner only then
+    if (strncmp(name, "nbd", 3) == 0) {
+        snprintf(path, sizeof(path), "/sys/block/%s/pid", name);
+        return path_exists(path);
+    }
+
+    // Virtual devices (loop, dm, md, zram) have no backing hardware
+    snprintf(path, sizeof(path), "/sys/block/%s/device", name);
+    if (!path_exists(path)) return false;
+
+    // Optical drives (SCSI type 5) are not disks
+    snprintf(path, sizeof(path), "/sys/block/%s/device/type", name);
+    return !read_sysfs_attr(path, type, sizeof(type)) || strcmp(type, "5") != 0;
+}
+
+// Sort device names the way lsblk lists them
+int compare_names(const void* a, const void* b) {
+    return strcmp((const char*)a, (const char*)b);
+}
+
+// Get all external drives the policy does not hide
+int get_drives(DriveInfo drives[], int max_drives) {
+    char roots[8][64];
+    char names[128][64];
+
+    load_system_tables();
+    int root_count = get_root_drives(roots, 8);
+    int name_count = list_dir("/sys/block", names, 128);
+    qsort(names, name_count, sizeof(names[0]), compare_names);
+
+    int count = 0;
+    for (int i = 0; i < name_count && count < max_drives; i++) {
+        if (!is_external_candidate(names[i], roots, root_count)) continue;
+
+        char drive[MAX_PATH];
+        snprintf(drive, sizeof(drive), "/dev/%s", names[i]);
+        get_drive_info(drive, &drives[count]);
+        if (!(drives[count].policy_actions & POLICY_HIDE)) count++;
+    }
+
+    return count;
+}
+
+// Build a display name from vendor and model
+void get_friendly_name(const DriveInfo* drive, char* name, size_t size) {
+    if (strlen(drive->vendor) > 0 || strlen(drive->model) > 0) {
+        snprintf(name, size, "%s%s%s", 
+                strlen(drive->vendor) > 0 ? drive->vendor : "",
+                strlen(drive->vendor) > 0 ? " " : "",
+                strlen(drive->model) > 0 ? drive->model : "Unknown Drive");
+    } else {
+        snprintf(name, size, "Unknown Drive");
+    }
+}
+
+// Teardown planning context
+typedef struct {
+    EjectPlan* plan;
+    const DriveInfo* drive;
+    char flush_bdi[MAX_PLAN_NODES][64];
+    int flush_node[MAX_PLAN_NODES];
+    int flush_count;
+} PlanCtx;
+
+// Append a node to the plan. A step whose target or device name does not
+// fit is left out, like one past MAX_PLAN_NODES, and marks the plan truncated.
+int plan_add(EjectPlan* plan, StepType type, const char* target, const char* device) {
+    if (plan->node_count >= MAX_PLAN_NODES) {
+        plan->truncated = true;
+        return -1;
+    }
+
+    PlanNode* node = &plan->nodes[plan->node_count];
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    if (snprintf(node->target, sizeof(node->target), "%s", target) >= (int)sizeof(node->target) ||
+        snprintf(node->device, sizeof(node->device), "%s", device) >= (int)sizeof(node->device)) {
+        plan->truncated = true;
+        return -1;
+    }
+    return plan->node_count++;
+}
+
+// Make node wait for dep
+void plan_dep(EjectPlan* plan, int node, int dep) {
+    if (node < 0 || dep < 0 || node == dep) return;
+
+    PlanNode* n = &plan->nodes[node];
+    for (int i = 0; i < n->dep_count; i++) {
+        if (n->deps[i] == dep) return;
+    }
+    if (n->dep_count >= MAX_PLAN_DEPS) {
+        plan->truncated = true;
+        return;
+    }
+    n->deps[n->dep_count++] = dep;
+}
+
+// Check whether path lies strictly below dir
+bool path_is_below(const char* path, const char* dir) {
+    size_t len = strlen(dir);
+    if (strcmp(dir, "/") == 0) return path[1] != '\0';
+    return strncmp(path, dir, len) == 0 && path[len] == '/';
+}
+
+// Flush node for a bdi, created on first use
+int plan_flush_node(PlanCtx* ctx, const char* bdi_name) {
+    for (int i = 0; i < ctx->flush_count; i++) {
+        if (strcmp(ctx->flush_bdi[i], bdi_name) == 0) return ctx->flush_node[i];
+    }
+
+    char target[MAX_PATH];
+    snprintf(target, sizeof(target), "/dev/%s", bdi_name);
+    int node = plan_add(ctx->plan, STEP_FLUSH, target, bdi_name);
+    if (node < 0 || ctx->flush_count >= MAX_PLAN_NODES) return node;
+
+    unsigned int major, minor;
+    if (get_block_devnum(bdi_name, &major, &minor)) {
+        BdiStats stats;
+        read_bdi_stats(major, minor, &stats);
+        ctx->plan->nodes[node].bytes = stats.dirty + stats.writeback;
+        // Exact only if the counts of all the flushes are
+        ctx->plan->dirty_exact = stats.exact && (ctx->plan->dirty_exact || !ctx->plan->has_flush);
+        ctx->plan->has_flush = true;
+    }
+
+    strcpy(ctx->flush_bdi[ctx->flush_count], bdi_name);
+    ctx->flush_node[ctx->flush_count++] = node;
+    return node;
+}
+
+// Plan the release of a block device and everything stacked on it.
+// Nodes that must finish before the device is free are added to outs.
+void plan_block(PlanCtx* ctx, const char* name, const char* bdi_name, int* outs, int* out_count) {
+    EjectPlan* plan = ctx->plan;
+    unsigned int major, minor;
+    if (!get_block_devnum(name, &major, &minor)) return;
+
+    // Holders (dm, md, loop) are released before the device beneath them
+    char path[MAX_PATH];
+    char holders[MAX_HOLDERS][64];
+    snprintf(path, sizeof(path), "/sys/class/block/%s/holders", name);
+    int holder_count = list_dir(path, holders, MAX_HOLDERS);
+
+    for (int i = 0; i < holder_count; i++) {
+        int sub[MAX_PLAN_DEPS];
+        int sub_count = 0;
+        plan_block(ctx, holders[i], holders[i], sub, &sub_count);
+
+        StepType type = STEP_RELEASE;
+        char target[MAX_PATH];
+        if (snprintf(target, sizeof(target), "/dev/%s", holders[i]) >= (int)sizeof(target)) continue;
+
+        if (strncmp(holders[i], "dm-", 3) == 0) {
+            char dm_name[128];
+            if (snprintf(path, sizeof(path), "/sys/class/block/%s/dm/name", holders[i]) < (int)sizeof(path) &&
+                read_sysfs_attr(path, dm_name, sizeof(dm_name))) {
+                snprintf(target, sizeof(target), "/dev/mapper/%s", dm_name);
+            }
+            type = STEP_DM_REMOVE;
+        } else if (strncmp(holders[i], "md", 2) == 0) {
+            type = STEP_MD_STOP;
+        } else if (strncmp(holders[i], "loop", 4) == 0) {
+            type = STEP_LOOP_DETACH;
+        }
+
+        int release = plan_add(plan, type, target, holders[i]);
+        for (int j = 0; j < sub_count; j++) plan_dep(plan, release, sub[j]);
+        if (release >= 0 && *out_count < MAX_PLAN_DEPS) outs[(*out_count)++] = release;
+    }
+
+    // Every mount of the device, including bind mounts
+    for (int i = 0; i < mount_table_count; i++) {
+        MountEntry* m = &mount_table[i];
+        if (m->major != major || m->minor != minor) continue;
+
+        int flush = plan_flush_node(ctx, bdi_name);
+        int unmount = plan_add(plan, STEP_UNMOUNT, m->mountpoint, name);
+        plan_dep(plan, unmount, flush);
+        if (unmount >= 0 && *out_count < MAX_PLAN_DEPS) outs[(*out_count)++] = unmount;
+
+        // A FUSE daemon keeps writing after its unmount returns; the device
+        // is only released once the daemon has exited
+        if (strncmp(m->fstype, "fuse", 4) == 0) {
+            int wait = -1;
+            for (int j = 0; j < plan->node_count && wait < 0; j++) {
+                if (plan->nodes[j].type == STEP_FUSE_WAIT && strcmp(plan->nodes[j].device, name) == 0) wait = j;
+            }
+            if (wait < 0) {
+                char target[MAX_PATH];
+                snprintf(target, sizeof(target), "/dev/%s", name);
+                wait = plan_add(plan, STEP_FUSE_WAIT, target, name);
+                if (wait >= 0 && *out_count < MAX_PLAN_DEPS) outs[(*out_count)++] = wait;
+            }
+            plan_dep(plan, wait, unmount);
+        }
+    }
+
+    // Swap directly on the device
+    for (int i = 0; i < swap_table_count; i++) {
+        SwapEntry* sw = &swap_table[i];
+        if (sw->is_file || major(sw->dev) != major || minor(sw->dev) != minor) continue;
+
+        int swapoff = plan_add(plan, STEP_SWAPOFF, sw->path, name);
+        if (swapoff >= 0) plan->nodes[swapoff].bytes = sw->used_kb * 1024;
+        if (swapoff >= 0 && *out_count < MAX_PLAN_DEPS) outs[(*out_count)++] = swapoff;
+    }
+}
+
+// Make every unmount of the given device wait for dep
+void plan_before_unmounts(PlanCtx* ctx, dev_t dev, int dep) {
+    EjectPlan* plan = ctx->plan;
+    for (int i = 0; i < plan->node_count; i++) {
+        PlanNode* n = &plan->nodes[i];
+        unsigned int major, minor;
+        if (n->type != STEP_UNMOUNT || !get_block_devnum(n->device, &major, &minor)) continue;
+        if (major(dev) == major && minor(dev) == minor) plan_dep(plan, i, dep);
+    }
+}
+
+// Check whether a device number belongs to a node in the plan
+bool plan_owns_dev(const EjectPlan* plan, dev_t dev) {
+    for (int i = 0; i < plan->node_count; i++) {
+        unsigned int major, minor;
+        if (plan->nodes[i].type != STEP_UNMOUNT) continue;
+        if (!get_block_devnum(plan->nodes[i].device, &major, &minor)) continue;
+        if (major(dev) == major && minor(dev) == minor) return true;
+    }
+    return false;
+}
+
+// Estimate the duration of each step from dirty bytes and learned rates
+void plan_estimate(EjectPlan* plan, const DriveInfo* drive) {
+    double default_bw = 30.0 * 1024 * 1024;
+    if (strcmp(drive->transport, "sata") == 0) default_bw = 150.0 * 1024 * 1024;
+    else if (strcmp(drive->transport, "nvme") == 0) default_bw = 800.0 * 1024 * 1024;
+
+    double write_bw = default_bw, unmount_ms = 30, fuse_exit_ms = 300, poweroff_ms = 800;
+    // A probed read speed bounds what the link can write until a flush
+    // has been timed
+    if (!state_get(plan->identity, "write_bw", &write_bw)) {
+        double read_bw;
+        if (state_get(plan->identity, "read_bw", &read_bw) && read_bw < write_bw) write_bw = read_bw;
+    }
+    state_get(plan->identity, "unmount_ms", &unmount_ms);
+    state_get(plan->identity, "fuse_exit_ms", &fuse_exit_ms);
+    state_get(plan->identity, "poweroff_ms", &poweroff_ms);
+
+    for (int i = 0; i < plan->node_count; i++) {
+        PlanNode* n = &plan->nodes[i];
+        double bw = write_bw;
+
+        // The kernel's own estimate is the freshest measure of the link
+        if (n->type == STEP_FLUSH) {
+            unsigned int major, minor;
+            BdiStats stats;
+            if (get_block_devnum(n->device, &major, &minor)) {
+                read_bdi_stats(major, minor, &stats);
+                if (stats.write_bw > 0) bw = (double)stats.write_bw;
+            }
+        }
+
+        switch (n->type) {
+            case STEP_FLUSH:       n->est_ms = 5 + n->bytes / bw * 1000; break;
+            case STEP_SWAPOFF:     n->est_ms = 20 + n->bytes / bw * 1000; break;
+            case STEP_UNMOUNT:     n->est_ms = unmount_ms; break;
+            case STEP_FUSE_WAIT:   n->est_ms = fuse_exit_ms; break;
+            case STEP_LOOP_DETACH: n->est_ms = 10; break;
+            case STEP_DM_REMOVE:   n->est_ms = 15; break;
+            case STEP_MD_STOP:     n->est_ms = 50; break;
+            case STEP_RELEASE:     n->est_ms = 50; break;
+            case STEP_POWER_OFF:   n->est_ms = poweroff_ms; break;
+            case STEP_NBD_DISCONNECT: n->est_ms = 20; break;
+            case STEP_MEDIA_EJECT: n->est_ms = 300; break;
+        }
+    }
+}
+
+// Earliest finish time of a node assuming independent steps run in parallel
+double plan_finish(EjectPlan* plan, int node, int depth) {
+    PlanNode* n = &plan->nodes[node];
+    if (n->finish_ms > 0 || depth > MAX_PLAN_NODES) return n->finish_ms;
+
+    double start = 0;
+    for (int i = 0; i < n->dep_count; i++) {
+        double f = plan_finish(plan, n->deps[i], depth + 1);
+        if (f > start) start = f;
+    }
+    n->finish_ms = start + n->est_ms;
+    return n->finish_ms;
+}
+
+// Mark the longest chain of steps ending at node
+void plan_mark_critical(EjectPlan* plan, int node) {
+    plan->critical_count = 0;
+    while (node >= 0 && !plan->nodes[node].critical) {
+        PlanNode* n = &plan->nodes[node];
+        n->critical = true;
+        plan->critical_path[plan->critical_count++] = node;
+
+        int next = -1;
+        double best = -1;
+        for (int i = 0; i < n->dep_count; i++) {
+            if (plan->nodes[n->deps[i]].finish_ms > best) {
+                best = plan->nodes[n->deps[i]].finish_ms;
+                next = n->deps[i];
+            }
+        }
+        node = next;
+    }
+    
+    // Walked backwards from power-off; store in execution order
+    for (int i = 0, j = plan->critical_count - 1; i < j; i++, j--) {
+        int tmp = plan->critical_path[i];
+        plan->critical_path[i] = plan->critical_path[j];
+        plan->critical_path[j] = tmp;
+    }
+}
+
+// Build the teardown DAG for a drive: flushes, swapoff, unmounts,
+// dm/md/loop releases and finally power-off. Uses the system tables
+// loaded by the last get_drives() or load_system_tables().
+void build_plan(const DriveInfo* drive, EjectPlan* plan) {
+    PlanCtx ctx;
+    const char* name = dev_name(drive->path);
+
+    memset(plan, 0, sizeof(*plan));
+    snprintf(plan->drive, sizeof(plan->drive), "%s", drive->path);
+    get_drive_identity(name, plan->identity, sizeof(plan->identity));
+    plan->truncated = system_tables_truncated;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.plan = plan;
+    ctx.drive = drive;
+
+    // The disk itself and each of its partitions
+    int outs[MAX_PLAN_DEPS];
+    int out_count = 0;
+    plan_block(&ctx, name, name, outs, &out_count);
+
+    char path[MAX_PATH], check[MAX_PATH + 80];
+    char entries[MAX_PARTITIONS * 4][64];
+    int entry_count = 0;
+    if (snprintf(path, sizeof(path), "/sys/block/%s", name) < (int)sizeof(path)) {
+        entry_count = list_dir(path, entries, MAX_PARTITIONS * 4);
+    }
+
+    for (int i = 0; i < entry_count; i++) {
+        if (snprintf(check, sizeof(check), "%s/%s/partition", path, entries[i]) >= (int)sizeof(check)) continue;
+        if (path_exists(check)) plan_block(&ctx, entries[i], name, outs, &out_count);
+    }
+
+    // Loop devices backed by files on the drive's filesystems
+    char loops[64][64];
+    int loop_count = list_dir("/sys/block", loops, 64);
+    for (int i = 0; i < loop_count; i++) {
+        if (strncmp(loops[i], "loop", 4) != 0) continue;
+
+        char backing[MAX_PATH], target[MAX_PATH];
+        if (snprintf(check, sizeof(check), "/sys/block/%s/loop/backing_file", loops[i]) >= (int)sizeof(check) ||
+            snprintf(target, sizeof(target), "/dev/%s", loops[i]) >= (int)sizeof(target)) continue;
+        struct stat st;
+        if (!read_sysfs_attr(check, backing, sizeof(backing)) || stat(backing, &st) != 0) continue;
+        if (!plan_owns_dev(plan, st.st_dev)) continue;
+
+        int sub[MAX_PLAN_DEPS];
+        int sub_count = 0;
+        plan_block(&ctx, loops[i], loops[i], sub, &sub_count);
+
+        int detach = plan_add(plan, STEP_LOOP_DETACH, target, loops[i]);
+        for (int j = 0; j < sub_count; j++) plan_dep(plan, detach, sub[j]);
+        plan_before_unmounts(&ctx, st.st_dev, detach);
+    }
+
+    // Swap files living on the drive
+    for (int i = 0; i < swap_table_count; i++) {
+        SwapEntry* sw = &swap_table[i];
+        if (!sw->is_file || !plan_owns_dev(plan, sw->dev)) continue;
+
+        int swapoff = plan_add(plan, STEP_SWAPOFF, sw->path, name);
+        if (swapoff >= 0) plan->nodes[swapoff].bytes = sw->used_kb * 1024;
+        plan_before_unmounts(&ctx, sw->dev, swapoff);
+    }
+
+    // Foreign mounts stacked below the drive's mountpoints (container
+    // binds, tmpfs overlays) have to go first
+    int planned = plan->node_count;
+    for (int i = 0; i < mount_table_count; i++) {
+        MountEntry* m = &mount_table[i];
+        bool below = false, known = false;
+
+        for (int j = 0; j < plan->node_count; j++) {
+            PlanNode* n = &plan->nodes[j];
+            if (n->type != STEP_UNMOUNT) continue;
+            if (strcmp(n->target, m->mountpoint) == 0) known = true;
+            else if (j < planned && path_is_below(m->mountpoint, n->target)) below = true;
+        }
+        // A foreign mount carries no device name: it is not the drive's,
+        // so plan_owns_dev must not match it
+        if (below && !known) plan_add(plan, STEP_UNMOUNT, m->mountpoint, "");
+    }
+
+    // Nested mountpoints unmount innermost first
+    for (int i = 0; i < plan->node_count; i++) {
+        if (plan->nodes[i].type != STEP_UNMOUNT) continue;
+        for (int j = 0; j < plan->node_count; j++) {
+            if (plan->nodes[j].type == STEP_UNMOUNT &&
+                path_is_below(plan->nodes[j].target, plan->nodes[i].target)) {
+                plan_dep(plan, i, j);
+            }
+        }
+    }
+
+    // Power-off waits for every step that nothing else waits for
+    bool has_dependent[MAX_PLAN_NODES] = {false};
+    for (int i = 0; i < plan->node_count; i++) {
+        for (int j = 0; j < plan->nodes[i].dep_count; j++) {
+            has_dependent[plan->nodes[i].deps[j]] = true;
+        }
+    }
+
+    // Network block devices are disconnected rather than powered off, and
+    // card readers the policy names only give up their card
+    int sinks = plan->node_count;
+    StepType detach = strcmp(drive->transport, "nbd") == 0 ? STEP_NBD_DISCONNECT :
+                      drive->policy_actions & POLICY_MEDIA_EJECT ? STEP_MEDIA_EJECT : STEP_POWER_OFF;
+    int power_off = plan_add(plan, detach, drive->path, name);
+    for (int i = 0; i < sinks; i++) {
+        if (!has_dependent[i]) plan_dep(plan, power_off, i);
+    }
+
+    plan_estimate(plan, drive);
+    if (power_off >= 0) {
+        plan->total_ms = plan_finish(plan, power_off, 0);
+        plan_mark_critical(plan, power_off);
+    }
+}
+
+// Human-readable byte count
+void format_bytes(unsigned long long bytes, char* buf, size_t size) {
+    const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double value = (double)bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    snprintf(buf, size, unit == 0 ? "%.0f %s" : "%.1f %s", value, units[unit]);
+}
+
+// Human-readable duration
+void format_ms(double ms, char* buf, size_t size) {
+    if (ms >= 1000) snprintf(buf, size, "%.2f s", ms / 1000);
+    else snprintf(buf, size, "%.0f ms", ms);
+}
+
+// Write a JSON string literal
+void json_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+// Display an eject plan
+void show_plan(const EjectPlan* plan, const DriveInfo* drive) {
+    char buf[64], est[32], friendly_name[256];
+    get_friendly_name(drive, friendly_name, sizeof(friendly_name));
+
+    printf("%s%s%s Eject plan for %s%s %s(%s, %s)%s\n", BOLD, MAGENTA, ICON_EJECT, plan->drive, NC,
+           DIM, friendly_name, drive->size, NC);
+    printf("%s" RULE "%s\n", DIM, NC);
+
+    for (int i = 0; i < plan->node_count; i++) {
+        const PlanNode* n = &plan->nodes[i];
+        char after[128] = "";
+
+        for (int j = 0; j < n->dep_count; j++) {
+            size_t len = strlen(after);
+            snprintf(after + len, sizeof(after) - len, "%s%d", j ? "," : "after ", n->deps[j] + 1);
+        }
+
+        format_ms(n->est_ms, est, sizeof(est));
+        printf("%s %s[%2d]%s %-12s %s", n->critical ? YELLOW ICON_CRITICAL NC : " ",
+               n->critical ? BOLD YELLOW : BOLD, i + 1, NC, step_names[n->type], n->target);
+
+        if (n->type == STEP_FLUSH || (n->type == STEP_SWAPOFF && n->bytes > 0)) {
+            format_bytes(n->bytes, buf, sizeof(buf));
+            printf(" %s(%s%s %s)%s", CYAN, plan->dirty_exact || n->type == STEP_SWAPOFF ? "" : AT_MOST,
+                   buf, n->type == STEP_FLUSH ? "dirty" : "in use", NC);
+        }
+        printf("  %s~%s%s%s%s\n", DIM, est, after[0] ? "  " : "", after, NC);
+    }
+
+    printf("%s" RULE "%s\n", DIM, NC);
+    printf("%sCritical path:%s ", BOLD, NC);
+
+    for (int i = 0; i < plan->critical_count; i++) {
+        printf("%s%d", i ? " " ARROW " " : "", plan->critical_path[i] + 1);
+    }
+    format_ms(plan->total_ms, est, sizeof(est));
+    printf("  %s(~%s)%s\n", YELLOW, est, NC);
+
+    if (plan->has_flush && !plan->dirty_exact) {
+        printf("%s%s Per-device dirty counters unavailable (debugfs); using system-wide totals.%s\n",
+               DIM, ICON_WARNING, NC);
+    }
+    if (plan->truncated) {
+        printf("%s%s Plan truncated: some steps or mounts did not fit.%s\n", YELLOW, ICON_WARNING, NC);
+    }
+    printf("\n");
+}
+
+// Write an eject plan as a JSON object
+void show_plan_json(const EjectPlan* plan, FILE* out) {
+    fprintf(out, "{\"drive\":");
+    json_string(out, plan->drive);
+    fprintf(out, ",\"identity\":");
+    json_string(out, plan->identity);
+    fprintf(out, ",\"est_total_ms\":%.1f,\"dirty_exact\":%s,\"truncated\":%s,\"steps\":[",
+            plan->total_ms, plan->dirty_exact ? "true" : "false", plan->truncated ? "true" : "false");
+
+    for (int i = 0; i < plan->node_count; i++) {
+        const PlanNode* n = &plan->nodes[i];
+        fprintf(out, "%s{\"id\":%d,\"op\":\"%s\",\"target\":", i ? "," : "", i + 1, step_names[n->type]);
+        json_string(out, n->target);
+        fprintf(out, ",\"device\":");
+        json_string(out, n->device);
+        fprintf(out, ",\"bytes\":%llu,\"est_ms\":%.1f,\"finish_ms\":%.1f,\"critical\":%s,\"after\":[",
+                n->bytes, n->est_ms, n->finish_ms, n->critical ? "true" : "false");
+        for (int j = 0; j < n->dep_count; j++) fprintf(out, "%s%d", j ? "," : "", n->deps[j] + 1);
+        fprintf(out, "]}");
+    }
+
+    fprintf(out, "],\"critical_path\":[");
+    for (int i = 0; i < plan->critical_count; i++) {
+        fprintf(out, "%s%d", i ? "," : "", plan->critical_path[i] + 1);
+    }
+    fprintf(out, "]}");
+}
+
+// Storage backends: where ceject discovers drives, plans their teardown and
+// carries out steps. The native backend is the real system; the simulated
+// one stands in for scheduler testing (CEJECT_BACKEND=sim, --bench-sim).
+typedef struct {
+    const char* name;
+    int (*get_drives)(DriveInfo drives[], int max_drives);
+    void (*get_drive_info)(const char* drive, DriveInfo* info);
+    void (*build_plan)(const DriveInfo* drive, EjectPlan* plan);
+    int (*run_step)(const EjectPlan* plan, int node);
+} Backend;
+
+double now_ms(void);
+int run_step(const EjectPlan* plan, int node);
+
+static const Backend native_backend = {"native", get_drives, get_drive_info, build_plan, run_step};
+static const Backend* backend = &native_backend;
+
+#ifndef CEJECT_MINI
+
+// Simulated drives, configured from CEJECT_SIM ("drives=8,partitions=2,
+// dirty_mb=64,bw_mb=40,unmount_ms=30,poweroff_ms=800,fail=0.02,seed=1").
+// Per-drive values vary around these means.
+typedef struct {
+    int drives;
+    int partitions;
+    double dirty_mb;
+    double bw_mb;
+    double unmount_ms;
+    double poweroff_ms;
+    double fail;
+    unsigned int seed;
+} SimConfig;
+
+typedef struct {
+    unsigned long long dirty;
+    double bw;
+    double unmount_ms;
+    double poweroff_ms;
+} SimDrive;
+
+static SimConfig sim_config = {8, 2, 64, 40, 30, 800, 0, 1};
+static SimDrive* sim_drives;
+
+// Read CEJECT_SIM and lay out the simulated drives
+void sim_init(int drives) {
+    const char* env = getenv("CEJECT_SIM");
+    char spec[MAX_LINE];
+    snprintf(spec, sizeof(spec), "%s", env ? env : "");
+
+    for (char* tok = strtok(spec, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        char* eq = strchr(tok, '=');
+        if (eq == NULL) continue;
+        *eq = '\0';
+        double value = atof(eq + 1);
+
+        if (strcmp(tok, "drives") == 0) sim_config.drives = (int)value;
+        else if (strcmp(tok, "partitions") == 0) sim_config.partitions = (int)value;
+        else if (strcmp(tok, "dirty_mb") == 0) sim_config.dirty_mb = value;
+        else if (strcmp(tok, "bw_mb") == 0) sim_config.bw_mb = value;
+        else if (strcmp(tok, "unmount_ms") == 0) sim_config.unmount_ms = value;
+        else if (strcmp(tok, "poweroff_ms") == 0) sim_config.poweroff_ms = value;
+        else if (strcmp(tok, "fail") == 0) sim_config.fail = value;
+        else if (strcmp(tok, "seed") == 0) sim_config.seed = (unsigned int)value;
+    }
+    if (drives > 0) sim_config.drives = drives;
+    if (sim_config.partitions < 1) sim_config.partitions = 1;
+    if (sim_config.partitions > MAX_PARTITIONS) sim_config.partitions = MAX_PARTITIONS;
+    if (sim_config.bw_mb <= 0) sim_config.bw_mb = 1;
+
+    free(sim_drives);
+    sim_drives = calloc(sim_config.drives, sizeof(SimDrive));
+    if (sim_drives == NULL) {
+        sim_config.drives = 0;
+        return;
+    }
+
+    unsigned int seed = sim_config.seed;
+    for (int i = 0; i < sim_config.drives; i++) {
+        SimDrive* d = &sim_drives[i];
+        d->dirty = (unsigned long long)(sim_config.dirty_mb * 1024 * 1024 * 2 * rand_r(&seed) / RAND_MAX);
+        d->bw = sim_config.bw_mb * 1024 * 1024 * (0.5 + (double)rand_r(&seed) / RAND_MAX);
+        d->unmount_ms = sim_config.unmount_ms * (0.5 + (double)rand_r(&seed) / RAND_MAX);
+        d->poweroff_ms = sim_config.poweroff_ms * (0.5 + (double)rand_r(&seed) / RAND_MAX);
+    }
+}
+
+// Index of a simulated drive from its path ("/dev/sim12")
+int sim_index(const char* path) {
+    const char* name = dev_name(path);
+    if (strncmp(name, "sim", 3) != 0) return -1;
+    int index = atoi(name + 3);
+    return index >= 0 && index < sim_config.drives ? index : -1;
+}
+
+void sim_get_drive_info(const char* drive, DriveInfo* info) {
+    memset(info, 0, sizeof(*info));
+    snprintf(info->path, sizeof(info->path), "%s", drive);
+    int index = sim_index(drive);
+    if (index < 0) return;
+
+    info->size_bytes = 64ULL << 30;
+    format_size(info->size_bytes, info->size, sizeof(info->size));
+    snprintf(info->vendor, sizeof(info->vendor), "Simulated");
+    snprintf(info->model, sizeof(info->model), "Drive %d", index);
+    snprintf(info->transport, sizeof(info->transport), "usb");
+    for (int p = 1; p <= sim_config.partitions && info->mount_count < 8; p++) {
+        snprintf(info->mountpoints[info->mount_count++], MAX_PATH, "/media/sim%d/part%d", index, p);
+    }
+}
+
+int sim_get_drives(DriveInfo drives[], int max_drives) {
+    int count = 0;
+    for (int i = 0; i < sim_config.drives && count < max_drives; i++) {
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "/dev/sim%d", i);
+        sim_get_drive_info(path, &drives[count++]);
+    }
+    return count;
+}
+
+// One flush, an unmount per partition, then power-off
+void sim_build_plan(const DriveInfo* drive, EjectPlan* plan) {
+    const char* name = dev_name(drive->path);
+    int index = sim_index(drive->path);
+
+    memset(plan, 0, sizeof(*plan));
+    snprintf(plan->drive, sizeof(plan->drive), "%s", drive->path);
+    snprintf(plan->identity, sizeof(plan->identity), "sim:%d", index);
+    if (index < 0) return;
+    SimDrive* d = &sim_drives[index];
+
+    int flush = plan_add(plan, STEP_FLUSH, drive->path, name);
+    plan->nodes[flush].bytes = d->dirty;
+    plan->nodes[flush].est_ms = 5 + d->dirty / d->bw * 1000;
+    plan->has_flush = true;
+    plan->dirty_exact = true;
+
+    for (int i = 0; i < drive->mount_count; i++) {
+        char device[64];
+        if (snprintf(device, sizeof(device), "%sp%d", name, i + 1) >= (int)sizeof(device)) break;
+        int unmount = plan_add(plan, STEP_UNMOUNT, drive->mountpoints[i], device);
+        if (unmount < 0) break;
+        plan->nodes[unmount].est_ms = d->unmount_ms;
+        plan_dep(plan, unmount, flush);
+    }
+
+    int power_off = plan_add(plan, STEP_POWER_OFF, drive->path, name);
+    plan->nodes[power_off].est_ms = d->poweroff_ms;
+    for (int i = flush + 1; i < power_off; i++) plan_dep(plan, power_off, i);
+
+    plan->total_ms = plan_finish(plan, power_off, 0);
+    plan_mark_critical(plan, power_off);
+}
+
+static unsigned int sim_calls;
+
+// Sleep for a step's simulated duration; unmounts fail with EBUSY at the
+// configured rate, independently on every attempt
+int sim_run_step(const EjectPlan* plan, int node) {
+    const PlanNode* n = &plan->nodes[node];
+    int index = sim_index(plan->drive);
+    if (index < 0) return ENODEV;
+
+    double ms = n->est_ms;
+    if (n->type == STEP_FLUSH) ms = n->bytes / sim_drives[index].bw * 1000;
+
+    long long us = (long long)(ms * 1000);
+    struct timespec ts = {us / 1000000, us % 1000000 * 1000};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+
+    unsigned int call = __atomic_fetch_add(&sim_calls, 1, __ATOMIC_RELAXED);
+    unsigned int seed = sim_config.seed ^ (unsigned int)(index * 7919 + node * 31) ^ (call * 2654435761u);
+    if (n->type == STEP_UNMOUNT && (double)rand_r(&seed) / RAND_MAX < sim_config.fail) return EBUSY;
+    return 0;
+}
+
+static const Backend sim_backend = {"sim", sim_get_drives, sim_get_drive_info, sim_build_plan, sim_run_step};
+
+// Fault injection around whichever backend is active, from CEJECT_FAULTS
+// (rules separated by ";") or faults.conf (one section per rule):
+//
+//   CEJECT_FAULTS="unmount errno=EBUSY times=2; power-off hang; flush slow=1500 p=0.5"
+//
+//   [busy-unmount]
+//   point = unmount           (a step name, or "discover")
+//   target = /media/backup    (substring of the step target or drive path)
+//   errno = EBUSY             (or hang, or slow = <ms>)
+//   p = 0.5                   (probability per call, default 1)
+//   times = 2                 (stop after firing this often, default unlimited)
+//
+// A hung step is held until just past its deadline, by when the executor
+// has given up on it, and then fails with ETIMEDOUT. Discovery runs on the
+// main thread, where nothing would give up on it, so it cannot hang.
+#define MAX_FAULTS 32
+#define FAULT_HANG_MARGIN_MS 1000
+
+double step_deadline_ms(const PlanNode* n);
+
+typedef enum { FAULT_ERRNO, FAULT_HANG, FAULT_SLOW } FaultAction;
+
+typedef struct {
+    char name[64];
+    char point[32];
+    char target[MAX_PATH];
+    FaultAction action;
+    int err;
+    int slow_ms;
+    double probability;
+    int times;
+    int fired;
+} Fault;
+
+static Fault faults[MAX_FAULTS];
+static int fault_count;
+static unsigned int fault_seed = 1;
+static pthread_mutex_t faults_lock = PTHREAD_MUTEX_INITIALIZER;
+static const Backend* fault_inner;
+
+// errno value from its name ("EBUSY") or number
+int parse_errno(const char* name) {
+    static const struct { const char* name; int value; } names[] = {
+        {"EPERM", EPERM}, {"ENOENT", ENOENT}, {"EIO", EIO}, {"ENXIO", ENXIO}, {"EAGAIN", EAGAIN},
+        {"ENOMEM", ENOMEM}, {"EACCES", EACCES}, {"EBUSY", EBUSY}, {"ENODEV", ENODEV}, {"EINVAL", EINVAL},
+        {"ENOSPC", ENOSPC}, {"EROFS", EROFS}, {"ETIMEDOUT", ETIMEDOUT}, {"ENOTSUP", ENOTSUP},
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcasecmp(names[i].name, name) == 0) return names[i].value;
+    }
+    int value = atoi(name);
+    return value > 0 ? value : EIO;
+}
+
+// Apply one key of a rule
+void fault_set(Fault* fault, const char* key, const char* value) {
+    if (strcmp(key, "point") == 0) snprintf(fault->point, sizeof(fault->point), "%s", value);
+    else if (strcmp(key, "target") == 0) snprintf(fault->target, sizeof(fault->target), "%s", value);
+    else if (strcmp(key, "p") == 0) fault->probability = atof(value);
+    else if (strcmp(key, "times") == 0) fault->times = atoi(value);
+    else if (strcmp(key, "hang") == 0) fault->action = FAULT_HANG;
+    else if (strcmp(key, "errno") == 0) {
+        fault->action = FAULT_ERRNO;
+        fault->err = parse_errno(value);
+    } else if (strcmp(key, "slow") == 0) {
+        fault->action = FAULT_SLOW;
+        fault->slow_ms = atoi(value);
+    }
+}
+
+Fault* fault_new(const char* name) {
+    if (fault_count >= MAX_FAULTS) return NULL;
+    Fault* fault = &faults[fault_count++];
+    memset(fault, 0, sizeof(*fault));
+    snprintf(fault->name, sizeof(fault->name), "%s", name);
+    fault->err = EIO;
+    fault->probability = 1;
+    return fault;
+}
+
+void fault_config_entry(const char* section, const char* key, const char* value, void* ctx) {
+    (void)ctx;
+    if (section[0] == '\0') return;
+    if (fault_count == 0 || strcmp(faults[fault_count - 1].name, section) != 0) {
+        if (fault_new(section) == NULL) return;
+    }
+    fault_set(&faults[fault_count - 1], key, value);
+}
+
+// Load fault rules from faults.conf and CEJECT_FAULTS
+void load_faults(void) {
+    read_config("faults.conf", fault_config_entry, NULL);
+
+    const char* env = getenv("CEJECT_FAULTS");
+    char spec[MAX_LINE];
+    snprintf(spec, sizeof(spec), "%s", env ? env : "");
+
+    char* rule_save;
+    for (char* rule = strtok_r(spec, ";", &rule_save); rule != NULL; rule = strtok_r(NULL, ";", &rule_save)) {
+        char* word_save;
+        char* point = strtok_r(rule, " \t", &word_save);
+        if (point == NULL) continue;
+
+        char name[64];
+        snprintf(name, sizeof(name), "env-%d", fault_count + 1);
+        Fault* fault = fault_new(name);
+        if (fault == NULL) break;
+        fault_set(fault, "point", point);
+
+        for (char* word = strtok_r(NULL, " \t", &word_save); word != NULL; word = strtok_r(NULL, " \t", &word_save)) {
+            char* eq = strchr(word, '=');
+            if (eq != NULL) *eq = '\0';
+            fault_set(fault, word, eq ? eq + 1 : "");
+        }
+    }
+
+    for (int i = fault_count - 1; i >= 0; i--) {
+        if (faults[i].action != FAULT_HANG || strcmp(faults[i].point, "discover") != 0) continue;
+        fprintf(stderr, "ceject: fault %s: discover cannot hang, it would freeze the whole process; rule ignored\n",
+                faults[i].name);
+        memmove(&faults[i], &faults[i + 1], (fault_count - i - 1) * sizeof(faults[0]));
+        fault_count--;
+    }
+}
+
+// Fire the first matching rule for a call, if any. Returns the errno to fail
+// with, or 0 to let the call through (after any injected delay). A hang
+// lasts hang_ms.
+int fault_check(const char* point, const char* target, const char* drive, double hang_ms) {
+    const Fault* hit = NULL;
+
+    pthread_mutex_lock(&faults_lock);
+    for (int i = 0; i < fault_count && hit == NULL; i++) {
+        Fault* f = &faults[i];
+        if (strcmp(f->point, point) != 0) continue;
+        if (f->target[0] && strstr(target, f->target) == NULL && strstr(drive, f->target) == NULL) continue;
+        if (f->times > 0 && f->fired >= f->times) continue;
+        if (f->probability < 1 && (double)rand_r(&fault_seed) / RAND_MAX >= f->probability) continue;
+        f->fired++;
+        hit = f;
+    }
+    pthread_mutex_unlock(&faults_lock);
+    if (hit == NULL) return 0;
+
+    switch (hit->action) {
+        case FAULT_ERRNO:
+            record_event(drive, "fault", "%s: %s %s fails with %s", hit->name, point, target, strerror(hit->err));
+            return hit->err;
+        case FAULT_SLOW:
+            record_event(drive, "fault", "%s: %s %s delayed %d ms", hit->name, point, target, hit->slow_ms);
+            usleep((useconds_t)hit->slow_ms * 1000);
+            return 0;
+        case FAULT_HANG: {
+            record_event(drive, "fault", "%s: %s %s hangs for %.0f ms", hit->name, point, target, hang_ms);
+            long long us = (long long)(hang_ms * 1000);
+            struct timespec ts = {us / 1000000, us % 1000000 * 1000};
+            while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+            return ETIMEDOUT;
+        }
+    }
+    return 0;
+}
+
+int fault_get_drives(DriveInfo drives[], int max_drives) {
+    int err = fault_check("discover", "", "", 0);
+    if (err != 0) {
+        errno = err;
+        return 0;
+    }
+
+    int count = fault_inner->get_drives(drives, max_drives);
+    for (int i = 0; i < count; i++) {
+        if (fault_check("discover", drives[i].path, drives[i].path, 0) != 0) {
+            char path[MAX_PATH];
+            snprintf(path, sizeof(path), "%s", drives[i].path);
+            memset(&drives[i], 0, sizeof(drives[i]));
+            snprintf(drives[i].path, MAX_PATH, "%s", path);
+        }
+    }
+    return count;
+}
+
+// A failed per-drive read leaves only the path, as an unreadable sysfs would
+void fault_get_drive_info(const char* drive, DriveInfo* info) {
+    if (fault_check("discover", drive, drive, 0) != 0) {
+        memset(info, 0, sizeof(*info));
+        snprintf(info->path, sizeof(info->path), "%s", drive);
+        return;
+    }
+    fault_inner->get_drive_info(drive, info);
+}
+
+void fault_build_plan(const DriveInfo* drive, EjectPlan* plan) {
+    fault_inner->build_plan(drive, plan);
+}
+
+int fault_run_step(const EjectPlan* plan, int node) {
+    const PlanNode* n = &plan->nodes[node];
+    int err = fault_check(step_names[n->type], n->target, plan->drive, step_deadline_ms(n) + FAULT_HANG_MARGIN_MS);
+    return err != 0 ? err : fault_inner->run_step(plan, node);
+}
+
+static const Backend fault_backend = {"faults", fault_get_drives, fault_get_drive_info, fault_build_plan,
+                                      fault_run_step};
+
+// Wrap the active backend if any fault rules are configured
+void install_faults(void) {
+    load_faults();
+    if (fault_count == 0 || backend == &fault_backend) return;
+    fault_inner = backend;
+    backend = &fault_backend;
+}
+#endif
+
+// Find a drive by menu number, device path, kernel name or identity
+int resolve_drive(DriveInfo drives[], int count, const char* id) {
+    char* end;
+    long index = strtol(id, &end, 10);
+    if (*end == '\0' && index >= 1 && index <= count) return (int)index - 1;
+
+    for (int i = 0; i < count; i++) {
+        char identity[128];
+        if (strcmp(drives[i].path, id) == 0 || strcmp(dev_name(drives[i].path), id) == 0) return i;
+        get_drive_identity(dev_name(drives[i].path), identity, sizeof(identity));
+        if (strcmp(identity, id) == 0) return i;
+    }
+    return -1;
+}
+
+// Dry run: print what an eject would do without touching anything
+int run_plan(const char* id, bool json) {
+    static DriveInfo drives[MAX_DRIVES];
+    static EjectPlan plan;
+    int count = backend->get_drives(drives, MAX_DRIVES);
+    int first = 0, last = count;
+
+    if (id != NULL) {
+        first = resolve_drive(drives, count, id);
+        if (first < 0) {
+            fprintf(stderr, "ceject: no external drive matches '%s'\n", id);
+            return 1;
+        }
+        last = first + 1;
+    }
+
+    if (json) printf("[");
+    for (int i = first; i < last; i++) {
+        backend->build_plan(&drives[i], &plan);
+        if (json) {
+            if (i > first) printf(",");
+            show_plan_json(&plan, stdout);
+        } else {
+            show_plan(&plan, &drives[i]);
+        }
+    }
+    if (json) printf("]\n");
+
+    return 0;
+}
+
+#ifndef CEJECT_MINI
+// Block-queue tuning profiles from tuning.conf, applied to drives as they
+// are discovered and undone on eject:
+//
+//   [usb-backup]
+//   transport = usb           (match on any of transport, model, identity;
+//   model = Extreme*           model is a glob, the most specific profile wins)
+//   read_ahead_kb = 4096
+//   max_sectors_kb = 1024
+//   nr_requests = 256
+//   scheduler = mq-deadline
+#define MAX_PROFILES 32
+
+// The scheduler goes first: switching it resets nr_requests
+static const char* tuning_attrs[] = {"scheduler", "read_ahead_kb", "max_sectors_kb", "nr_requests"};
+#define TUNING_ATTR_COUNT (int)(sizeof(tuning_attrs) / sizeof(tuning_attrs[0]))
+
+typedef struct {
+    char name[64];
+    char transport[16];
+    char model[128];
+    char identity[128];
+    char values[TUNING_ATTR_COUNT][32];
+} TuningProfile;
+
+// A drive ceject has tuned, with the values it replaced
+typedef struct {
+    char name[64];
+    const TuningProfile* profile;
+    bool restored;
+    bool saved[TUNING_ATTR_COUNT];
+    char original[TUNING_ATTR_COUNT][32];
+} TunedDrive;
+
+static TuningProfile profiles[MAX_PROFILES];
+static int profile_count;
+static bool profiles_loaded;
+static TunedDrive tuned[MAX_DRIVES];
+static int tuned_count;
+static bool tuning_enabled;
+static pthread_mutex_t tuning_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void tuning_config_entry(const char* section, const char* key, const char* value, void* ctx) {
+    (void)ctx;
+    if (section[0] == '\0') return;
+
+    if (profile_count == 0 || strcmp(profiles[profile_count - 1].name, section) != 0) {
+        if (profile_count >= MAX_PROFILES) return;
+        TuningProfile* profile = &profiles[profile_count++];
+        memset(profile, 0, sizeof(*profile));
+        snprintf(profile->name, sizeof(profile->name), "%s", section);
+    }
+
+    TuningProfile* profile = &profiles[profile_count - 1];
+    if (strcmp(key, "transport") == 0) snprintf(profile->transport, sizeof(profile->transport), "%s", value);
+    else if (strcmp(key, "model") == 0) snprintf(profile->model, sizeof(profile->model), "%s", value);
+    else if (strcmp(key, "identity") == 0) snprintf(profile->identity, sizeof(profile->identity), "%s", value);
+
+    for (int i = 0; i < TUNING_ATTR_COUNT; i++) {
+        if (strcmp(key, tuning_attrs[i]) == 0) snprintf(profile->values[i], sizeof(profile->values[i]), "%s", value);
+    }
+}
+
+// Pick the profile for a drive: identity beats model beats transport, and
+// every criterion a profile sets must match
+const TuningProfile* find_profile(const DriveInfo* drive, const char* identity) {
+    const TuningProfile* best = NULL;
+    int best_score = 0;
+
+    for (int i = 0; i < profile_count; i++) {
+        const TuningProfile* p = &profiles[i];
+        int score = 0;
+        if (p->identity[0]) {
+            if (strcmp(p->identity, identity) != 0) continue;
+            score += 4;
+        }
+        if (p->model[0]) {
+            if (fnmatch(p->model, drive->model, 0) != 0) continue;
+            score += 2;
+        }
+        if (p->transport[0]) {
+            if (strcmp(p->transport, drive->transport) != 0) continue;
+            score += 1;
+        }
+        if (score > best_score) {
+            best = p;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+// Current value of a queue attribute; for the scheduler, the active one
+bool read_queue_attr(const char* name, const char* attr, char* value, size_t size) {
+    char path[MAX_PATH], buf[MAX_LINE];
+    if (snprintf(path, sizeof(path), "/sys/block/%s/queue/%s", name, attr) >= (int)sizeof(path)) return false;
+    if (!read_sysfs_attr(path, buf, sizeof(buf))) return false;
+
+    char* active = strchr(buf, '[');
+    char* end = active ? strchr(active, ']') : NULL;
+    if (end != NULL) {
+        *end = '\0';
+        snprintf(value, size, "%s", active + 1);
+    } else {
+        snprintf(value, size, "%s", buf);
+    }
+    return true;
+}
+
+bool write_queue_attr(const char* name, const char* attr, const char* value) {
+    char path[MAX_PATH];
+    if (snprintf(path, sizeof(path), "/sys/block/%s/queue/%s", name, attr) >= (int)sizeof(path)) return false;
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+    close(fd);
+    return ok;
+}
+
+// Apply the matching profile to a drive once per attach
+void tune_drive(const DriveInfo* drive) {
+    const char* name = dev_name(drive->path);
+    char identity[128];
+
+    pthread_mutex_lock(&tuning_lock);
+    if (!profiles_loaded) {
+        read_config("tuning.conf", tuning_config_entry, NULL);
+        profiles_loaded = true;
+    }
+
+    bool known = false;
+    for (int i = 0; i < tuned_count && !known; i++) known = strcmp(tuned[i].name, name) == 0;
+
+    get_drive_identity(name, identity, sizeof(identity));
+    const TuningProfile* profile = known ? NULL : find_profile(drive, identity);
+    if (profile == NULL || tuned_count >= MAX_DRIVES) {
+        pthread_mutex_unlock(&tuning_lock);
+        return;
+    }
+
+    // A cut name would restore the values onto another device
+    TunedDrive* t = &tuned[tuned_count];
+    memset(t, 0, sizeof(*t));
+    if (snprintf(t->name, sizeof(t->name), "%s", name) >= (int)sizeof(t->name)) {
+        pthread_mutex_unlock(&tuning_lock);
+        return;
+    }
+    tuned_count++;
+    t->profile = profile;
+
+    // max_sectors_kb must stay within max_hw_sectors_kb; the kernel
+    // rejects the write otherwise, which is reported and left at that
+    for (int i = 0; i < TUNING_ATTR_COUNT; i++) {
+        if (profile->values[i][0] == '\0') continue;
+        if (!read_queue_attr(name, tuning_attrs[i], t->original[i], sizeof(t->original[i]))) continue;
+        if (write_queue_attr(name, tuning_attrs[i], profile->values[i])) {
+            t->saved[i] = true;
+        } else {
+            record_event(drive->path, "tuning", "%s: cannot set %s=%s: %s", profile->name, tuning_attrs[i],
+                         profile->values[i], strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&tuning_lock);
+
+    record_event(drive->path, "tuning", "applied profile %s", profile->name);
+}
+
+// Name of the profile applied to a drive, or NULL
+const char* get_tuning_profile(const char* name) {
+    const char* profile = NULL;
+    pthread_mutex_lock(&tuning_lock);
+    for (int i = 0; i < tuned_count; i++) {
+        if (strcmp(tuned[i].name, name) == 0 && !tuned[i].restored) profile = tuned[i].profile->name;
+    }
+    pthread_mutex_unlock(&tuning_lock);
+    return profile;
+}
+
+// Put back the values a profile replaced. The drive stays known, so a
+// drive made safe but left attached is not tuned again.
+void untune_drive(const char* name) {
+    pthread_mutex_lock(&tuning_lock);
+    for (int i = 0; i < tuned_count; i++) {
+        if (strcmp(tuned[i].name, name) != 0 || tuned[i].restored) continue;
+
+        for (int a = 0; a < TUNING_ATTR_COUNT; a++) {
+            if (tuned[i].saved[a]) write_queue_attr(name, tuning_attrs[a], tuned[i].original[a]);
+        }
+        tuned[i].restored = true;
+    }
+    pthread_mutex_unlock(&tuning_lock);
+}
+
+// Forget a drive that went away, so it is tuned afresh when it comes back
+void forget_tuning(const char* name) {
+    pthread_mutex_lock(&tuning_lock);
+    for (int i = 0; i < tuned_count; i++) {
+        if (strcmp(tuned[i].name, name) == 0) {
+            tuned[i] = tuned[--tuned_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tuning_lock);
+}
+
+#else
+// Queue tuning belongs to the resident modes, which the mini build leaves out
+static const bool tuning_enabled = false;
+
+void tune_drive(const DriveInfo* drive) { (void)drive; }
+const char* get_tuning_profile(const char* name) { (void)name; return NULL; }
+void untune_drive(const char* name) { (void)name; }
+void forget_tuning(const char* name) { (void)name; }
+#endif
+
+// Kernel uevent fields ceject cares about
+typedef struct {
+    char action[16];
+    char devpath[MAX_PATH];
+    char subsystem[32];
+    char devname[64];
+    char devtype[32];
+    unsigned int major;
+    unsigned int minor;
+} Uevent;
+
+// Subscribe to kernel uevents
+int open_uevent_socket(void) {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) return -1;
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// A number field of a uevent, which need not be NUL-terminated in the buffer
+unsigned int parse_uevent_number(const char* value, size_t len) {
+    char buf[16];
+    unsigned long long n;
+    const char* p = buf;
+    if (len >= sizeof(buf)) return 0;
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+    return parse_number(&p, UINT_MAX, &n) && *p == '\0' ? (unsigned int)n : 0;
+}
+
+// Split a uevent message ("action@devpath\0KEY=value\0...") into fields
+bool parse_uevent(const char* msg, size_t len, Uevent* ev) {
+    memset(ev, 0, sizeof(*ev));
+    if (len == 0 || memchr(msg, '@', strnlen(msg, len)) == NULL) return false;
+
+    for (size_t pos = strnlen(msg, len) + 1; pos < len; pos += strnlen(msg + pos, len - pos) + 1) {
+        const char* field = msg + pos;
+        size_t field_len = strnlen(field, len - pos);
+        const char* eq = memchr(field, '=', field_len);
+        if (eq == NULL) continue;
+
+        size_t key_len = eq - field, value_len = field_len - key_len - 1;
+        char* dest = NULL;
+        size_t dest_size = 0;
+
+        if (key_len == 6 && strncmp(field, "ACTION", 6) == 0) { dest = ev->action; dest_size = sizeof(ev->action); }
+        else if (key_len == 7 && strncmp(field, "DEVPATH", 7) == 0) { dest = ev->devpath; dest_size = sizeof(ev->devpath); }
+        else if (key_len == 9 && strncmp(field, "SUBSYSTEM", 9) == 0) { dest = ev->subsystem; dest_size = sizeof(ev->subsystem); }
+        else if (key_len == 7 && strncmp(field, "DEVNAME", 7) == 0) { dest = ev->devname; dest_size = sizeof(ev->devname); }
+        else if (key_len == 7 && strncmp(field, "DEVTYPE", 7) == 0) { dest = ev->devtype; dest_size = sizeof(ev->devtype); }
+        else if (key_len == 5 && strncmp(field, "MAJOR", 5) == 0) ev->major = parse_uevent_number(eq + 1, value_len);
+        else if (key_len == 5 && strncmp(field, "MINOR", 5) == 0) ev->minor = parse_uevent_number(eq + 1, value_len);
+
+        if (dest != NULL) {
+            if (value_len >= dest_size) value_len = dest_size - 1;
+            memcpy(dest, eq + 1, value_len);
+            dest[value_len] = '\0';
+        }
+    }
+    return ev->action[0] != '\0';
+}
+
+// Receive one pending uevent
+bool read_uevent(int fd, Uevent* ev) {
+    char buf[8192];
+    ssize_t len = recv(fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) return false;
+    buf[len] = '\0';
+    return parse_uevent(buf, (size_t)len, ev);
+}
+
+// Resident drive model: discovered drives with ready-to-run teardown plans,
+// kept current from mount, swap and uevent notifications
+typedef struct {
+    DriveInfo drives[MAX_DRIVES];
+    EjectPlan plans[MAX_DRIVES];
+    unsigned long signature[MAX_DRIVES];
+    Readiness ready[MAX_DRIVES];
+    dev_t devs[MAX_DRIVES][MAX_PLAN_NODES];   // as of the last plan, for when sysfs has gone
+    int dev_count[MAX_DRIVES];
+    char roots[8][64];
+    int root_count;
+    int count;
+    char incident[16 + MAX_LINE];   // last surprise removal, shown above the drive list
+} DriveModel;
+
+// Fingerprint of the mounts and swaps a drive's plan depends on, given the
+// drive's device numbers
+unsigned long drive_signature(const DriveInfo* drive, const dev_t devs[], int dev_count) {
+    unsigned long hash = 5381;
+
+    for (int i = 0; i < dev_count; i++) hash = hash * 33 + devs[i];
+
+    for (int i = 0; i < mount_table_count; i++) {
+        MountEntry* m = &mount_table[i];
+        bool related = false;
+
+        for (int j = 0; j < dev_count && !related; j++) {
+            related = major(devs[j]) == m->major && minor(devs[j]) == m->minor;
+        }
+        for (int j = 0; j < drive->mount_count && !related; j++) {
+            related = path_is_below(m->mountpoint, drive->mountpoints[j]);
+        }
+        if (related) hash = hash * 33 + (unsigned long)m->id;
+    }
+
+    for (int i = 0; i < swap_table_count; i++) {
+        for (int j = 0; j < dev_count; j++) {
+            if (swap_table[i].dev == devs[j]) hash = hash * 33 + swap_table[i].dev + 1;
+        }
+    }
+    return hash;
+}
+
+// Note a drive's device numbers and the signature of its plan's inputs
+void model_sign_drive(DriveModel* model, int index) {
+    const DriveInfo* drive = &model->drives[index];
+    model->dev_count[index] = get_drive_devices(dev_name(drive->path), model->devs[index], 0, MAX_PLAN_NODES);
+    model->signature[index] = drive_signature(drive, model->devs[index], model->dev_count[index]);
+}
+
+// Refresh one drive's info and plan
+void model_update_drive(DriveModel* model, int index) {
+    DriveInfo* drive = &model->drives[index];
+    backend->get_drive_info(drive->path, drive);
+    if (tuning_enabled) {
+        tune_drive(drive);
+        preflush_drive(drive);
+    }
+    backend->build_plan(drive, &model->plans[index]);
+    model_sign_drive(model, index);
+}
+
+// Full discovery
+void model_load(DriveModel* model) {
+    model->count = backend->get_drives(model->drives, MAX_DRIVES);
+    model->root_count = get_root_drives(model->roots, 8);
+    for (int i = 0; i < model->count; i++) {
+        model->ready[i].open_files = -1;
+        if (tuning_enabled) {
+            tune_drive(&model->drives[i]);
+            preflush_drive(&model->drives[i]);
+        }
+        backend->build_plan(&model->drives[i], &model->plans[i]);
+        model_sign_drive(model, i);
+    }
+}
+
+// Mounts or swaps changed: rebuild only the plans whose inputs changed
+bool model_tables_changed(DriveModel* model) {
+    bool changed = false;
+    load_system_tables();
+
+    for (int i = 0; i < model->count; i++) {
+        dev_t devs[MAX_PLAN_NODES];
+        int dev_count = get_drive_devices(dev_name(model->drives[i].path), devs, 0, MAX_PLAN_NODES);
+        if (drive_signature(&model->drives[i], devs, dev_count) != model->signature[i]) {
+            model_update_drive(model, i);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Drop a drive from the model
+void model_remove(DriveModel* model, int index) {
+    for (int i = index; i < model->count - 1; i++) {
+        model->drives[i] = model->drives[i + 1];
+        model->plans[i] = model->plans[i + 1];
+        model->signature[i] = model->signature[i + 1];
+        memcpy(model->devs[i], model->devs[i + 1], sizeof(model->devs[i]));
+        model->dev_count[i] = model->dev_count[i + 1];
+        model->ready[i] = model->ready[i + 1];
+    }
+    model->count--;
+}
+
+// Drop drives the policy hides. Labels can arrive after their disk, so a
+// drive may only turn out to be hidden once its partitions are known.
+void model_drop_hidden(DriveModel* model) {
+    for (int i = model->count - 1; i >= 0; i--) {
+        if (model->drives[i].policy_actions & POLICY_HIDE) model_remove(model, i);
+    }
+}
+
+// Find a drive in the model by kernel name
+int model_find(const DriveModel* model, const char* name) {
+    for (int i = 0; i < model->count; i++) {
+        if (strcmp(dev_name(model->drives[i].path), name) == 0) return i;
+    }
+    return -1;
+}
+
+// A drive was pulled out while mounted. Its mounts would linger, keeping
+// the mountpoints busy, so lazily detach them (children first), along with
+// those of devices stacked on it, and report the data that was still
+// waiting to be written. Mounts are matched by device number, as cached
+// with the drive's plan, so a filesystem mounted since at one of the
+// drive's old mountpoints is left alone. Returns true if there was
+// anything to detach.
+bool detach_orphaned_mounts(DriveModel* model, const Uevent* ev) {
+    // The kernel removes partitions first, while the disk and its bdi
+    // still exist, so the first event of a drive is the one that counts
+    char disk[MAX_PATH];
+    snprintf(disk, sizeof(disk), "%s", ev->devname);
+    if (strcmp(ev->devtype, "partition") == 0) {
+        char parent[MAX_PATH];
+        snprintf(parent, sizeof(parent), "%s", ev->devpath);
+        char* slash = strrchr(parent, '/');
+        if (slash == NULL) return false;
+        *slash = '\0';
+        snprintf(disk, sizeof(disk), "%s", dev_name(parent));
+    }
+    int index = model_find(model, disk);
+    if (index < 0) return false;
+    const DriveInfo* drive = &model->drives[index];
+
+    load_system_tables();
+    int orphans[MAX_PLAN_NODES], orphan_count = 0;
+    for (int i = mount_table_count - 1; i >= 0 && orphan_count < MAX_PLAN_NODES; i--) {
+        const MountEntry* m = &mount_table[i];
+        bool orphan = ev->major != 0 && m->major == ev->major && m->minor == ev->minor;
+        for (int j = 0; j < model->dev_count[index] && !orphan; j++) {
+            orphan = major(model->devs[index][j]) == m->major && minor(model->devs[index][j]) == m->minor;
+        }
+        if (orphan) orphans[orphan_count++] = i;
+    }
+    if (orphan_count == 0) return false;
+
+    unsigned int major = ev->major, minor = ev->minor;
+    BdiStats stats;
+    get_block_devnum(disk, &major, &minor);
+    read_bdi_stats(major, minor, &stats);
+
+    char detached[MAX_LINE] = "", failed[MAX_LINE] = "";
+    int detached_count = 0;
+    for (int i = 0; i < orphan_count; i++) {
+        const char* target = mount_table[orphans[i]].mountpoint;
+        if (umount2(target, MNT_DETACH) == 0) {
+            size_t len = strlen(detached);
+            snprintf(detached + len, sizeof(detached) - len, "%s%s", detached_count++ ? ", " : "", target);
+        } else if (failed[0] == '\0') {
+            snprintf(failed, sizeof(failed), "; could not detach %s: %s", target, strerror(errno));
+        }
+    }
+
+    char dirty[32], writeback[32], msg[MAX_LINE], stamp[16];
+    format_bytes(stats.dirty, dirty, sizeof(dirty));
+    format_bytes(stats.writeback, writeback, sizeof(writeback));
+    int len = snprintf(msg, sizeof(msg),
+             "%s removed without eject: lazily detached %d of %d mount%s (%s)%s; %s%s dirty and %s under "
+             "writeback were not written%s", drive->path, detached_count, orphan_count, orphan_count == 1 ? "" : "s",
+             detached, failed,
+             stats.exact ? "" : "up to ", dirty, writeback, stats.exact ? "" : " (system-wide count)");
+    if (len >= (int)sizeof(msg)) strcpy(msg + sizeof(msg) - 4, "...");   // a long list of mountpoints
+    log_event(drive->path, "incident", "%s", msg);
+
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime_r(&now, &tm));
+    snprintf(model->incident, sizeof(model->incident), "%s %s", stamp, msg);
+    return true;
+}
+
+// Apply a block uevent to the model
+bool model_handle_uevent(DriveModel* model, const Uevent* ev) {
+    if (strcmp(ev->subsystem, "block") != 0 || ev->devname[0] == '\0') return false;
+
+    bool orphaned = strcmp(ev->action, "remove") == 0 && detach_orphaned_mounts(model, ev);
+
+    int index = model_find(model, ev->devname);
+
+    // A disk becomes a candidate on "add", or on "change" for devices such
+    // as nbd that exist unconnected; it stops being one the same ways
+    bool is_disk = strcmp(ev->devtype, "disk") == 0;
+    bool candidate = is_disk && strcmp(ev->action, "remove") != 0 &&
+                     is_external_candidate(ev->devname, model->roots, model->root_count);
+
+    if (candidate && index < 0 && model->count < MAX_DRIVES) {
+        snprintf(model->drives[model->count].path, MAX_PATH, "/dev/%s", ev->devname);
+        memset(&model->ready[model->count], 0, sizeof(Readiness));
+        model->ready[model->count].open_files = -1;
+        model_update_drive(model, model->count++);
+        model_drop_hidden(model);
+        return true;
+    }
+
+    if (index >= 0 && (strcmp(ev->action, "remove") == 0 || (is_disk && !candidate))) {
+        forget_tuning(ev->devname);
+        model_remove(model, index);
+        return true;
+    }
+
+    if (index >= 0) {
+        model_update_drive(model, index);
+        model_drop_hidden(model);
+        return true;
+    }
+
+    // A partition: only its disk's plan is affected
+    if (strcmp(ev->devtype, "partition") == 0) {
+        char parent[MAX_PATH];
+        snprintf(parent, sizeof(parent), "%s", ev->devpath);
+        char* slash = strrchr(parent, '/');
+        if (slash == NULL) return orphaned;
+        *slash = '\0';
+
+        index = model_find(model, dev_name(parent));
+        if (index < 0) return orphaned;
+        model_update_drive(model, index);
+        model_drop_hidden(model);
+        return true;
+    }
+
+    // dm, md or loop devices came or went: holder chains may have changed
+    for (int i = 0; i < model->count; i++) model_update_drive(model, i);
+    model_drop_hidden(model);
+    return model->count > 0 || orphaned;
+}
+
+// Monotonic clock in milliseconds
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+#ifndef CEJECT_MINI
+// Run a udisksctl verb on a block device and wait for it to finish.
+// Spawned directly rather than through /bin/sh, where "&>" would
+// background the command and report success before it ran.
+int run_udisksctl(const char* verb, const char* device) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    pid_t pid;
+    char* argv[] = {"udisksctl", (char*)verb, "-b", (char*)device, NULL};
+    extern char** environ;
+    int err = posix_spawnp(&pid, "udisksctl", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) return err;
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return errno;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : EIO;
+}
+#endif
+
+#define FUSE_EXIT_TIMEOUT_MS 15000
+#define REMOVAL_TIMEOUT_MS 10000
+
+// Power off a disk without udisks, the way it does it: detach it from the
+// SCSI layer (the kernel syncs its cache and stops it first), then logically
+// remove the USB device, which cuts port power on hubs that support it
+int native_power_off(const char* name) {
+    char path[MAX_PATH], usb[PATH_MAX], check[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "/sys/block/%s", name);
+    if (realpath(path, usb) == NULL) return errno;
+
+    // Find the USB device now; its sysfs path is gone after the delete
+    while (true) {
+        snprintf(check, sizeof(check), "%s/idVendor", usb);
+        if (path_exists(check)) break;
+        char* slash = strrchr(usb, '/');
+        if (slash == NULL || slash == usb) {
+            usb[0] = '\0';
+            break;
+        }
+        *slash = '\0';
+    }
+
+    snprintf(path, sizeof(path), "/sys/block/%s/device/delete", name);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT ? ENOTSUP : errno;
+    int err = write(fd, "1", 1) == 1 ? 0 : errno;
+    close(fd);
+    if (err != 0 || usb[0] == '\0') return err;
+
+    // Older kernels have no remove attribute; the disk is already detached
+    snprintf(check, sizeof(check), "%s/remove", usb);
+    fd = open(check, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    if (write(fd, "1", 1) != 1) err = errno;
+    close(fd);
+    return err;
+}
+
+// Power off a drive, then wait until the kernel has actually removed the
+// disk and all of its partitions
+int step_power_off(const PlanNode* n, const char* drive) {
+    char names[MAX_PARTITIONS * 4 + 1][64], entries[MAX_PARTITIONS * 4][64];
+    char path[MAX_PATH], check[MAX_PATH + 80];
+    int name_count = 0;
+
+    // A cut name would be confirmed gone by a path that never existed
+    if (snprintf(names[name_count++], 64, "%s", dev_name(n->target)) >= 64 ||
+        snprintf(path, sizeof(path), "/sys/block/%s", names[0]) >= (int)sizeof(path)) return ENAMETOOLONG;
+    int entry_count = list_dir(path, entries, MAX_PARTITIONS * 4);
+    for (int i = 0; i < entry_count; i++) {
+        if (snprintf(check, sizeof(check), "%s/%s/partition", path, entries[i]) >= (int)sizeof(check)) continue;
+        if (path_exists(check)) strcpy(names[name_count++], entries[i]);
+    }
+
+    // Subscribe before the request so no remove event can slip past
+    int uevent_fd = open_uevent_socket();
+    double t0 = now_ms();
+#ifdef CEJECT_MINI
+    int err = native_power_off(names[0]);
+#else
+    int err = run_udisksctl("power-off", n->target);
+    if (err == ENOENT) err = native_power_off(names[0]);   // udisks not installed
+#endif
+    double accepted = now_ms() - t0;
+    if (err != 0) {
+        if (uevent_fd >= 0) close(uevent_fd);
+        return err;
+    }
+
+    double deadline = t0 + REMOVAL_TIMEOUT_MS;
+    int present = name_count;
+    while (true) {
+        present = 0;
+        for (int i = 0; i < name_count; i++) {
+            if (snprintf(path, sizeof(path), "/sys/class/block/%s", names[i]) >= (int)sizeof(path) ||
+                path_exists(path)) present++;
+        }
+        if (present == 0 || now_ms() >= deadline) break;
+
+        // Uevents wake us promptly; the sysfs check above is authoritative
+        struct pollfd pfd = {uevent_fd, POLLIN, 0};
+        int wait = (int)(deadline - now_ms());
+        poll(&pfd, uevent_fd >= 0 ? 1 : 0, wait < 100 ? wait : 100);
+        Uevent ev;
+        while (uevent_fd >= 0 && read_uevent(uevent_fd, &ev)) {}
+    }
+    if (uevent_fd >= 0) close(uevent_fd);
+
+    double removed = now_ms() - t0;
+    if (present > 0) {
+        log_event(drive, "power-off", "request accepted after %.0f ms, but %d of %d devices still present after %d ms",
+                  accepted, present, name_count, REMOVAL_TIMEOUT_MS);
+        return ETIMEDOUT;
+    }
+
+    record_event(drive, "power-off", "request accepted after %.0f ms, removal confirmed after %.0f ms",
+                 accepted, removed);
+    return 0;
+}
+
+// Disconnect a network block device from its server, then wait until the
+// kernel reports it unconnected
+int step_nbd_disconnect(const PlanNode* n) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "/sys/block/%s/pid", n->device);
+    if (!path_exists(path)) return 0;   // already disconnected
+
+    int fd = open(n->target, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return errno;
+
+    // NBD_DISCONNECT tells the server and stops the queue; NBD_CLEAR_SOCK
+    // drops the socket so the device reads as empty. The latter is
+    // redundant for netlink-configured devices and may fail there.
+    int err = ioctl(fd, NBD_DISCONNECT) == 0 ? 0 : errno;
+    if (err == 0) ioctl(fd, NBD_CLEAR_SOCK);
+    close(fd);
+    if (err != 0) return err;
+
+    double deadline = now_ms() + REMOVAL_TIMEOUT_MS;
+    while (path_exists(path)) {
+        if (now_ms() >= deadline) return ETIMEDOUT;
+        usleep(20000);
+    }
+    return 0;
+}
+
+// Flush the filesystems whose unmounts wait on this node
+int step_flush(const EjectPlan* plan, int node) {
+    int err = 0;
+    bool synced = false;
+
+    for (int i = 0; i < plan->node_count; i++) {
+        const PlanNode* n = &plan->nodes[i];
+        if (n->type != STEP_UNMOUNT) continue;
+
+        for (int j = 0; j < n->dep_count; j++) {
+            if (n->deps[j] != node) continue;
+            int fd = open(n->target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) continue;
+            if (syncfs(fd) != 0) err = errno;
+            synced = true;
+            close(fd);
+        }
+    }
+
+    if (!synced) {
+        int fd = open(plan->nodes[node].target, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            if (fsync(fd) != 0) err = errno;
+            close(fd);
+        }
+    }
+    return err;
+}
+
+// Unmount, falling back to udisksctl when we lack the privilege
+int step_unmount(const PlanNode* n) {
+    if (umount2(n->target, 0) == 0) return 0;
+
+    int err = errno;
+    if (err == EINVAL || err == ENOENT) return 0;   // already gone
+
+#ifndef CEJECT_MINI
+    // Foreign mounts (tmpfs, binds of other filesystems) have no device
+    // for udisks to act on
+    char device[MAX_PATH];
+    snprintf(device, sizeof(device), "/dev/%s", n->device);
+    if (err == EPERM && n->device[0] && path_exists(device)) return run_udisksctl("unmount", device);
+#endif
+    return err;
+}
+
+// Check whether a process has a file descriptor open on the given device
+bool process_has_fd(const char* pid, dev_t rdev, bool* has_fuse) {
+    char path[MAX_PATH], fd_path[MAX_PATH + 300];
+    snprintf(path, sizeof(path), "/proc/%s/fd", pid);
+    DIR* dir = opendir(path);
+    if (dir == NULL) return false;
+
+    struct dirent* entry;
+    bool found = false;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(fd_path, sizeof(fd_path), "%s/%s", path, entry->d_name);
+
+        struct stat st;
+        if (stat(fd_path, &st) != 0) continue;
+        if (S_ISCHR(st.st_mode) && st.st_rdev == makedev(10, 229)) *has_fuse = true;   // /dev/fuse
+        else if (S_ISBLK(st.st_mode) && st.st_rdev == rdev) found = true;
+    }
+    closedir(dir);
+    return found;
+}
+
+// Check whether a process was started with the given path on its command line
+bool process_cmdline_has(const char* pid, const char* arg) {
+    char path[MAX_PATH], buf[MAX_LINE];
+    snprintf(path, sizeof(path), "/proc/%s/cmdline", pid);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) return false;
+    buf[len] = '\0';
+
+    for (char* p = buf; p < buf + len; p += strlen(p) + 1) {
+        if (strcmp(p, arg) == 0) return true;
+    }
+    return false;
+}
+
+// Find the FUSE daemon serving a block device: a process holding /dev/fuse
+// that has the device open, or failing that was given it on its command line
+pid_t find_fuse_daemon(const char* device) {
+    struct stat dev_st;
+    if (stat(device, &dev_st) != 0 || !S_ISBLK(dev_st.st_mode)) return -1;
+
+    DIR* proc = opendir("/proc");
+    if (proc == NULL) return -1;
+
+    pid_t by_fd = -1, by_cmdline = -1;
+    struct dirent* entry;
+    while (by_fd < 0 && (entry = readdir(proc)) != NULL) {
+        if (!isdigit((unsigned char)entry->d_name[0])) continue;
+
+        bool has_fuse = false;
+        bool holds_device = process_has_fd(entry->d_name, dev_st.st_rdev, &has_fuse);
+        if (!has_fuse) continue;
+        if (holds_device) by_fd = atoi(entry->d_name);
+        else if (by_cmdline < 0 && process_cmdline_has(entry->d_name, device)) by_cmdline = atoi(entry->d_name);
+    }
+    closedir(proc);
+    return by_fd >= 0 ? by_fd : by_cmdline;
+}
+
+// Wait, with a deadline, for the FUSE daemon of an unmounted device to exit
+int step_fuse_wait(const PlanNode* n) {
+    pid_t pid = find_fuse_daemon(n->target);
+    if (pid < 0) return 0;   // already gone
+
+    double deadline = now_ms() + FUSE_EXIT_TIMEOUT_MS;
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+
+    if (pidfd >= 0) {
+        struct pollfd pfd = {pidfd, POLLIN, 0};
+        int r;
+        do {
+            int wait = (int)(deadline - now_ms());
+            r = poll(&pfd, 1, wait > 0 ? wait : 0);
+        } while (r < 0 && errno == EINTR);
+        close(pidfd);
+        return r > 0 ? 0 : ETIMEDOUT;
+    }
+    if (errno == ESRCH) return 0;
+
+    // Kernels before 5.3 have no pidfd: poll for the process instead
+    while (kill(pid, 0) == 0 || errno == EPERM) {
+        if (now_ms() >= deadline) return ETIMEDOUT;
+        usleep(20000);
+    }
+    return 0;
+}
+
+// Detach a loop device from its backing file
+int step_loop_detach(const PlanNode* n) {
+    int fd = open(n->target, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno;
+
+    int err = ioctl(fd, LOOP_CLR_FD, 0) == 0 || errno == ENXIO ? 0 : errno;
+    close(fd);
+    return err;
+}
+
+// Remove a device-mapper device (LUKS mapping, LVM volume)
+int step_dm_remove(const PlanNode* n) {
+    unsigned int major, minor;
+    if (!get_block_devnum(n->device, &major, &minor)) return 0;
+
+    struct dm_ioctl dmi;
+    memset(&dmi, 0, sizeof(dmi));
+    dmi.version[0] = DM_VERSION_MAJOR;
+    dmi.version[1] = DM_VERSION_MINOR;
+    dmi.version[2] = DM_VERSION_PATCHLEVEL;
+    dmi.data_size = sizeof(dmi);
+    dmi.data_start = sizeof(dmi);
+    dmi.dev = makedev(major, minor);
+
+    int err;
+    int fd = open("/dev/mapper/control", O_RDWR | O_CLOEXEC);
+    if (fd >= 0) {
+        err = ioctl(fd, DM_DEV_REMOVE, &dmi) == 0 ? 0 : errno;
+        close(fd);
+    } else {
+        err = errno;
+    }
+
+#ifndef CEJECT_MINI
+    // Unprivileged: let udisks lock LUKS containers for us
+    char path[MAX_PATH], uuid[128], slaves[1][64];
+    snprintf(path, sizeof(path), "/sys/class/block/%s/dm/uuid", n->device);
+    if ((err == EACCES || err == EPERM || err == ENOENT) &&
+        read_sysfs_attr(path, uuid, sizeof(uuid)) && strncmp(uuid, "CRYPT-", 6) == 0) {
+        snprintf(path, sizeof(path), "/sys/class/block/%s/slaves", n->device);
+        if (list_dir(path, slaves, 1) == 1) {
+            snprintf(path, sizeof(path), "/dev/%s", slaves[0]);
+            err = run_udisksctl("lock", path);
+        }
+    }
+#endif
+    return err;
+}
+
+// Stop an md array
+int step_md_stop(const PlanNode* n) {
+    int fd = open(n->target, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT ? 0 : errno;
+
+    int err = ioctl(fd, STOP_ARRAY, NULL) == 0 ? 0 : errno;
+    close(fd);
+    return err;
+}
+
+// Carry out one plan step, returning 0 or an errno value
+// Eject only the medium, leaving the reader attached for the next card: let
+// the medium go (the kernel locks it while the device is open), then send
+// the SCSI eject, and wait until the disk reports no medium
+int step_media_eject(const PlanNode* n) {
+    int fd = open(n->target, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return errno;
+    ioctl(fd, SCSI_IOCTL_DOORUNLOCK, 0);
+    int err = ioctl(fd, CDROMEJECT, 0) == 0 ? 0 : errno;
+    close(fd);
+    if (err != 0) return err;
+
+    char path[MAX_PATH], size[32];
+    snprintf(path, sizeof(path), "/sys/block/%s/size", n->device);
+    double deadline = now_ms() + REMOVAL_TIMEOUT_MS;
+    while (read_sysfs_attr(path, size, sizeof(size)) && strcmp(size, "0") != 0) {
+        if (now_ms() >= deadline) return ETIMEDOUT;
+        usleep(20000);
+    }
+    return 0;
+}
+
+int run_step(const EjectPlan* plan, int node) {
+    const PlanNode* n = &plan->nodes[node];
+
+    switch (n->type) {
+        case STEP_FLUSH:       return step_flush(plan, node);
+        case STEP_SWAPOFF:     return swapoff(n->target) == 0 || errno == EINVAL ? 0 : errno;
+        case STEP_UNMOUNT:     return step_unmount(n);
+        case STEP_FUSE_WAIT:   return step_fuse_wait(n);
+        case STEP_LOOP_DETACH: return step_loop_detach(n);
+        case STEP_DM_REMOVE:   return step_dm_remove(n);
+        case STEP_MD_STOP:     return step_md_stop(n);
+        case STEP_RELEASE:     return ENOTSUP;
+        case STEP_POWER_OFF:   return step_power_off(n, plan->drive);
+        case STEP_NBD_DISCONNECT: return step_nbd_disconnect(n);
+        case STEP_MEDIA_EJECT: return step_media_eject(n);
+    }
+    return EINVAL;
+}
+
+// Announce a step as it starts
+void show_step_start(const PlanNode* n) {
+    char buf[64];
+
+    switch (n->type) {
+        case STEP_FLUSH:
+            format_bytes(n->bytes, buf, sizeof(buf));
+            printf("  %s" ARROW "%s Flushing %s (%s pending)...\n", DIM, NC, n->target, buf);
+            break;
+        case STEP_UNMOUNT:
+            if (n->device[0]) printf("  %s" ARROW "%s Unmounting /dev/%s (%s)...\n", DIM, NC, n->device, n->target);
+            else printf("  %s" ARROW "%s Unmounting %s...\n", DIM, NC, n->target);
+            break;
+        case STEP_SWAPOFF:
+            printf("  %s" ARROW "%s Disabling swap on %s...\n", DIM, NC, n->target);
+            break;
+        case STEP_FUSE_WAIT:
+            printf("  %s" ARROW "%s Waiting for the FUSE daemon of %s to exit...\n", DIM, NC, n->target);
+            break;
+        case STEP_LOOP_DETACH:
+        case STEP_DM_REMOVE:
+        case STEP_MD_STOP:
+        case STEP_RELEASE:
+            printf("  %s" ARROW "%s Releasing %s...\n", DIM, NC, n->target);
+            break;
+        case STEP_POWER_OFF:
+            printf("\n%s%s Powering off the drive...%s\n\n", CYAN, ICON_EJECT, NC);
+            break;
+        case STEP_NBD_DISCONNECT:
+            printf("\n%s%s Disconnecting the network block device...%s\n\n", CYAN, ICON_EJECT, NC);
+            break;
+        case STEP_MEDIA_EJECT:
+            printf("\n%s%s Ejecting the medium...%s\n\n", CYAN, ICON_EJECT, NC);
+            break;
+    }
+}
+
+// State shared by execute_plan and its step threads. A step that misses its
+// deadline is abandoned, not cancelled, so this lives until the last
+// thread is done with it; steps read their own copy of the plan.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs;
+    double t0;
+    EjectPlan plan;
+} ExecShared;
+
+// Worker for one plan step
+typedef struct {
+    ExecShared* shared;
+    int node;
+    int err;
+    int attempts;
+    double end_ms;
+    bool finished;
+    bool abandoned;
+} StepJob;
+
+#define STEP_RETRIES 3
+#define STEP_BACKOFF_MS 100
+#define STEP_DEADLINE_MS 60000
+
+// Steps are shallow; small stacks keep many concurrent ejects cheap
+#define STEP_STACK_SIZE (256 * 1024)
+
+// Errors worth retrying: something briefly held the device
+bool step_retryable(StepType type, int err) {
+    if (err != EBUSY && err != EAGAIN) return false;
+    return type == STEP_UNMOUNT || type == STEP_SWAPOFF || type == STEP_LOOP_DETACH ||
+           type == STEP_DM_REMOVE || type == STEP_MD_STOP;
+}
+
+// How long a step may run before the eject gives up on it: four times its
+// estimate, but never less than CEJECT_STEP_DEADLINE_MS (default 60 s)
+double step_deadline_ms(const PlanNode* n) {
+    const char* env = getenv("CEJECT_STEP_DEADLINE_MS");
+    double deadline = env ? atof(env) : STEP_DEADLINE_MS;
+    return n->est_ms * 4 > deadline ? n->est_ms * 4 : deadline;
+}
+
+// Drop a reference to the shared state, freeing it with the last one
+void exec_shared_release(ExecShared* shared) {
+    pthread_mutex_lock(&shared->lock);
+    bool last = --shared->refs == 0;
+    pthread_mutex_unlock(&shared->lock);
+
+    if (last) {
+        pthread_mutex_destroy(&shared->lock);
+        pthread_cond_destroy(&shared->cond);
+        free(shared);
+    }
+}
+
+void* step_thread(void* arg) {
+    StepJob* job = arg;
+    ExecShared* shared = job->shared;
+    const PlanNode* n = &shared->plan.nodes[job->node];
+    int err;
+
+    // Transient busy errors get a few retries with exponential backoff
+    while ((err = backend->run_step(&shared->plan, job->node)) != 0 && step_retryable(n->type, err) &&
+           job->attempts < STEP_RETRIES) {
+        int delay = STEP_BACKOFF_MS << job->attempts++;
+        record_event(shared->plan.drive, "step", "%s %s: %s, retry %d in %d ms", step_names[n->type], n->target,
+                     strerror(err), job->attempts, delay);
+        usleep(delay * 1000);
+
+        pthread_mutex_lock(&shared->lock);
+        bool abandoned = job->abandoned;
+        pthread_mutex_unlock(&shared->lock);
+        if (abandoned) break;
+    }
+
+    pthread_mutex_lock(&shared->lock);
+    job->err = err;
+    job->end_ms = now_ms() - shared->t0;
+    job->finished = true;
+    bool abandoned = job->abandoned;
+    pthread_cond_signal(&shared->cond);
+    pthread_mutex_unlock(&shared->lock);
+
+    // execute_plan frees jobs it collects; abandoned ones are ours
+    if (abandoned) free(job);
+    exec_shared_release(shared);
+    return NULL;
+}
+
+// Told about every step that starts, ends or is skipped, along with the
+// plan's start time; the eject timeline listens here
+static void (*step_observer)(const EjectPlan* plan, int node, double t0);
+
+// Run a plan, starting each step as soon as everything it waits for is done.
+// Steps whose prerequisites failed are skipped, and a step that overruns its
+// deadline fails with ETIMEDOUT. Returns true if all succeeded.
+bool execute_plan(EjectPlan* plan, bool verbose) {
+    ExecShared* shared = malloc(sizeof(*shared));
+    if (shared == NULL) return false;
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&shared->lock, NULL);
+    pthread_cond_init(&shared->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    shared->refs = 1;
+    shared->plan = *plan;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, STEP_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    StepJob* jobs[MAX_PLAN_NODES] = {NULL};
+    bool started[MAX_PLAN_NODES] = {false}, reported[MAX_PLAN_NODES] = {false};
+    double t0 = shared->t0 = now_ms();
+    int running = 0;
+    bool ok = true;
+
+    for (int i = 0; i < plan->node_count; i++) {
+        plan->nodes[i].status = NODE_PENDING;
+        plan->nodes[i].err = 0;
+        plan->nodes[i].attempts = 0;
+        plan->nodes[i].start_ms = plan->nodes[i].end_ms = 0;
+    }
+
+    pthread_mutex_lock(&shared->lock);
+    while (true) {
+        bool progress = false;
+        double now = now_ms() - t0, next_deadline = -1;
+
+        // Collect finished steps, and give up on overdue ones
+        for (int i = 0; i < plan->node_count; i++) {
+            PlanNode* n = &plan->nodes[i];
+            StepJob* job = jobs[i];
+            if (job == NULL) continue;
+
+            if (job->finished) {
+                n->err = job->err;
+                n->end_ms = job->end_ms;
+                n->attempts = job->attempts;
+                n->status = job->err == 0 ? NODE_DONE : NODE_FAILED;
+                free(job);
+                jobs[i] = NULL;
+            } else if (now >= n->start_ms + step_deadline_ms(n)) {
+                job->abandoned = true;
+                jobs[i] = NULL;
+                n->err = ETIMEDOUT;
+                n->end_ms = now;
+                n->status = NODE_FAILED;
+            } else if (next_deadline < 0 || n->start_ms + step_deadline_ms(n) < next_deadline) {
+                next_deadline = n->start_ms + step_deadline_ms(n);
+            }
+        }
+
+        // Report finished steps
+        for (int i = 0; i < plan->node_count; i++) {
+            PlanNode* n = &plan->nodes[i];
+            if (!started[i] || reported[i] || n->status == NODE_RUNNING) continue;
+
+            char took[32], retries[32] = "";
+            format_ms(n->end_ms - n->start_ms, took, sizeof(took));
+            if (n->attempts > 0) snprintf(retries, sizeof(retries), ", %d %s", n->attempts,
+                                          n->attempts == 1 ? "retry" : "retries");
+            if (verbose && n->status == NODE_DONE) {
+                printf("    %s%s %s %s%s %s(%s%s)%s\n", GREEN, ICON_SUCCESS, step_names[n->type], n->target, NC,
+                       DIM, took, retries, NC);
+            } else if (verbose) {
+                printf("    %s%s Failed: %s %s: %s%s\n", RED, ICON_ERROR, step_names[n->type],
+                       n->target, strerror(n->err), NC);
+            }
+            if (n->status == NODE_DONE) {
+                record_event(plan->drive, "step", "%s %s ok %s%s", step_names[n->type], n->target, took, retries);
+            } else {
+                record_event(plan->drive, "step", "%s %s failed: %s%s", step_names[n->type], n->target,
+                             strerror(n->err), retries);
+                ok = false;
+            }
+            reported[i] = true;
+            running--;
+            if (step_observer != NULL) step_observer(plan, i, t0);
+        }
+
+        // Start every step whose prerequisites are complete
+        for (int i = 0; i < plan->node_count; i++) {
+            PlanNode* n = &plan->nodes[i];
+            if (n->status != NODE_PENDING) continue;
+
+            bool ready = true, blocked = false;
+            for (int j = 0; j < n->dep_count; j++) {
+                NodeStatus dep = plan->nodes[n->deps[j]].status;
+                if (dep == NODE_FAILED || dep == NODE_SKIPPED) blocked = true;
+                else if (dep != NODE_DONE) ready = false;
+            }
+
+            if (blocked) {
+                n->status = NODE_SKIPPED;
+                ok = false;
+                progress = true;
+                if (step_observer != NULL) step_observer(plan, i, t0);
+            } else if (ready) {
+                n->status = NODE_RUNNING;
+                n->start_ms = now_ms() - t0;
+                if (verbose) show_step_start(n);
+
+                pthread_t thread;
+                jobs[i] = calloc(1, sizeof(StepJob));
+                if (jobs[i] != NULL) {
+                    *jobs[i] = (StepJob){shared, i, 0, 0, 0, false, false};
+                    shared->refs++;
+                    if (pthread_create(&thread, &attr, step_thread, jobs[i]) != 0) {
+                        shared->refs--;
+                        free(jobs[i]);
+                        jobs[i] = NULL;
+                    }
+                }
+                if (jobs[i] == NULL) {
+                    n->status = NODE_FAILED;
+                    n->err = EAGAIN;
+                    n->end_ms = n->start_ms;
+                }
+                started[i] = true;
+                running++;
+                progress = true;
+                if (step_observer != NULL) step_observer(plan, i, t0);
+            }
+        }
+
+        if (running == 0 && !progress) break;
+        if (progress) continue;
+
+        if (next_deadline < 0) {
+            pthread_cond_wait(&shared->cond, &shared->lock);
+        } else {
+            double wake = t0 + next_deadline;
+            struct timespec ts = {(time_t)(wake / 1000), (long)((wake - (time_t)(wake / 1000) * 1000.0) * 1e6)};
+            pthread_cond_timedwait(&shared->cond, &shared->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&shared->lock);
+
+    pthread_attr_destroy(&attr);
+    exec_shared_release(shared);
+    return ok;
+}
+
+// Fold the measured step durations into the device's learned rates
+void learn_from_run(const EjectPlan* plan) {
+    double unmount_total = 0;
+    int unmount_count = 0;
+    if (backend != &native_backend) return;   // simulated timings say nothing about a device
+
+    for (int i = 0; i < plan->node_count; i++) {
+        const PlanNode* n = &plan->nodes[i];
+        double took = n->end_ms - n->start_ms;
+        if (n->status != NODE_DONE) continue;
+
+        if (n->type == STEP_UNMOUNT) {
+            unmount_total += took;
+            unmount_count++;
+        } else if (n->type == STEP_FLUSH && n->bytes >= 1024 * 1024 && took > 0) {
+            state_learn(plan->identity, "write_bw", n->bytes / (took / 1000));
+        } else if (n->type == STEP_FUSE_WAIT) {
+            state_learn(plan->identity, "fuse_exit_ms", took);
+        } else if (n->type == STEP_POWER_OFF) {
+            state_learn(plan->identity, "poweroff_ms", took);
+        }
+    }
+
+    if (unmount_count > 0) state_learn(plan->identity, "unmount_ms", unmount_total / unmount_count);
+}
+
+// Describe the first failed step of a plan
+void describe_failure(const EjectPlan* plan, char* error, size_t size) {
+    for (int i = 0; i < plan->node_count; i++) {
+        const PlanNode* n = &plan->nodes[i];
+        if (n->status == NODE_FAILED) {
+            snprintf(error, size, "%s %s: %s", step_names[n->type], n->target, strerror(n->err));
+            return;
+        }
+    }
+    snprintf(error, size, "incomplete");
+}
+
+#ifndef CEJECT_MINI
+// Per-device pre/post-eject hooks from hooks.conf:
+//
+//   [backup-db]
+//   label = BACKUP            (or identity = <wwid/serial>)
+//   pre = systemctl stop backup-db
+//   post = /usr/local/bin/notify-ejected
+//   timeout = 30              (seconds)
+//   on-failure = abort        (or continue)
+#define MAX_HOOKS 32
+#define HOOK_DEFAULT_TIMEOUT_MS 30000
+
+typedef struct {
+    char name[64];
+    char identity[128];
+    char label[64];
+    char pre[MAX_PATH];
+    char post[MAX_PATH];
+    int timeout_ms;
+    bool continue_on_failure;
+} HookConfig;
+
+static HookConfig hooks[MAX_HOOKS];
+static int hook_count;
+static bool hooks_loaded;
+static pthread_mutex_t hooks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void hook_config_entry(const char* section, const char* key, const char* value, void* ctx) {
+    (void)ctx;
+    if (section[0] == '\0') return;
+
+    if (hook_count == 0 || strcmp(hooks[hook_count - 1].name, section) != 0) {
+        if (hook_count >= MAX_HOOKS) return;
+        HookConfig* hook = &hooks[hook_count++];
+        memset(hook, 0, sizeof(*hook));
+        snprintf(hook->name, sizeof(hook->name), "%s", section);
+        hook->timeout_ms = HOOK_DEFAULT_TIMEOUT_MS;
+    }
+
+    HookConfig* hook = &hooks[hook_count - 1];
+    if (strcmp(key, "identity") == 0) snprintf(hook->identity, sizeof(hook->identity), "%s", value);
+    else if (strcmp(key, "label") == 0) snprintf(hook->label, sizeof(hook->label), "%s", value);
+    else if (strcmp(key, "pre") == 0) snprintf(hook->pre, sizeof(hook->pre), "%s", value);
+    else if (strcmp(key, "post") == 0) snprintf(hook->post, sizeof(hook->post), "%s", value);
+    else if (strcmp(key, "timeout") == 0) hook->timeout_ms = (int)(atof(value) * 1000);
+    else if (strcmp(key, "on-failure") == 0) hook->continue_on_failure = strcmp(value, "continue") == 0;
+}
+
+// Load hooks.conf once
+void load_hooks(void) {
+    pthread_mutex_lock(&hooks_lock);
+    if (!hooks_loaded) {
+        read_config("hooks.conf", hook_config_entry, NULL);
+        hooks_loaded = true;
+    }
+    pthread_mutex_unlock(&hooks_lock);
+}
+
+// Check whether a hook applies to a drive
+bool hook_matches(const HookConfig* hook, const DriveInfo* drive, const char* identity) {
+    if (hook->identity[0] && strcmp(hook->identity, identity) == 0) return true;
+    for (int i = 0; hook->label[0] && i < drive->label_count; i++) {
+        if (strcmp(hook->label, drive->labels[i]) == 0) return true;
+    }
+    return false;
+}
+
+// A spawned hook process
+typedef struct {
+    const HookConfig* hook;
+    pid_t pid;
+    int fd;
+    double deadline;
+    bool exited;
+    int status;
+    bool timed_out;
+    char buf[MAX_LINE];
+    size_t len;
+} HookRun;
+
+// Start one hook command under /bin/sh with its output on a pipe. Returns
+// 0 or the error that kept it from starting.
+int spawn_hook(HookRun* run, const char* command, const char* phase, const DriveInfo* drive,
+               const char* identity, const char* result) {
+    extern char** environ;
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0) return errno;
+
+    char env_device[MAX_PATH + 16], env_identity[160], env_phase[32], env_result[32], env_label[96];
+    snprintf(env_device, sizeof(env_device), "CEJECT_DEVICE=%s", drive->path);
+    snprintf(env_identity, sizeof(env_identity), "CEJECT_IDENTITY=%s", identity);
+    snprintf(env_phase, sizeof(env_phase), "CEJECT_PHASE=%s", phase);
+    snprintf(env_result, sizeof(env_result), "CEJECT_RESULT=%s", result);
+    snprintf(env_label, sizeof(env_label), "CEJECT_LABEL=%s", drive->label_count ? drive->labels[0] : "");
+
+    int env_count = 0;
+    while (environ[env_count] != NULL) env_count++;
+    char** envp = calloc(env_count + 6, sizeof(char*));
+    if (envp == NULL) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return ENOMEM;
+    }
+    memcpy(envp, environ, env_count * sizeof(char*));
+    envp[env_count++] = env_device;
+    envp[env_count++] = env_identity;
+    envp[env_count++] = env_phase;
+    envp[env_count++] = env_result;
+    envp[env_count++] = env_label;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDERR_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+
+    // Own process group, so a timeout also stops whatever the hook started
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    char* argv[] = {"/bin/sh", "-c", (char*)command, NULL};
+    int err = posix_spawn(&run->pid, "/bin/sh", &actions, &attr, argv, envp);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    free(envp);
+    close(pipefd[1]);
+
+    if (err != 0) {
+        close(pipefd[0]);
+        return err;
+    }
+    run->fd = pipefd[0];
+    run->deadline = now_ms() + run->hook->timeout_ms;
+    return 0;
+}
+
+// Forward complete output lines of a hook to the event stream
+void hook_drain(HookRun* run, const char* drive, bool flush) {
+    char* start = run->buf;
+    char* nl;
+    while ((nl = memchr(start, '\n', run->len - (start - run->buf))) != NULL) {
+        *nl = '\0';
+        log_event(drive, "hook", "%s: %s", run->hook->name, start);
+        start = nl + 1;
+    }
+    run->len -= start - run->buf;
+    memmove(run->buf, start, run->len);
+
+    if (flush && run->len > 0) {
+        run->buf[run->len] = '\0';
+        log_event(drive, "hook", "%s: %s", run->hook->name, run->buf);
+        run->len = 0;
+    }
+}
+
+// Stop hooks already started when the eject is abandoned: SIGTERM to each
+// process group, SIGKILL to those still running after the grace period
+#define HOOK_STOP_GRACE_MS 1000
+
+void stop_hooks(HookRun runs[], int run_count, const char* drive) {
+    for (int i = 0; i < run_count; i++) kill(-runs[i].pid, SIGTERM);
+
+    double deadline = now_ms() + HOOK_STOP_GRACE_MS;
+    for (int i = 0; i < run_count; i++) {
+        HookRun* run = &runs[i];
+        while (waitpid(run->pid, &run->status, WNOHANG) != run->pid) {
+            if (now_ms() >= deadline) {
+                kill(-run->pid, SIGKILL);
+                waitpid(run->pid, &run->status, 0);
+                break;
+            }
+            struct timespec ts = {0, 10 * 1000000};
+            nanosleep(&ts, NULL);
+        }
+        run->exited = true;
+        kill(-run->pid, SIGKILL);   // whatever the hook started and left behind
+
+        if (run->fd >= 0) {
+            fcntl(run->fd, F_SETFL, O_NONBLOCK);
+            ssize_t r;
+            while ((r = read(run->fd, run->buf + run->len, sizeof(run->buf) - 1 - run->len)) > 0) {
+                run->len += r;
+                hook_drain(run, drive, run->len == sizeof(run->buf) - 1);
+            }
+            close(run->fd);
+            run->fd = -1;
+        }
+        hook_drain(run, drive, true);
+        log_event(drive, "hook", "%s: stopped, the eject was abandoned", run->hook->name);
+    }
+}
+
+// Run the matching pre or post hooks of a drive concurrently, each under its
+// own deadline. Returns false if a hook that must succeed did not.
+bool run_hooks(bool pre, const DriveInfo* drive, const char* identity, const char* result,
+               char* error, size_t size) {
+    HookRun runs[MAX_HOOKS];
+    int run_count = 0;
+    const char* phase = pre ? "pre" : "post";
+
+    load_hooks();
+    for (int i = 0; i < hook_count; i++) {
+        const char* command = pre ? hooks[i].pre : hooks[i].post;
+        if (command[0] == '\0' || !hook_matches(&hooks[i], drive, identity)) continue;
+
+        HookRun* run = &runs[run_count];
+        memset(run, 0, sizeof(*run));
+        run->hook = &hooks[i];
+        int err = spawn_hook(run, command, phase, drive, identity, result);
+        if (err == 0) {
+            record_event(drive->path, "hook", "%s: %s-eject hook started", hooks[i].name, phase);
+            run_count++;
+        } else {
+            log_event(drive->path, "hook", "%s: cannot start: %s", hooks[i].name, strerror(err));
+            if (pre && !hooks[i].continue_on_failure) {
+                snprintf(error, size, "pre-eject hook %s could not start", hooks[i].name);
+                stop_hooks(runs, run_count, drive->path);
+                return false;
+            }
+        }
+    }
+
+    int remaining = run_count;
+    while (remaining > 0) {
+        struct pollfd fds[MAX_HOOKS];
+        double now = now_ms(), next_deadline = now + 1000;
+
+        for (int i = 0; i < run_count; i++) {
+            fds[i].fd = runs[i].exited ? -1 : runs[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+            if (!runs[i].exited && runs[i].deadline < next_deadline) next_deadline = runs[i].deadline;
+        }
+
+        // Wake up at the nearest deadline, and periodically for hooks whose
+        // output pipe closed before they exited
+        int wait = (int)(next_deadline - now);
+        if (wait < 0) wait = 0;
+        if (wait > 20) wait = 20;
+        poll(fds, run_count, wait);
+
+        for (int i = 0; i < run_count; i++) {
+            HookRun* run = &runs[i];
+            if (run->exited) continue;
+
+            if (run->fd >= 0 && (fds[i].revents & (POLLIN | POLLHUP))) {
+                ssize_t r = read(run->fd, run->buf + run->len, sizeof(run->buf) - 1 - run->len);
+                if (r > 0) {
+                    run->len += r;
+                    if (run->len == sizeof(run->buf) - 1) hook_drain(run, drive->path, true);
+                    else hook_drain(run, drive->path, false);
+                } else if (r == 0) {
+                    close(run->fd);
+                    run->fd = -1;
+                }
+            }
+
+            if (waitpid(run->pid, &run->status, WNOHANG) == run->pid) {
+                run->exited = true;
+            } else if (now_ms() >= run->deadline) {
+                kill(-run->pid, SIGKILL);
+                waitpid(run->pid, &run->status, 0);
+                run->exited = true;
+                run->timed_out = true;
+            }
+
+            if (run->exited) {
+                if (run->fd >= 0) {
+                    close(run->fd);
+                    run->fd = -1;
+                }
+                hook_drain(run, drive->path, true);
+                remaining--;
+            }
+        }
+    }
+
+    bool ok = true;
+    for (int i = 0; i < run_count; i++) {
+        HookRun* run = &runs[i];
+        bool failed = run->timed_out || !WIFEXITED(run->status) || WEXITSTATUS(run->status) != 0;
+
+        if (run->timed_out) {
+            log_event(drive->path, "hook", "%s: %s-eject hook killed after %d s", run->hook->name, phase,
+                      run->hook->timeout_ms / 1000);
+        } else if (failed) {
+            log_event(drive->path, "hook", "%s: %s-eject hook failed (status %d)", run->hook->name, phase,
+                      WIFEXITED(run->status) ? WEXITSTATUS(run->status) : -1);
+        } else {
+            record_event(drive->path, "hook", "%s: %s-eject hook done", run->hook->name, phase);
+        }
+
+        if (failed && pre && !run->hook->continue_on_failure && ok) {
+            snprintf(error, size, "pre-eject hook %s %s", run->hook->name, run->timed_out ? "timed out" : "failed");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+#else
+// Hooks run under /bin/sh, which a rescue image may not have
+bool run_hooks(bool pre, const DriveInfo* drive, const char* identity, const char* result,
+               char* error, size_t size) {
+    (void)pre, (void)drive, (void)identity, (void)result, (void)size;
+    error[0] = '\0';
+    return true;
+}
+#endif
+
+// Eject one drive: pre-eject hooks, the teardown plan, post-eject hooks.
+// Drives ejected together each run this in their own thread, so hooks of one
+// drive never hold up another.
+bool eject_drive(EjectPlan* plan, const DriveInfo* drive, bool verbose, char* error, size_t size) {
+    error[0] = '\0';
+    if (!run_hooks(true, drive, plan->identity, "pending", error, size)) {
+        log_event(plan->drive, "eject", "aborted: %s", error);
+        return false;
+    }
+
+    bool ok = execute_plan(plan, verbose);
+    untune_drive(dev_name(plan->drive));
+    learn_from_run(plan);
+    if (!ok) describe_failure(plan, error, size);
+    record_event(plan->drive, "eject", "%s%s", ok ? "done" : "failed: ", ok ? "" : error);
+
+    char hook_error[MAX_LINE];
+    run_hooks(false, drive, plan->identity, ok ? "ok" : "failed", hook_error, sizeof(hook_error));
+    return ok;
+}
+
+#ifndef CEJECT_MINI
+// Read a line from stdin without stdio buffering, so poll() stays accurate
+bool read_line(char* buf, size_t size) {
+    size_t len = 0;
+    char c;
+
+    while (true) {
+        ssize_t r = read(STDIN_FILENO, &c, 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            if (len == 0) return false;
+            break;
+        }
+        if (c == '\n') break;
+        if (len < size - 1) buf[len++] = c;
+    }
+
+    buf[len] = '\0';
+    return true;
+}
+
+// Wait for the user to press Enter
+void wait_for_enter(void) {
+    char line[MAX_LINE];
+    read_line(line, sizeof(line));
+}
+
+// Interactive latency accounting (hidden --ui-stats flag)
+#define LATENCY_BUCKETS 24
+#define UI_LATENCY_BUDGET_MS 50
+
+typedef struct {
+    unsigned long counts[LATENCY_BUCKETS];   // bucket i holds [2^i, 2^(i+1)) µs
+    unsigned long samples;
+    unsigned long over_budget;
+    double max_us;
+} LatencyHistogram;
+
+typedef enum { UI_KEY, UI_REFRESH } UiEventKind;
+
+typedef struct {
+    bool enabled;
+    bool pending;
+    UiEventKind kind;
+    double t_input;
+    double t_model;
+    LatencyHistogram total[2];
+    LatencyHistogram update[2];
+    LatencyHistogram paint[2];
+} UiStats;
+
+static UiStats ui_stats;
+
+// Add a sample to a histogram
+void histogram_add(LatencyHistogram* h, double us) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && us >= (double)(2UL << bucket)) bucket++;
+    h->counts[bucket]++;
+    h->samples++;
+    if (us > h->max_us) h->max_us = us;
+    if (us > UI_LATENCY_BUDGET_MS * 1000.0) h->over_budget++;
+}
+
+// Upper bound of the bucket holding the given percentile, in µs
+double histogram_percentile(const LatencyHistogram* h, double pct) {
+    if (h->samples == 0) return 0;
+
+    unsigned long rank = (unsigned long)(h->samples * pct / 100.0 + 0.5), seen = 0;
+    if (rank == 0) rank = 1;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) return (double)(2UL << i) < h->max_us ? (double)(2UL << i) : h->max_us;
+    }
+    return h->max_us;
+}
+
+// Input arrived (keypress or kernel notification)
+void ui_stats_input(UiEventKind kind, double t) {
+    if (!ui_stats.enabled || ui_stats.pending) return;
+    ui_stats.pending = true;
+    ui_stats.kind = kind;
+    ui_stats.t_input = ui_stats.t_model = t;
+}
+
+// The model reflects the input
+void ui_stats_model(void) {
+    if (ui_stats.pending) ui_stats.t_model = now_ms();
+}
+
+// The resulting frame has been written to the terminal
+void ui_stats_frame(void) {
+    if (!ui_stats.pending) return;
+    fflush(stdout);
+
+    double t = now_ms();
+    int k = ui_stats.kind;
+    histogram_add(&ui_stats.total[k], (t - ui_stats.t_input) * 1000);
+    histogram_add(&ui_stats.update[k], (ui_stats.t_model - ui_stats.t_input) * 1000);
+    histogram_add(&ui_stats.paint[k], (t - ui_stats.t_model) * 1000);
+    ui_stats.pending = false;
+}
+
+// One-line latency summary under the menu
+void show_ui_stats_footer(void) {
+    if (!ui_stats.enabled) return;
+
+    const LatencyHistogram* keys = &ui_stats.total[UI_KEY];
+    const LatencyHistogram* refresh = &ui_stats.total[UI_REFRESH];
+
+    printf("%skeys p50 %.1f ms p99 %.1f ms (n=%lu) · refresh p50 %.1f ms p99 %.1f ms (n=%lu) · over %d ms: %lu%s\n\n",
+           DIM, histogram_percentile(keys, 50) / 1000, histogram_percentile(keys, 99) / 1000, keys->samples,
+           histogram_percentile(refresh, 50) / 1000, histogram_percentile(refresh, 99) / 1000,
+           refresh->samples, UI_LATENCY_BUDGET_MS, keys->over_budget + refresh->over_budget, NC);
+}
+
+// Print a histogram
+void show_histogram(FILE* out, const char* label, const LatencyHistogram* h) {
+    if (h->samples == 0) return;
+
+    fprintf(out, "%s: n=%lu p50≤%.0fµs p90≤%.0fµs p99≤%.0fµs max=%.0fµs", label, h->samples,
+            histogram_percentile(h, 50), histogram_percentile(h, 90), histogram_percentile(h, 99), h->max_us);
+    if (h->over_budget > 0) fprintf(out, " over-budget=%lu", h->over_budget);
+    fputc('\n', out);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (h->counts[i] == 0) continue;
+        fprintf(out, "  <%8luµs %6lu ", 2UL << i, h->counts[i]);
+        for (unsigned long j = 0; j < h->counts[i] * 40 / h->samples + 1; j++) fputc('#', out);
+        fputc('\n', out);
+    }
+}
+
+// Full latency report at exit
+void show_ui_stats_report(void) {
+    if (!ui_stats.enabled) return;
+
+    const char* kinds[] = {"key", "refresh"};
+    fprintf(stderr, "\nUI latency (input → model → frame), budget %d ms\n", UI_LATENCY_BUDGET_MS);
+    for (int k = 0; k < 2; k++) {
+        char label[64];
+        snprintf(label, sizeof(label), "%s input→frame", kinds[k]);
+        show_histogram(stderr, label, &ui_stats.total[k]);
+        snprintf(label, sizeof(label), "%s input→model", kinds[k]);
+        show_histogram(stderr, label, &ui_stats.update[k]);
+        snprintf(label, sizeof(label), "%s model→frame", kinds[k]);
+        show_histogram(stderr, label, &ui_stats.paint[k]);
+    }
+}
+
+// Read-throughput probe: short O_DIRECT sequential reads at a few queue
+// depths, through Linux AIO so a depth really is that many requests in flight
+#define PROBE_BLOCK (1024 * 1024)
+#define PROBE_MAX_DEPTH 16
+#define PROBE_REGION (128LL * 1024 * 1024)
+#define PROBE_MS_PER_DEPTH 1500
+
+static const int probe_depths[] = {1, 4, PROBE_MAX_DEPTH};
+#define PROBE_DEPTH_COUNT (int)(sizeof(probe_depths) / sizeof(probe_depths[0]))
+
+typedef struct {
+    int depth;
+    long long bytes;
+    double ms;
+    double bw;                      // bytes per second
+    LatencyHistogram latency;
+} ProbeResult;
+
+// Read one region with `depth` requests in flight, until it ends or the time is up
+bool probe_depth(int fd, aio_context_t ctx, void* bufs[], long long offset, long long limit,
+                 ProbeResult* result) {
+    struct iocb cbs[PROBE_MAX_DEPTH], *cbp[1];
+    struct io_event events[PROBE_MAX_DEPTH];
+    double submitted[PROBE_MAX_DEPTH];
+    long long next = offset, end = offset + limit;
+    int inflight = 0;
+    double start = now_ms();
+
+    for (int slot = 0; slot < result->depth && next < end; slot++) {
+        memset(&cbs[slot], 0, sizeof(cbs[slot]));
+        cbs[slot].aio_lio_opcode = IOCB_CMD_PREAD;
+        cbs[slot].aio_fildes = fd;
+        cbs[slot].aio_buf = (uintptr_t)bufs[slot];
+        cbs[slot].aio_nbytes = PROBE_BLOCK;
+        cbs[slot].aio_data = slot;
+        cbs[slot].aio_offset = next;
+        cbp[0] = &cbs[slot];
+        submitted[slot] = now_ms();
+        if (syscall(SYS_io_submit, ctx, 1, cbp) != 1) return false;
+        next += PROBE_BLOCK;
+        inflight++;
+    }
+
+    while (inflight > 0) {
+        struct timespec timeout = {5, 0};
+        long r = syscall(SYS_io_getevents, ctx, 1, PROBE_MAX_DEPTH, events, &timeout);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            if (r == 0) errno = ETIMEDOUT;
+            return false;
+        }
+
+        double now = now_ms();
+        for (long i = 0; i < r; i++) {
+            int slot = (int)events[i].data;
+            inflight--;
+            if (events[i].res < 0) {
+                errno = (int)-events[i].res;
+                return false;
+            }
+            result->bytes += events[i].res;
+            histogram_add(&result->latency, (now - submitted[slot]) * 1000);
+
+            // Keep the queue full until the region or the time budget runs out
+            if (events[i].res < PROBE_BLOCK || next >= end || now - start >= PROBE_MS_PER_DEPTH) continue;
+            cbs[slot].aio_offset = next;
+            cbp[0] = &cbs[slot];
+            submitted[slot] = now;
+            if (syscall(SYS_io_submit, ctx, 1, cbp) != 1) return false;
+            next += PROBE_BLOCK;
+            inflight++;
+        }
+    }
+
+    result->ms = now_ms() - start;
+    result->bw = result->ms > 0 ? result->bytes / (result->ms / 1000) : 0;
+    return true;
+}
+
+// Probe a block device at every queue depth. Only reads; each depth gets
+// its own region so the drive's cache does not serve a later pass.
+bool probe_device(const char* path, ProbeResult results[], char* error, size_t size) {
+    int fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(error, size, "cannot open %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    unsigned long long device_bytes = 0;
+    if (ioctl(fd, BLKGETSIZE64, &device_bytes) != 0 || device_bytes < PROBE_BLOCK) {
+        snprintf(error, size, "cannot size %s", path);
+        close(fd);
+        return false;
+    }
+
+    aio_context_t ctx = 0;
+    if (syscall(SYS_io_setup, PROBE_MAX_DEPTH, &ctx) != 0) {
+        snprintf(error, size, "asynchronous I/O unavailable: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    // Aligned for O_DIRECT on any logical block size
+    void* bufs[PROBE_MAX_DEPTH] = {NULL};
+    bool ok = true;
+    for (int i = 0; i < PROBE_MAX_DEPTH && ok; i++) {
+        ok = posix_memalign(&bufs[i], 4096, PROBE_BLOCK) == 0;
+    }
+    if (!ok) snprintf(error, size, "out of memory");
+
+    for (int d = 0; d < PROBE_DEPTH_COUNT && ok; d++) {
+        long long offset = d * PROBE_REGION;
+        if (offset + PROBE_REGION > (long long)device_bytes) offset = 0;
+        long long limit = (long long)device_bytes - offset < PROBE_REGION ?
+                          (long long)device_bytes - offset : PROBE_REGION;
+
+        memset(&results[d], 0, sizeof(results[d]));
+        results[d].depth = probe_depths[d];
+        if (!probe_depth(fd, ctx, bufs, offset, limit, &results[d])) {
+            snprintf(error, size, "read failed at queue depth %d: %s", probe_depths[d], strerror(errno));
+            ok = false;
+        }
+    }
+
+    // Destroying the context waits for requests still in flight
+    syscall(SYS_io_destroy, ctx);
+    for (int i = 0; i < PROBE_MAX_DEPTH; i++) free(bufs[i]);
+    close(fd);
+    return ok;
+}
+
+// Probe a drive, print the results and remember its best throughput
+bool probe_drive(const DriveInfo* drive, bool json) {
+    ProbeResult results[PROBE_DEPTH_COUNT];
+    char identity[128], error[MAX_LINE];
+    get_drive_identity(dev_name(drive->path), identity, sizeof(identity));
+
+    if (!json) {
+        printf("\n%s%s Probing read throughput of %s...%s\n", BOLD, CYAN, drive->path, NC);
+        fflush(stdout);
+    }
+
+    if (!probe_device(drive->path, results, error, sizeof(error))) {
+        log_event(drive->path, "probe", "failed: %s", error);
+        if (json) {
+            printf("{\"path\":");
+            json_string(stdout, drive->path);
+            printf(",\"error\":");
+            json_string(stdout, error);
+            printf("}\n");
+        } else {
+            printf("%s%s Probe failed: %s%s\n", RED, ICON_ERROR, error, NC);
+        }
+        return false;
+    }
+
+    double best = 0;
+    for (int d = 0; d < PROBE_DEPTH_COUNT; d++) {
+        if (results[d].bw > best) best = results[d].bw;
+    }
+    state_set(identity, "read_bw", best);
+    record_event(drive->path, "probe", "read %.1f MB/s", best / 1e6);
+
+    if (json) {
+        printf("{\"path\":");
+        json_string(stdout, drive->path);
+        printf(",\"identity\":");
+        json_string(stdout, identity);
+        printf(",\"read_bw\":%.0f,\"depths\":[", best);
+        for (int d = 0; d < PROBE_DEPTH_COUNT; d++) {
+            printf("%s{\"depth\":%d,\"bytes\":%lld,\"ms\":%.1f,\"bw\":%.0f,\"p50_us\":%.0f,\"p99_us\":%.0f}",
+                   d ? "," : "", results[d].depth, results[d].bytes, results[d].ms, results[d].bw,
+                   histogram_percentile(&results[d].latency, 50), histogram_percentile(&results[d].latency, 99));
+        }
+        printf("]}\n");
+        return true;
+    }
+
+    for (int d = 0; d < PROBE_DEPTH_COUNT; d++) {
+        char read[32], p50[32], p99[32];
+        format_bytes(results[d].bytes, read, sizeof(read));
+        format_ms(histogram_percentile(&results[d].latency, 50) / 1000, p50, sizeof(p50));
+        format_ms(histogram_percentile(&results[d].latency, 99) / 1000, p99, sizeof(p99));
+        printf("  %sQD %-2d%s %8.1f MB/s  %s%s in %.1f s · latency p50 %s p99 %s%s\n", YELLOW, results[d].depth,
+               NC, results[d].bw / 1e6, DIM, read, results[d].ms / 1000, p50, p99, NC);
+    }
+    printf("%s%s Sequential read: %.1f MB/s (saved for eject estimates)%s\n", GREEN, ICON_SUCCESS, best / 1e6, NC);
+    return true;
+}
+
+// Non-interactive probe
+int run_probe(const char* id, bool json) {
+    static DriveInfo drives[MAX_DRIVES];
+    int count = get_drives(drives, MAX_DRIVES);
+    int index = id ? resolve_drive(drives, count, id) : -1;
+
+    if (index < 0) {
+        fprintf(stderr, "ceject: no external drive matches '%s'\n", id ? id : "");
+        return 1;
+    }
+    return probe_drive(&drives[index], json) ? 0 : 1;
+}
+
+// Display drives
+void show_drives(DriveInfo drives[], const Readiness ready[], int count, const char* incident) {
+    show_header();
+    if (incident[0]) printf("%s%s %s%s\n\n", RED, ICON_WARNING, incident, NC);
+    
+    if (count == 0) {
+        printf("%s%s No external drives found.%s\n\n", RED, ICON_ERROR, NC);
+        printf("Press Enter to exit...");
+        fflush(stdout);
+        wait_for_enter();
+        exit(1);
+    }
+    
+    printf("%s%sAvailable Drives:%s\n", BOLD, GREEN, NC);
+    printf("%s" RULE "%s\n\n", DIM, NC);
+    
+    for (int i = 0; i < count; i++) {
+        DriveInfo* drive = &drives[i];
+        
+        // Build friendly name
+        char friendly_name[256];
+        get_friendly_name(drive, friendly_name, sizeof(friendly_name));
+        
+        // Mount info
+        const char* mount_info;
+        char mount_extra[64] = "";
+        
+        if (drive->mount_count > 0) {
+            mount_info = GREEN ICON_MOUNTED " Mounted" NC;
+            if (drive->mount_count > 3) {
+                snprintf(mount_extra, sizeof(mount_extra), " (%d locations)", drive->mount_count);
+            }
+        } else {
+            mount_info = DIM ICON_UNMOUNTED " Not mounted" NC;
+        }
+        
+        // Connection type
+        const char* conn_icon = ICON_USB;
+        const char* conn_type = "USB";
+        
+        if (strcmp(drive->transport, "sata") == 0) {
+            conn_icon = "💿";
+            conn_type = "SATA";
+        } else if (strcmp(drive->transport, "nvme") == 0) {
+            conn_icon = "⚡";
+            conn_type = "NVMe";
+        } else if (strcmp(drive->transport, "nbd") == 0) {
+            conn_icon = "🌐";
+            conn_type = "Network block device";
+        }
+        
+        // Display drive info
+        printf("%s%s[%d]%s %s %s%s%s\n", BOLD, YELLOW, i + 1, NC, conn_icon, BOLD, friendly_name, NC);
+        printf("    %s├─%s %sDevice:%s %s\n", DIM, NC, CYAN, NC, drive->path);
+        printf("    %s├─%s %sSize:%s %s\n", DIM, NC, CYAN, NC, drive->size);
+        if (drive->link_mbps > 0) {
+            char link[32], capable[32];
+            format_link_speed(drive->link_mbps, link, sizeof(link));
+            printf("    %s├─%s %sType:%s %s %s · %s%s%s\n", DIM, NC, CYAN, NC, conn_type, drive->usb_version, link,
+                   drive->usb_driver[0] ? " · " : "", drive->usb_driver);
+
+            if (usb_link_degraded(drive)) {
+                double expected = drive->port_mbps > 0 && drive->port_mbps < drive->device_mbps ?
+                                  drive->port_mbps : drive->device_mbps;
+                format_link_speed(expected, capable, sizeof(capable));
+                printf("    %s│%s  %s%s Running at %s; drive and port support %s (check cable/port)%s\n",
+                       DIM, NC, YELLOW, ICON_WARNING, link, capable, NC);
+            }
+            if (strcmp(drive->usb_driver, "usb-storage") == 0 && drive->link_mbps >= 5000) {
+                printf("    %s│%s  %s%s Using usb-storage (BOT) rather than UAS%s\n", DIM, NC, DIM, ICON_WARNING, NC);
+            }
+        } else {
+            printf("    %s├─%s %sType:%s %s\n", DIM, NC, CYAN, NC, conn_type);
+        }
+        const char* profile = get_tuning_profile(dev_name(drive->path));
+        if (profile) printf("    %s├─%s %sTuning:%s %s\n", DIM, NC, CYAN, NC, profile);
+        const PolicyRule* rule = policy_rule(drive->policy_mask, 0);
+        if (rule != NULL) {
+            char actions[64];
+            format_policy_actions(drive->policy_actions, actions, sizeof(actions));
+            printf("    %s├─%s %sPolicy:%s %s%s%s%s\n", DIM, NC, CYAN, NC, rule->name, actions[0] ? " (" : "",
+                   actions, actions[0] ? ")" : "");
+        }
+        const char* ready_colors[] = {GREEN, YELLOW, YELLOW, RED};
+        printf("    %s├─%s %sEject:%s %s%s%s %s(%s)%s\n", DIM, NC, CYAN, NC, ready_colors[ready[i].state],
+               ready_names[ready[i].state], NC, DIM, ready[i].reason, NC);
+        printf("    %s└─%s %sStatus:%s %s%s\n", DIM, NC, CYAN, NC, mount_info, mount_extra);
+        
+        // Show mount points if mounted and count <= 3
+        if (drive->mount_count > 0 && drive->mount_count <= 3) {
+            for (int j = 0; j < drive->mount_count; j++) {
+                printf("       %s" ARROW "%s %s\n", DIM, NC, drive->mountpoints[j]);
+            }
+        }
+        printf("\n");
+    }
+    
+    printf("%s" RULE "%s\n", DIM, NC);
+}
+
+#endif
+
+// Per-step timing breakdown of an executed plan
+void show_timing(const EjectPlan* plan) {
+    char start[32], end[32], took[32];
+    double total = 0;
+    
+    printf("%s%sTiming:%s\n", BOLD, CYAN, NC);
+    for (int i = 0; i < plan->node_count; i++) {
+        const PlanNode* n = &plan->nodes[i];
+        if (n->status != NODE_DONE && n->status != NODE_FAILED) continue;
+        
+        format_ms(n->start_ms, start, sizeof(start));
+        format_ms(n->end_ms, end, sizeof(end));
+        format_ms(n->end_ms - n->start_ms, took, sizeof(took));
+        printf("  %s%-12s%s %-32s %s%8s " ARROW " %8s%s  %s\n", n->status == NODE_DONE ? "" : RED, step_names[n->type],
+               n->status == NODE_DONE ? "" : NC, n->target, DIM, start, end, NC, took);
+        if (n->end_ms > total) total = n->end_ms;
+    }
+    format_ms(total, took, sizeof(took));
+    printf("  %sTotal:%s %s\n\n", BOLD, NC, took);
+}
+
+#ifndef CEJECT_MINI
+// Eject timeline: when each phase of every drive's teardown ran. Filled in
+// through step_observer, drawn live while several drives eject at once,
+// and kept until the next eject for the [g] view and trace export.
+#define TIMELINE_PHASES 4
+#define TIMELINE_INTERVAL_MS 100
+#define TIMELINE_LABEL_WIDTH 16
+#define TIMELINE_MAX_ROWS 128
+#define TIMELINE_MAX_COLS 240
+#define TIMELINE_TOP_ROW 7   // below show_header() and the selection line
+
+static const char* phase_names[TIMELINE_PHASES] = {"flush", "unmount", "holders", "power-off"};
+
+typedef struct {
+    StepType type;
+    NodeStatus status;
+    int err;
+    double start_ms;   // since the timeline began
+    double end_ms;
+    char target[64];   // a label: long paths are cut
+} TimelineStep;
+
+typedef struct {
+    char drive[MAX_PATH];
+    TimelineStep steps[MAX_PLAN_NODES];
+    int step_count;
+    bool finished;
+    bool ok;
+    double end_ms;
+    char error[128];
+} TimelineRun;
+
+// One character cell of the panel; frames are diffed cell by cell
+typedef struct {
+    char glyph[4];
+    unsigned char color;
+} TimelineCell;
+
+enum { TL_PLAIN, TL_DIM, TL_BOLD, TL_GREEN, TL_RED, TL_YELLOW };
+static const char* timeline_colors[] = {"", DIM, BOLD, GREEN, RED, YELLOW};
+
+static TimelineRun timeline_runs[MAX_DRIVES];
+static int timeline_count;
+static double timeline_t0;
+static time_t timeline_started;
+static pthread_mutex_t timeline_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Which bar of the timeline a step belongs to
+int step_phase(StepType type) {
+    switch (type) {
+        case STEP_FLUSH: return 0;
+        case STEP_SWAPOFF: case STEP_UNMOUNT: case STEP_FUSE_WAIT: return 1;
+        case STEP_LOOP_DETACH: case STEP_DM_REMOVE: case STEP_MD_STOP: case STEP_RELEASE: return 2;
+        default: return 3;
+    }
+}
+
+TimelineRun* timeline_find(const char* drive) {
+    for (int i = 0; i < timeline_count; i++) {
+        if (strcmp(timeline_runs[i].drive, drive) == 0) return &timeline_runs[i];
+    }
+    return NULL;
+}
+
+void timeline_observe(const EjectPlan* plan, int node, double t0) {
+    pthread_mutex_lock(&timeline_lock);
+    TimelineRun* run = timeline_find(plan->drive);
+    if (run != NULL && node < run->step_count) {
+        const PlanNode* n = &plan->nodes[node];
+        TimelineStep* step = &run->steps[node];
+        step->status = n->status;
+        step->err = n->err;
+        step->start_ms = t0 + n->start_ms - timeline_t0;
+        step->end_ms = t0 + n->end_ms - timeline_t0;
+    }
+    pthread_mutex_unlock(&timeline_lock);
+}
+
+// Forget the previous eject and start timing a new one
+void timeline_begin(void) {
+    pthread_mutex_lock(&timeline_lock);
+    timeline_count = 0;
+    timeline_t0 = now_ms();
+    timeline_started = time(NULL);
+    step_observer = timeline_observe;
+    pthread_mutex_unlock(&timeline_lock);
+}
+
+// Add a drive about to be ejected, with its steps still pending
+void timeline_add(const EjectPlan* plan) {
+    pthread_mutex_lock(&timeline_lock);
+    if (timeline_count < MAX_DRIVES) {
+        TimelineRun* run = &timeline_runs[timeline_count++];
+        memset(run, 0, sizeof(*run));
+        snprintf(run->drive, sizeof(run->drive), "%s", plan->drive);
+        run->step_count = plan->node_count;
+        for (int i = 0; i < plan->node_count; i++) {
+            run->steps[i].type = plan->nodes[i].type;
+            run->steps[i].status = NODE_PENDING;
+            snprintf(run->steps[i].target, sizeof(run->steps[i].target), "%.63s", plan->nodes[i].target);
+        }
+    }
+    pthread_mutex_unlock(&timeline_lock);
+}
+
+void timeline_finish(const char* drive, bool ok, const char* error) {
+    pthread_mutex_lock(&timeline_lock);
+    TimelineRun* run = timeline_find(drive);
+    if (run != NULL) {
+        run->finished = true;
+        run->ok = ok;
+        run->end_ms = now_ms() - timeline_t0;
+        snprintf(run->error, sizeof(run->error), "%.127s", error);
+    }
+    pthread_mutex_unlock(&timeline_lock);
+}
+
+void timeline_put(TimelineCell* cell, const char* glyph, unsigned char color) {
+    snprintf(cell->glyph, sizeof(cell->glyph), "%s", glyph);
+    cell->color = color;
+}
+
+// Write ASCII text into a row of cells, clipped at the right edge
+void timeline_text(TimelineCell* row, int col, int cols, const char* text, unsigned char color) {
+    for (; *text && col < cols; text++, col++) {
+        char c[2] = {*text & 0x80 ? '?' : *text, '\0'};
+        timeline_put(&row[col], c, color);
+    }
+}
+
+// Milliseconds per column: the first round value that fits the run so far
+double timeline_scale(double span_ms, int width) {
+    static const double scales[] = {10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 30000, 60000};
+    int count = sizeof(scales) / sizeof(scales[0]);
+    for (int i = 0; i < count; i++) {
+        if (scales[i] * width >= span_ms) return scales[i];
+    }
+    return scales[count - 1];
+}
+
+// Lay out the panel at time now: a header row per drive, then one bar per
+// phase its plan has. Returns the rows used; *running counts unfinished drives.
+int timeline_frame(TimelineCell frame[][TIMELINE_MAX_COLS], int max_rows, int cols, double now, int* running) {
+    int width = cols - TIMELINE_LABEL_WIDTH, rows = 0;
+    char buf[MAX_LINE], took[32];
+
+    pthread_mutex_lock(&timeline_lock);
+    double span = 0;
+    *running = 0;
+    for (int i = 0; i < timeline_count; i++) {
+        const TimelineRun* run = &timeline_runs[i];
+        double end = run->finished ? run->end_ms : now;
+        if (end > span) span = end;
+        if (!run->finished) (*running)++;
+    }
+    double scale = timeline_scale(span, width);
+
+    for (int r = 0; r < max_rows; r++) {
+        for (int c = 0; c < cols; c++) timeline_put(&frame[r][c], " ", TL_PLAIN);
+    }
+
+    format_ms(span, took, sizeof(took));
+    snprintf(buf, sizeof(buf), "Eject timeline (%s%s)", took, *running > 0 ? " so far" : "");
+    timeline_text(frame[rows++], 0, cols, buf, TL_BOLD);
+    for (int c = 0; c + 8 < width; c += 10) {
+        format_ms(c * scale, took, sizeof(took));
+        timeline_put(&frame[rows][TIMELINE_LABEL_WIDTH + c], "|", TL_DIM);
+        timeline_text(frame[rows], TIMELINE_LABEL_WIDTH + c + 1, cols, took, TL_DIM);
+    }
+    rows++;
+
+    for (int i = 0; i < timeline_count; i++) {
+        const TimelineRun* run = &timeline_runs[i];
+        bool phases[TIMELINE_PHASES] = {false};
+        int lanes = 0;
+        for (int s = 0; s < run->step_count; s++) {
+            int phase = step_phase(run->steps[s].type);
+            if (!phases[phase]) lanes++;
+            phases[phase] = true;
+        }
+        if (rows + 1 + lanes > max_rows - 1) {
+            snprintf(buf, sizeof(buf), "+ %d more drive%s", timeline_count - i, timeline_count - i == 1 ? "" : "s");
+            timeline_text(frame[rows++], 0, cols, buf, TL_DIM);
+            break;
+        }
+
+        timeline_text(frame[rows], 0, TIMELINE_LABEL_WIDTH - 1, run->drive, TL_BOLD);
+        format_ms(run->finished ? run->end_ms : now, took, sizeof(took));
+        if (!run->finished) snprintf(buf, sizeof(buf), "ejecting... %s", took);
+        else if (run->ok) snprintf(buf, sizeof(buf), "ejected in %s", took);
+        else snprintf(buf, sizeof(buf), "failed after %s: %s", took, run->error);
+        timeline_text(frame[rows++], TIMELINE_LABEL_WIDTH, cols,
+                      buf, !run->finished ? TL_YELLOW : run->ok ? TL_GREEN : TL_RED);
+
+        for (int phase = 0; phase < TIMELINE_PHASES; phase++) {
+            if (!phases[phase]) continue;
+            TimelineCell* row = frame[rows++];
+            timeline_text(row, 2, TIMELINE_LABEL_WIDTH - 1, phase_names[phase], TL_DIM);
+
+            for (int s = 0; s < run->step_count; s++) {
+                const TimelineStep* step = &run->steps[s];
+                if (step_phase(step->type) != phase) continue;
+                if (step->status == NODE_PENDING || step->status == NODE_SKIPPED) continue;
+
+                // Instant steps still get a cell
+                double end = step->status == NODE_RUNNING ? now : step->end_ms;
+                if (end < step->start_ms + scale / 2) end = step->start_ms + scale / 2;
+                int first = (int)(step->start_ms / scale), last = (int)(end / scale);
+                for (int c = first; c <= last && c < width; c++) {
+                    TimelineCell* cell = &row[TIMELINE_LABEL_WIDTH + c];
+                    if (cell->color == TL_RED) continue;   // a failure outranks what overlaps it
+                    if (step->status == NODE_FAILED) timeline_put(cell, "█", TL_RED);
+                    else if (step->status == NODE_RUNNING) timeline_put(cell, "▓", TL_YELLOW);
+                    else if (cell->color != TL_YELLOW) timeline_put(cell, "█", TL_GREEN);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&timeline_lock);
+    return rows;
+}
+
+// Draw only the cells that differ from the previous frame, then leave the
+// cursor below the panel. A cell with an empty glyph in prev forces a redraw.
+void timeline_paint(TimelineCell frame[][TIMELINE_MAX_COLS], TimelineCell prev[][TIMELINE_MAX_COLS], int rows,
+                    int cols) {
+    int cursor_row = -1, cursor_col = -1, color = -1;
+
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            TimelineCell* cell = &frame[r][c];
+            if (cell->color == prev[r][c].color && strcmp(cell->glyph, prev[r][c].glyph) == 0) continue;
+
+            if (r != cursor_row || c != cursor_col) printf("\033[%d;%dH", TIMELINE_TOP_ROW + r, c + 1);
+            if (cell->color != color) printf("%s%s", NC, timeline_colors[cell->color]);
+            fputs(cell->glyph, stdout);
+            color = cell->color;
+            cursor_row = r;
+            cursor_col = c + 1;
+            prev[r][c] = *cell;
+        }
+    }
+    printf("%s\033[%d;1H", NC, TIMELINE_TOP_ROW + rows + 1);
+    fflush(stdout);
+}
+
+// Terminal size, capped to what the panel can hold
+void timeline_size(int* rows, int* cols) {
+    struct winsize ws;
+    *rows = 24;
+    *cols = 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0) {
+        *rows = ws.ws_row;
+        *cols = ws.ws_col;
+    }
+    *rows -= TIMELINE_TOP_ROW + 4;   // room for the summary prompt
+    if (*rows < 4) *rows = 4;
+    if (*rows > TIMELINE_MAX_ROWS) *rows = TIMELINE_MAX_ROWS;
+    if (*cols > TIMELINE_MAX_COLS) *cols = TIMELINE_MAX_COLS;
+    if (*cols < TIMELINE_LABEL_WIDTH + 20) *cols = TIMELINE_LABEL_WIDTH + 20;
+}
+
+static TimelineCell timeline_frames[2][TIMELINE_MAX_ROWS][TIMELINE_MAX_COLS];
+
+void timeline_invalidate(void) {
+    memset(timeline_frames[1], 0, sizeof(timeline_frames[1]));
+}
+
+// Draw the whole panel under a fresh header
+void timeline_draw(const char* title, int* running) {
+    int rows, cols;
+    timeline_size(&rows, &cols);
+    show_header();
+    printf("%s%s%s\n\n", BOLD, title, NC);
+    timeline_invalidate();
+    rows = timeline_frame(timeline_frames[0], rows, cols, now_ms() - timeline_t0, running);
+    timeline_paint(timeline_frames[0], timeline_frames[1], rows, cols);
+}
+
+// Write the timeline as Chrome trace events, for chrome://tracing or
+// Perfetto: a process per drive, a thread per phase, an event per step
+bool timeline_export(char* path, size_t size) {
+    char file[64];
+    struct tm tm;
+    localtime_r(&timeline_started, &tm);
+    strftime(file, sizeof(file), "trace-%Y%m%d-%H%M%S.json", &tm);
+    get_state_path(file, path, size);
+    mkdir_parents(path);
+
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) return false;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    bool first = true;
+    pthread_mutex_lock(&timeline_lock);
+    double now = now_ms() - timeline_t0;
+    for (int i = 0; i < timeline_count; i++) {
+        const TimelineRun* run = &timeline_runs[i];
+        fprintf(fp, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":", first ? "" : ",",
+                i + 1);
+        json_string(fp, run->drive);
+        fprintf(fp, "}}");
+        first = false;
+        bool phases[TIMELINE_PHASES] = {false};
+        for (int s = 0; s < run->step_count; s++) phases[step_phase(run->steps[s].type)] = true;
+        for (int phase = 0; phase < TIMELINE_PHASES; phase++) {
+            if (!phases[phase]) continue;
+            fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    i + 1, phase, phase_names[phase]);
+        }
+
+        for (int s = 0; s < run->step_count; s++) {
+            const TimelineStep* step = &run->steps[s];
+            if (step->status == NODE_PENDING || step->status == NODE_SKIPPED) continue;
+            double end = step->status == NODE_RUNNING ? now : step->end_ms;
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.0f,"
+                    "\"dur\":%.0f,\"args\":{\"target\":", step_names[step->type], phase_names[step_phase(step->type)],
+                    i + 1, step_phase(step->type), step->start_ms * 1000, (end - step->start_ms) * 1000);
+            json_string(fp, step->target);
+            fprintf(fp, ",\"status\":\"%s\"", step->status == NODE_DONE ? "done" :
+                    step->status == NODE_RUNNING ? "running" : "failed");
+            if (step->status == NODE_FAILED) {
+                fprintf(fp, ",\"error\":");
+                json_string(fp, strerror(step->err));
+            }
+            fprintf(fp, "}}");
+        }
+    }
+    pthread_mutex_unlock(&timeline_lock);
+    fprintf(fp, "\n]}\n");
+    return fclose(fp) == 0;
+}
+
+// After a timeline: Enter returns, x saves the trace first
+void timeline_prompt(void) {
+    char input[MAX_LINE], path[MAX_PATH];
+    printf("Press Enter to continue, or x to save a trace... ");
+    fflush(stdout);
+    if (!read_line(input, sizeof(input)) || tolower((unsigned char)input[0]) != 'x') return;
+
+    if (timeline_export(path, sizeof(path))) {
+        printf("%s%s Trace saved to %s%s\n", GREEN, ICON_SUCCESS, path, NC);
+    } else {
+        printf("%s%s Cannot write %s: %s%s\n", RED, ICON_ERROR, path, strerror(errno), NC);
+    }
+    printf("Press Enter to continue...");
+    fflush(stdout);
+    wait_for_enter();
+}
+
+// The [g] view: the timeline of the last eject
+void show_last_timeline(void) {
+    pthread_mutex_lock(&timeline_lock);
+    int count = timeline_count;
+    pthread_mutex_unlock(&timeline_lock);
+    if (count == 0) {
+        printf("\n%s%s No eject to show yet.%s\n", YELLOW, ICON_WARNING, NC);
+        ui_stats_frame();
+        sleep(2);
+        return;
+    }
+
+    char title[64], stamp[32];
+    struct tm tm;
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime_r(&timeline_started, &tm));
+    snprintf(title, sizeof(title), "Last eject, started at %s", stamp);
+    int running;
+    timeline_draw(title, &running);
+    timeline_prompt();
+}
+
+// Unmount drive: run its prepared teardown plan
+bool unmount_drive(EjectPlan* plan, const DriveInfo* drive) {
+    char error[MAX_LINE];
+    
+    show_header();
+    printf("%s%s%s Selected: %s%s\n\n", BOLD, YELLOW, ICON_WARNING, plan->drive, NC);
+    printf("%s%s Unmounting all partitions...%s\n\n", CYAN, ICON_DRIVE, NC);
+    ui_stats_frame();
+    
+    timeline_begin();
+    timeline_add(plan);
+    event_echo = EVENTS_TEXT;
+    bool ok = eject_drive(plan, drive, true, error, sizeof(error));
+    event_echo = EVENTS_QUIET;
+    timeline_finish(plan->drive, ok, error);
+    
+    bool unmount_failed = false, daemon_running = false;
+    PlanNode* power_off = NULL;
+    for (int i = 0; i < plan->node_count; i++) {
+        PlanNode* n = &plan->nodes[i];
+        if (step_detaches(n->type)) power_off = n;
+        else if (n->type == STEP_FUSE_WAIT && n->status == NODE_FAILED) daemon_running = true;
+        else if (n->status != NODE_DONE) unmount_failed = true;
+    }
+    
+    if (power_off != NULL && power_off->status == NODE_PENDING && error[0]) {
+        printf("\n%s%s Eject aborted: %s%s\n\n", RED, ICON_ERROR, error, NC);
+        printf("Press Enter to continue...");
+        fflush(stdout);
+        wait_for_enter();
+        return false;
+    }
+    
+    if (daemon_running && !unmount_failed) {
+        printf("\n%s%s A FUSE daemon is still writing to the drive; it was not powered off.%s\n", RED,
+               ICON_ERROR, NC);
+        printf("%s%s Try again once it has finished.%s\n\n", YELLOW, ICON_WARNING, NC);
+        printf("Press Enter to continue...");
+        fflush(stdout);
+        wait_for_enter();
+        return false;
+    }
+    
+    if (unmount_failed) {
+        printf("\n%s%s Some partitions failed to unmount.%s\n", RED, ICON_ERROR, NC);
+        printf("%s%s The drive may still be in use.%s\n\n", YELLOW, ICON_WARNING, NC);
+        printf("Press Enter to continue...");
+        fflush(stdout);
+        wait_for_enter();
+        return false;
+    }
+    
+    if (power_off != NULL && power_off->status == NODE_DONE && power_off->type == STEP_NBD_DISCONNECT) {
+        printf("%s%s Network block device %s has been disconnected.%s\n\n", GREEN, ICON_SUCCESS, plan->drive, NC);
+    } else if (power_off != NULL && power_off->status == NODE_DONE && power_off->type == STEP_MEDIA_EJECT) {
+        printf("%s%s The medium in %s has been ejected; you can take it out.%s\n\n", GREEN, ICON_SUCCESS,
+               plan->drive, NC);
+    } else if (power_off != NULL && power_off->status == NODE_DONE) {
+        char took[32];
+        format_ms(power_off->end_ms - power_off->start_ms, took, sizeof(took));
+        printf("%s%s Drive %s has been safely ejected!%s\n", GREEN, ICON_SUCCESS, plan->drive, NC);
+        printf("%s%s You can now safely remove the drive.%s %s(removal confirmed after %s)%s\n\n",
+               GREEN, ICON_SUCCESS, NC, DIM, took, NC);
+    } else if (power_off != NULL && power_off->type == STEP_POWER_OFF && power_off->err == ETIMEDOUT) {
+        printf("%s%s The drive was powered off but the system still lists it.%s\n", YELLOW, ICON_WARNING, NC);
+        printf("%s%s Wait a moment before unplugging it.%s\n\n", YELLOW, ICON_WARNING, NC);
+    } else {
+        printf("%s%s Failed to %s.%s\n\n", RED, ICON_ERROR,
+               power_off == NULL || power_off->type == STEP_POWER_OFF ? "power off the drive" :
+               power_off->type == STEP_NBD_DISCONNECT ? "disconnect the drive" : "eject the medium", NC);
+    }
+    show_timing(plan);
+    
+    printf("Press Enter to continue...");
+    fflush(stdout);
+    wait_for_enter();
+    return true;
+}
+
+// One drive of a multi-drive eject
+typedef struct {
+    EjectPlan* plan;
+    const DriveInfo* drive;
+    bool ok;
+    char error[MAX_LINE];
+    double ms;
+} EjectJob;
+
+void* eject_thread(void* arg) {
+    EjectJob* job = arg;
+    double t0 = now_ms();
+    job->ok = eject_drive(job->plan, job->drive, false, job->error, sizeof(job->error));
+    job->ms = now_ms() - t0;
+    timeline_finish(job->plan->drive, job->ok, job->error);
+    return NULL;
+}
+
+// Eject several drives at once, each in its own thread, with the timeline
+// redrawn at a steady rate until the last one is done
+void unmount_drives(DriveModel* model, int indices[], int count) {
+    EjectJob jobs[MAX_DRIVES];
+    pthread_t threads[MAX_DRIVES];
+    bool started[MAX_DRIVES];
+    char title[64];
+    int running, rows, cols;
+    
+    snprintf(title, sizeof(title), "%s%s Selected %d drives", YELLOW, ICON_WARNING, count);
+    timeline_begin();
+    for (int i = 0; i < count; i++) timeline_add(&model->plans[indices[i]]);
+    timeline_draw(title, &running);
+    timeline_size(&rows, &cols);
+    
+    for (int i = 0; i < count; i++) {
+        jobs[i] = (EjectJob){&model->plans[indices[i]], &model->drives[indices[i]], false, "", 0};
+        started[i] = pthread_create(&threads[i], NULL, eject_thread, &jobs[i]) == 0;
+        if (!started[i]) {
+            snprintf(jobs[i].error, sizeof(jobs[i].error), "cannot start worker");
+            timeline_finish(jobs[i].plan->drive, false, jobs[i].error);
+        }
+    }
+    
+    // Events only go to the log meanwhile; the panel shows what they would say
+    double next = now_ms();
+    do {
+        int new_rows, new_cols;
+        timeline_size(&new_rows, &new_cols);
+        if (new_rows != rows || new_cols != cols) {
+            timeline_draw(title, &running);
+            rows = new_rows;
+            cols = new_cols;
+        }
+        int used = timeline_frame(timeline_frames[0], rows, cols, now_ms() - timeline_t0, &running);
+        timeline_paint(timeline_frames[0], timeline_frames[1], used, cols);
+        
+        next += TIMELINE_INTERVAL_MS;
+        double wait = next - now_ms();
+        if (wait > 0) usleep((useconds_t)(wait * 1000));
+        else next = now_ms();
+    } while (running > 0);
+    
+    for (int i = 0; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        char took[32];
+        format_ms(jobs[i].ms, took, sizeof(took));
+        if (jobs[i].ok) {
+            printf("%s%s %s has been safely ejected%s %s(%s)%s\n", GREEN, ICON_SUCCESS, jobs[i].plan->drive, NC,
+                   DIM, took, NC);
+        } else {
+            printf("%s%s %s: %s%s\n", RED, ICON_ERROR, jobs[i].plan->drive, jobs[i].error, NC);
+        }
+    }
+    
+    printf("\n");
+    timeline_prompt();
+}
+
+// Show the main menu
+void show_menu(int drive_count) {
+    printf("\n%s%sOptions:%s\n", BOLD, CYAN, NC);
+    printf("  %s[1-%d]%s Select a drive to eject (several: \"1 3\")\n", YELLOW, drive_count, NC);
+    printf("  %s[p N]%s Probe read speed of drive N\n", YELLOW, NC);
+    printf("  %s[t]%s Show which processes are writing to the drives\n", YELLOW, NC);
+    printf("  %s[g]%s Show the timeline of the last eject\n", YELLOW, NC);
+    printf("  %s[r]%s Refresh drive list\n", YELLOW, NC);
+    printf("  %s[q]%s Quit\n\n", YELLOW, NC);
+    show_ui_stats_footer();
+    printf("%s%sYour choice: %s", BOLD, GREEN, NC);
+    fflush(stdout);
+}
+
+#endif
+
+// Outstanding I/O on a drive: dirty/writeback bytes and requests in flight
+// (dirty is a system-wide bound where the kernel has no per-device counts;
+// *exact tells which, if given)
+void get_drive_pending_io(const char* name, unsigned long long* dirty, unsigned long long* inflight, bool* exact) {
+    char path[MAX_PATH], buf[64];
+    dev_t devs[MAX_PLAN_NODES];
+    int dev_count = get_drive_devices(name, devs, 0, MAX_PLAN_NODES);
+
+    *dirty = 0;
+    *inflight = 0;
+    if (exact != NULL) *exact = true;
+
+    for (int i = 0; i < dev_count; i++) {
+        // Partitions share the disk's bdi and request queue
+        char real[PATH_MAX], *dev;
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(devs[i]), minor(devs[i]));
+        if (realpath(path, real) == NULL) continue;
+        dev = strrchr(real, '/') + 1;
+        if (is_partition(dev)) continue;
+
+        BdiStats stats;
+        read_bdi_stats(major(devs[i]), minor(devs[i]), &stats);
+        if (stats.exact) *dirty += stats.dirty + stats.writeback;
+        else *dirty = stats.dirty + stats.writeback;   // system-wide bound, counted once
+        if (exact != NULL && !stats.exact) *exact = false;
+
+        unsigned long long reads = 0, writes = 0;
+        snprintf(path, sizeof(path), "/sys/block/%s/inflight", dev);
+        if (read_sysfs_attr(path, buf, sizeof(buf)) && parse_inflight(buf, &reads, &writes)) {
+            *inflight += reads + writes;
+        }
+    }
+}
+
+// Readiness of a drive from its outstanding I/O and, when known, the
+// files open on its filesystems
+void assess_readiness(const DriveInfo* drive, Readiness* ready) {
+    char bytes[32];
+    bool exact;
+    get_drive_pending_io(dev_name(drive->path), &ready->dirty, &ready->inflight, &exact);
+    if (!exact && drive->mount_count == 0) ready->dirty = 0;   // the system's, not this drive's
+    format_bytes(ready->dirty, bytes, sizeof(bytes));
+
+    if (ready->open_files > 0) {
+        ready->state = READY_BLOCKED;
+        snprintf(ready->reason, sizeof(ready->reason), "%d file%s open%s%s", ready->open_files,
+                 ready->open_files == 1 ? "" : "s", ready->holder[0] ? " by " : "", ready->holder);
+    } else if (ready->inflight > 0) {
+        ready->state = READY_BUSY;
+        snprintf(ready->reason, sizeof(ready->reason), "%llu request%s in flight", ready->inflight,
+                 ready->inflight == 1 ? "" : "s");
+    } else if (ready->dirty > 0) {
+        ready->state = READY_NEEDS_FLUSH;
+        snprintf(ready->reason, sizeof(ready->reason), "%s%s to write back%s", exact ? "" : "up to ", bytes,
+                 exact ? "" : " (system-wide)");
+    } else {
+        ready->state = READY_INSTANT;
+        snprintf(ready->reason, sizeof(ready->reason), "%s", drive->mount_count > 0 ? "nothing to write back" :
+                 "not mounted");
+    }
+}
+
+// Reassess every drive; open_files and holders come from a process scan,
+// or are NULL to keep the last counts. True if any drive changed state.
+bool model_assess(DriveModel* model, const int open_files[], char holders[][48]) {
+    bool changed = false;
+    for (int i = 0; i < model->count; i++) {
+        Readiness* ready = &model->ready[i];
+        ReadyState before = ready->state;
+        if (open_files != NULL) {
+            ready->open_files = open_files[i];
+            snprintf(ready->holder, sizeof(ready->holder), "%.47s", holders[i]);
+        }
+        assess_readiness(&model->drives[i], ready);
+        if (ready->state != before) changed = true;
+    }
+    return changed;
+}
+
+// Write one drive as a JSON object
+void show_drive_json(FILE* out, const DriveInfo* drive, const EjectPlan* plan, const Readiness* ready) {
+    fprintf(out, "{\"path\":");
+    json_string(out, drive->path);
+    fprintf(out, ",\"identity\":");
+    json_string(out, plan->identity);
+    fprintf(out, ",\"size\":");
+    json_string(out, drive->size);
+    fprintf(out, ",\"vendor\":");
+    json_string(out, drive->vendor);
+    fprintf(out, ",\"model\":");
+    json_string(out, drive->model);
+    fprintf(out, ",\"transport\":");
+    json_string(out, drive->transport);
+    fprintf(out, ",\"mountpoints\":[");
+    for (int i = 0; i < drive->mount_count; i++) {
+        if (i) fputc(',', out);
+        json_string(out, drive->mountpoints[i]);
+    }
+    fprintf(out, "]");
+    if (drive->link_mbps > 0) {
+        fprintf(out, ",\"usb\":{\"version\":");
+        json_string(out, drive->usb_version);
+        fprintf(out, ",\"link_mbps\":%g,\"device_mbps\":%g,\"port_mbps\":%g,\"driver\":",
+                drive->link_mbps, drive->device_mbps, drive->port_mbps);
+        json_string(out, drive->usb_driver);
+        fprintf(out, ",\"degraded\":%s}", usb_link_degraded(drive) ? "true" : "false");
+    }
+    const char* profile = get_tuning_profile(dev_name(drive->path));
+    fprintf(out, ",\"tuning\":");
+    if (profile) json_string(out, profile);
+    else fprintf(out, "null");
+    fprintf(out, ",\"policy\":{\"rules\":[");
+    for (int r = 0, first = 1; r < policy_rule_count; r++) {
+        if (!(drive->policy_mask & (1ULL << r))) continue;
+        if (!first) fputc(',', out);
+        json_string(out, policy_rules[r].name);
+        first = 0;
+    }
+    fprintf(out, "],\"actions\":[");
+    for (size_t a = 0, first = 1; a < sizeof(policy_action_names) / sizeof(policy_action_names[0]); a++) {
+        if (!(drive->policy_actions & (1u << a))) continue;
+        if (!first) fputc(',', out);
+        json_string(out, policy_action_names[a]);
+        first = 0;
+    }
+    fprintf(out, "]}");
+    fprintf(out, ",\"ready\":{\"state\":\"%s\",\"reason\":", ready_names[ready->state]);
+    json_string(out, ready->reason);
+    fprintf(out, ",\"dirty_bytes\":%llu,\"inflight\":%llu,\"open_files\":", ready->dirty, ready->inflight);
+    if (ready->open_files >= 0) fprintf(out, "%d}", ready->open_files);
+    else fprintf(out, "null}");
+    fprintf(out, ",\"est_eject_ms\":%.1f}", plan->total_ms);
+}
+
+// Write the drive list as a JSON array
+void show_drives_json(FILE* out, const DriveModel* model) {
+    fputc('[', out);
+    for (int i = 0; i < model->count; i++) {
+        if (i) fputc(',', out);
+        show_drive_json(out, &model->drives[i], &model->plans[i], &model->ready[i]);
+    }
+    fputc(']', out);
+}
+
+// The steps an executed plan ran, as a JSON "steps" member
+void show_step_results_json(FILE* out, const EjectPlan* plan) {
+    fprintf(out, ",\"steps\":[");
+    for (int i = 0, first = 1; i < plan->node_count; i++) {
+        const PlanNode* n = &plan->nodes[i];
+        if (n->status != NODE_DONE && n->status != NODE_FAILED) continue;
+        fprintf(out, "%s{\"op\":\"%s\",\"target\":", first ? "" : ",", step_names[n->type]);
+        json_string(out, n->target);
+        fprintf(out, ",\"start_ms\":%.1f,\"ms\":%.1f,\"ok\":%s}", n->start_ms, n->end_ms - n->start_ms,
+                n->status == NODE_DONE ? "true" : "false");
+        first = 0;
+    }
+    fprintf(out, "]");
+}
+
+#ifndef CEJECT_MINI
+bool model_sample_readiness(DriveModel* model);
+#endif
+
+// Non-interactive listing
+int run_list(bool json) {
+    static DriveModel model;
+    model_load(&model);
+
+    if (json) {
+#ifdef CEJECT_MINI
+        model_assess(&model, NULL, NULL);   // no process scan here
+#else
+        model_sample_readiness(&model);
+#endif
+        show_drives_json(stdout, &model);
+        printf("\n");
+        return 0;
+    }
+
+    for (int i = 0; i < model.count; i++) {
+        DriveInfo* drive = &model.drives[i];
+        char friendly_name[256];
+        get_friendly_name(drive, friendly_name, sizeof(friendly_name));
+        printf("%d\t%s\t%s\t%s\t%s", i + 1, drive->path, drive->size,
+               drive->transport[0] ? drive->transport : "-", friendly_name);
+        for (int j = 0; j < drive->mount_count; j++) printf("%s%s", j ? "," : "\t", drive->mountpoints[j]);
+        printf("\n");
+    }
+    return 0;
+}
+
+// Non-interactive eject of one drive; with --json, one result line in the
+// format batch mode uses
+int run_eject(const char* id, bool json) {
+    static DriveInfo drives[MAX_DRIVES];
+    static EjectPlan plan;
+    char error[MAX_LINE];
+
+    if (id == NULL) {
+        fprintf(stderr, "ceject: --eject needs a drive\n");
+        return 2;
+    }
+    int count = backend->get_drives(drives, MAX_DRIVES);
+    int index = resolve_drive(drives, count, id);
+    if (index < 0) {
+        fprintf(stderr, "ceject: no external drive matches '%s'\n", id);
+        return 1;
+    }
+
+    backend->build_plan(&drives[index], &plan);
+    if (!json) printf("%sEjecting %s%s\n", BOLD, plan.drive, NC);
+    event_echo = json ? EVENTS_QUIET : EVENTS_TEXT;
+    double t0 = now_ms();
+    bool ok = eject_drive(&plan, &drives[index], !json, error, sizeof(error));
+    double ms = now_ms() - t0;
+    event_echo = EVENTS_QUIET;
+
+    if (json) {
+        printf("{\"cmd\":\"eject\",\"drive\":");
+        json_string(stdout, plan.drive);
+        printf(",\"status\":\"%s\",\"ms\":%.1f", ok ? "ok" : "error", ms);
+        show_step_results_json(stdout, &plan);
+        if (!ok) {
+            printf(",\"error\":");
+            json_string(stdout, error);
+        }
+        printf("}\n");
+        return ok ? 0 : 1;
+    }
+
+    if (ok) printf("\n%s%s %s has been safely ejected.%s\n\n", GREEN, ICON_SUCCESS, plan.drive, NC);
+    else printf("\n%s%s %s%s\n\n", RED, ICON_ERROR, error, NC);
+    show_timing(&plan);
+    return ok ? 0 : 1;
+}
+
+#ifndef CEJECT_MINI
+// Suspend integration, for a systemd-sleep hook: --pre-sleep flushes every
+// external drive in parallel (and with --remount-ro parks its filesystems
+// read-only) under a hard deadline; --post-resume undoes the remounts.
+// The work runs in a child process, since a thread stuck in a flush would
+// keep the process, and with it the suspend, from finishing.
+#define SLEEP_DEADLINE_MS 10000
+
+// Outcome for one drive, sent whole through a pipe (below PIPE_BUF)
+typedef struct {
+    int index;
+    int err;
+    int filesystems;
+    int remounted;
+    double flush_ms;
+    double remount_ms;
+    char error[MAX_PATH + 128];   // the step's target and a strerror()
+} SleepResult;
+
+typedef struct {
+    const DriveInfo* drive;
+    EjectPlan plan;
+    int index;
+    bool remount;
+    int fd;
+} SleepJob;
+
+static pthread_mutex_t sleep_state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Mount flags to keep when remounting, from statvfs
+unsigned long mount_flags_of(unsigned long f_flag) {
+    static const struct { unsigned long st, ms; } flags[] = {
+        {ST_NOSUID, MS_NOSUID}, {ST_NODEV, MS_NODEV}, {ST_NOEXEC, MS_NOEXEC}, {ST_SYNCHRONOUS, MS_SYNCHRONOUS},
+        {ST_NOATIME, MS_NOATIME}, {ST_NODIRATIME, MS_NODIRATIME}, {ST_RELATIME, MS_RELATIME},
+    };
+    unsigned long result = 0;
+    for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        if (f_flag & flags[i].st) result |= flags[i].ms;
+    }
+    return result;
+}
+
+// A filesystem parked read-only, as the sleep state records it for
+// --post-resume: "<flags> <identity> <drive> <mountpoint>", each field
+// escaped like a mountinfo path so that any mountpoint stays one field
+typedef struct {
+    unsigned long flags;
+    char identity[128];
+    char drive[MAX_PATH];
+    char target[MAX_PATH];
+} SleepMount;
+
+#define SLEEP_LINE_MAX (3 * 4 * MAX_PATH + 32)
+
+bool format_sleep_mount(const SleepMount* m, char* line, size_t size) {
+    char identity[4 * sizeof(m->identity)], drive[4 * MAX_PATH], target[4 * MAX_PATH];
+    if (!escape_octal(m->identity, identity, sizeof(identity)) || !escape_octal(m->drive, drive, sizeof(drive)) ||
+        !escape_octal(m->target, target, sizeof(target))) return false;
+    return snprintf(line, size, "%lu %s %s %s\n", m->flags, identity, drive, target) < (int)size;
+}
+
+bool parse_sleep_mount(const char* line, SleepMount* m) {
+    char identity[4 * sizeof(m->identity)], drive[4 * MAX_PATH], target[4 * MAX_PATH];
+    unsigned long long flags;
+    if (!next_number(&line, ULONG_MAX, &flags) || !next_field(&line, identity, sizeof(identity)) ||
+        !next_field(&line, drive, sizeof(drive)) || !next_field(&line, target, sizeof(target)) ||
+        next_field(&line, NULL, 0)) return false;
+
+    unescape_octal(identity);
+    unescape_octal(drive);
+    unescape_octal(target);
+    m->flags = (unsigned long)flags;
+    return snprintf(m->identity, sizeof(m->identity), "%s", identity) < (int)sizeof(m->identity) &&
+           snprintf(m->drive, sizeof(m->drive), "%s", drive) < (int)sizeof(m->drive) &&
+           snprintf(m->target, sizeof(m->target), "%s", target) < (int)sizeof(m->target);
+}
+
+// Remount a filesystem read-only and note it in the sleep state
+int remount_read_only(const EjectPlan* plan, const char* target, bool* remounted) {
+    struct statvfs st;
+    *remounted = false;
+    if (statvfs(target, &st) != 0) return errno == ENOENT ? 0 : errno;
+    if (st.f_flag & ST_RDONLY) return 0;   // left as it is on resume
+
+    SleepMount m = {mount_flags_of(st.f_flag), "", "", ""};
+    char line[SLEEP_LINE_MAX];
+    snprintf(m.identity, sizeof(m.identity), "%s", plan->identity[0] ? plan->identity : "-");
+    snprintf(m.drive, sizeof(m.drive), "%s", plan->drive);
+    snprintf(m.target, sizeof(m.target), "%s", target);
+    if (!format_sleep_mount(&m, line, sizeof(line))) return ENAMETOOLONG;   // could not be undone
+
+    if (mount(NULL, target, NULL, MS_REMOUNT | MS_RDONLY | m.flags, NULL) != 0) return errno;
+    *remounted = true;
+
+    char path[MAX_PATH];
+    get_state_path("sleep", path, sizeof(path));
+    pthread_mutex_lock(&sleep_state_lock);
+    FILE* fp = fopen(path, "a");
+    if (fp != NULL) {
+        fputs(line, fp);
+        fclose(fp);
+    }
+    pthread_mutex_unlock(&sleep_state_lock);
+    return 0;
+}
+
+// Carry over the records of an earlier --pre-sleep whose filesystems are
+// still parked read-only: a --post-resume that failed leaves them for the
+// next one to undo. The rest are stale and dropped. Returns 0 or an errno.
+int keep_parked_mounts(const char* path) {
+    char tmp_path[MAX_PATH + 8], buf[SLEEP_LINE_MAX], *line;
+    LineReader reader;
+    if (!line_reader_open(&reader, path, buf, sizeof(buf))) return errno == ENOENT ? 0 : errno;
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        line_reader_close(&reader);
+        return ENAMETOOLONG;
+    }
+
+    FILE* out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        int err = errno;
+        line_reader_close(&reader);
+        return err;
+    }
+    while ((line = line_reader_next(&reader)) != NULL) {
+        SleepMount m;
+        struct statvfs st;
+        if (parse_sleep_mount(line, &m) && statvfs(m.target, &st) == 0 && (st.f_flag & ST_RDONLY)) {
+            fprintf(out, "%s\n", line);
+        }
+    }
+    line_reader_close(&reader);
+
+    int err = ferror(out) ? EIO : 0;
+    if (fclose(out) != 0 && err == 0) err = errno;
+    if (err == 0 && rename(tmp_path, path) != 0) err = errno;
+    if (err != 0) unlink(tmp_path);
+    return err;
+}
+
+// Whether an unmount step is one of the drive's own filesystems. Foreign
+// mounts stacked below it (binds of other filesystems, tmpfs) only need
+// their writes flushed: a remount would change a superblock the drive
+// does not own.
+bool plan_owns_mount(const EjectPlan* plan, const PlanNode* n) {
+    if (n->device[0] == '\0') return false;
+    struct stat st;
+    if (stat(n->target, &st) != 0) return true;   // unmounted since, or simulated: no superblock to touch
+    return plan_owns_dev(plan, st.st_dev);
+}
+
+void* sleep_thread(void* arg) {
+    SleepJob* job = arg;
+    EjectPlan* plan = &job->plan;
+    SleepResult result = {job->index, 0, 0, 0, 0, 0, ""};
+
+    // The plan's flush steps sync exactly the filesystems on this drive
+    double t0 = now_ms();
+    for (int i = 0; i < plan->node_count && result.err == 0; i++) {
+        if (plan->nodes[i].type != STEP_FLUSH) continue;
+        result.err = backend->run_step(plan, i);
+        if (result.err != 0) {
+            snprintf(result.error, sizeof(result.error), "flush %.255s: %.100s", plan->nodes[i].target,
+                     strerror(result.err));
+        }
+    }
+    result.flush_ms = now_ms() - t0;
+
+    t0 = now_ms();
+    for (int i = 0; i < plan->node_count && result.err == 0; i++) {
+        if (plan->nodes[i].type != STEP_UNMOUNT || !plan_owns_mount(plan, &plan->nodes[i])) continue;
+        result.filesystems++;
+        if (!job->remount) continue;
+
+        bool remounted;
+        result.err = remount_read_only(plan, plan->nodes[i].target, &remounted);
+        if (remounted) result.remounted++;
+        if (result.err != 0) {
+            snprintf(result.error, sizeof(result.error), "remount %.255s: %.100s", plan->nodes[i].target,
+                     strerror(result.err));
+        }
+    }
+    result.remount_ms = now_ms() - t0;
+
+    if (result.err == 0) {
+        record_event(plan->drive, "sleep", "flushed in %.0f ms, %d of %d filesystems remounted read-only",
+                     result.flush_ms, result.remounted, result.filesystems);
+    } else {
+        record_event(plan->drive, "sleep", "failed: %s", result.error);
+    }
+    ssize_t written = write(job->fd, &result, sizeof(result));
+    (void)written;
+    return NULL;
+}
+
+// Child side of --pre-sleep: one thread per drive, results down the pipe
+void pre_sleep_worker(SleepJob jobs[], int count) {
+    pthread_t threads[MAX_DRIVES];
+    bool started[MAX_DRIVES];
+
+    for (int i = 0; i < count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, sleep_thread, &jobs[i]) == 0;
+        if (!started[i]) {
+            SleepResult result = {i, EAGAIN, 0, 0, 0, 0, "cannot start worker"};
+            ssize_t written = write(jobs[i].fd, &result, sizeof(result));
+            (void)written;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+}
+
+int run_pre_sleep(bool remount, double deadline_ms, bool json) {
+    static DriveInfo drives[MAX_DRIVES];
+    static SleepJob jobs[MAX_DRIVES];
+    SleepResult results[MAX_DRIVES];
+    bool done[MAX_DRIVES] = {false};
+    double t0 = now_ms();
+    if (deadline_ms <= 0) deadline_ms = SLEEP_DEADLINE_MS;
+
+    // Start from the filesystems an earlier run left read-only, so
+    // --post-resume undoes those and this run's remounts, and nothing else
+    char path[MAX_PATH];
+    get_state_path("sleep", path, sizeof(path));
+    mkdir_parents(path);
+    int err = keep_parked_mounts(path);
+    if (err != 0) {
+        fprintf(stderr, "ceject: %s: cannot keep the filesystems still read-only from the last sleep: %s\n", path,
+                strerror(err));
+        return 1;
+    }
+
+    int count = backend->get_drives(drives, MAX_DRIVES);
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        perror("ceject: pipe");
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        jobs[i].drive = &drives[i];
+        jobs[i].index = i;
+        jobs[i].remount = remount;
+        jobs[i].fd = pipe_fds[1];
+        backend->build_plan(&drives[i], &jobs[i].plan);
+    }
+
+    fflush(stdout);
+    pid_t pid = count > 0 ? fork() : 0;
+    if (pid < 0) {
+        perror("ceject: fork");
+        return 1;
+    }
+    if (pid == 0 && count > 0) {
+        // Nothing to say, and an open stdout would hold up a caller reading it
+        int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        close(pipe_fds[0]);
+        pre_sleep_worker(jobs, count);
+        _exit(0);
+    }
+    close(pipe_fds[1]);
+
+    // Collect results until every drive reported, the worker died, or the
+    // deadline passed; a drive still flushing by then is left to finish
+    int finished = 0;
+    while (finished < count) {
+        int wait = (int)(t0 + deadline_ms - now_ms());
+        if (wait <= 0) break;
+
+        struct pollfd pfd = {pipe_fds[0], POLLIN, 0};
+        int ready = poll(&pfd, 1, wait);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) break;
+
+        SleepResult result;
+        if (read(pipe_fds[0], &result, sizeof(result)) != (ssize_t)sizeof(result)) break;
+        if (result.index < 0 || result.index >= count || done[result.index]) continue;
+        results[result.index] = result;
+        done[result.index] = true;
+        finished++;
+    }
+    close(pipe_fds[0]);
+    if (finished == count && pid > 0) waitpid(pid, NULL, 0);
+    double ms = now_ms() - t0;
+
+    bool ok = finished == count;
+    for (int i = 0; i < count; i++) {
+        if (done[i] && results[i].err != 0) ok = false;
+        if (!done[i]) record_event(drives[i].path, "sleep", "not flushed within %.0f ms", deadline_ms);
+    }
+
+    if (json) {
+        printf("{\"cmd\":\"pre-sleep\",\"status\":\"%s\",\"ms\":%.1f,\"drives\":[", ok ? "ok" : "error", ms);
+        for (int i = 0; i < count; i++) {
+            printf("%s{\"drive\":", i ? "," : "");
+            json_string(stdout, drives[i].path);
+            if (!done[i]) {
+                printf(",\"status\":\"timeout\"}");
+                continue;
+            }
+            printf(",\"status\":\"%s\",\"flush_ms\":%.1f,\"remount_ms\":%.1f,\"filesystems\":%d,\"remounted\":%d",
+                   results[i].err == 0 ? "ok" : "error", results[i].flush_ms, results[i].remount_ms,
+                   results[i].filesystems, results[i].remounted);
+            if (results[i].err != 0) {
+                printf(",\"error\":");
+                json_string(stdout, results[i].error);
+            }
+            printf("}");
+        }
+        printf("]}\n");
+        return ok ? 0 : 1;
+    }
+
+    char took[32], limit[32];
+    format_ms(ms, took, sizeof(took));
+    format_ms(deadline_ms, limit, sizeof(limit));
+    printf("%sFlushed %d external drive%s in %s%s %s(deadline %s)%s\n", BOLD, count, count == 1 ? "" : "s", took, NC,
+           DIM, limit, NC);
+    for (int i = 0; i < count; i++) {
+        char flush[32], remounted[64] = "";
+        if (!done[i]) {
+            printf("  %s%s %-12s still flushing at the deadline%s\n", RED, ICON_ERROR, drives[i].path, NC);
+            continue;
+        }
+        format_ms(results[i].flush_ms, flush, sizeof(flush));
+        if (remount) snprintf(remounted, sizeof(remounted), ", %d of %d read-only", results[i].remounted,
+                              results[i].filesystems);
+        if (results[i].err == 0) {
+            printf("  %s%s %-12s%s flush %s%s\n", GREEN, ICON_SUCCESS, drives[i].path, NC, flush, remounted);
+        } else {
+            printf("  %s%s %-12s %s%s %s(flush %s)%s\n", RED, ICON_ERROR, drives[i].path, results[i].error, NC, DIM,
+                   flush, NC);
+        }
+    }
+    return ok ? 0 : 1;
+}
+
+// Undo the read-only remounts of the last --pre-sleep, for filesystems
+// still mounted from the same drive
+int run_post_resume(bool json) {
+    static DriveInfo drives[MAX_DRIVES];
+    static EjectPlan plan;
+    char path[MAX_PATH], buf[SLEEP_LINE_MAX], *line;
+    LineReader reader;
+    double t0 = now_ms();
+    bool ok = true;
+    int count = 0, restored = 0;
+
+    get_state_path("sleep", path, sizeof(path));
+    if (json) printf("{\"cmd\":\"post-resume\",\"mounts\":[");
+    if (line_reader_open(&reader, path, buf, sizeof(buf))) {
+        int drive_count = backend->get_drives(drives, MAX_DRIVES);
+
+        while ((line = line_reader_next(&reader)) != NULL) {
+            SleepMount m;
+            if (!parse_sleep_mount(line, &m)) continue;
+            const char* identity = m.identity;
+            const char* drive = m.drive;
+            const char* target = m.target;
+            unsigned long flags = m.flags;
+
+            // The drive may have been swapped, or pulled and its mounts
+            // detached, while the machine slept
+            const char* status = "ok";
+            int err = 0;
+            int index = resolve_drive(drives, drive_count, drive);
+            struct statvfs st;
+            if (index >= 0) backend->build_plan(&drives[index], &plan);
+            if (index < 0) {
+                status = "gone";
+            } else if (strcmp(identity, plan.identity[0] ? plan.identity : "-") != 0) {
+                status = "replaced";
+            } else if (statvfs(target, &st) != 0 || !(st.f_flag & ST_RDONLY)) {
+                status = "skipped";
+            } else if (mount(NULL, target, NULL, MS_REMOUNT | flags, NULL) != 0) {
+                err = errno;
+                status = "error";
+                ok = false;
+            } else {
+                restored++;
+            }
+            record_event(drive, "resume", "%s %s%s%s", target, status, err ? ": " : "", err ? strerror(err) : "");
+
+            if (json) {
+                printf("%s{\"target\":", count ? "," : "");
+                json_string(stdout, target);
+                printf(",\"drive\":");
+                json_string(stdout, drive);
+                printf(",\"status\":\"%s\"", status);
+                if (err != 0) {
+                    printf(",\"error\":");
+                    json_string(stdout, strerror(err));
+                }
+                printf("}");
+            } else if (err != 0) {
+                printf("  %s%s %s: %s%s\n", RED, ICON_ERROR, target, strerror(err), NC);
+            } else if (strcmp(status, "ok") == 0) {
+                printf("  %s%s %s%s read-write again\n", GREEN, ICON_SUCCESS, target, NC);
+            } else {
+                printf("  %s%s %s: %s, left alone%s\n", YELLOW, ICON_WARNING, target,
+                       strcmp(status, "skipped") == 0 ? "no longer read-only" :
+                       strcmp(status, "gone") == 0 ? "drive is gone" : "a different drive is there", NC);
+            }
+            count++;
+        }
+        line_reader_close(&reader);
+    }
+    if (ok) unlink(path);
+
+    double ms = now_ms() - t0;
+    if (json) {
+        printf("],\"status\":\"%s\",\"ms\":%.1f}\n", ok ? "ok" : "error", ms);
+    } else {
+        char took[32];
+        format_ms(ms, took, sizeof(took));
+        printf("%sRestored %d of %d filesystem%s in %s%s\n", BOLD, restored, count, count == 1 ? "" : "s", took, NC);
+    }
+    return ok ? 0 : 1;
+}
+#endif
+
+// Startup benchmark (hidden --bench-startup N): runs "ceject --list" N
+// times, timing each from spawn to its first output and to exit. A listing
+// should be on screen within STARTUP_BUDGET_MS, which is what rescue shells
+// and appliances running the mini build need; fails if the 95th
+// percentile of time to first output is over budget.
+#define STARTUP_BUDGET_MS 20
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+int run_bench_startup(int count) {
+    char self[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len <= 0) {
+        perror("ceject: /proc/self/exe");
+        return 1;
+    }
+    self[len] = '\0';
+    if (count < 1) count = 1;
+
+    double* first = calloc(count, sizeof(double));
+    double* done = calloc(count, sizeof(double));
+    if (first == NULL || done == NULL) {
+        fprintf(stderr, "ceject: out of memory\n");
+        return 1;
+    }
+
+    char* argv[] = {self, "--list", NULL};
+    extern char** environ;
+    int runs = 0, lines = 0;
+    for (int i = 0; i < count; i++) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) break;
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+        pid_t pid;
+        double t0 = now_ms();
+        int err = posix_spawn(&pid, self, &actions, NULL, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[1]);
+        if (err != 0) {
+            close(fds[0]);
+            break;
+        }
+
+        char buf[4096];
+        ssize_t n;
+        first[runs] = -1;
+        while ((n = read(fds[0], buf, sizeof(buf))) != 0) {
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) break;
+            if (first[runs] < 0) first[runs] = now_ms() - t0;
+            for (ssize_t j = 0; j < n; j++) lines += buf[j] == '\n';
+        }
+        close(fds[0]);
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {}
+        done[runs] = now_ms() - t0;
+        if (first[runs] < 0) first[runs] = done[runs];   // nothing to list
+        runs++;
+    }
+    if (runs == 0) {
+        fprintf(stderr, "ceject: could not start %s\n", self);
+        return 1;
+    }
+
+    qsort(first, runs, sizeof(double), compare_doubles);
+    qsort(done, runs, sizeof(double), compare_doubles);
+    double p95 = first[(runs * 95 - 1) / 100];
+
+    printf("Startup of ceject --list, %d runs, %d drive%s listed\n", runs, lines / runs, lines / runs == 1 ? "" : "s");
+    printf("  first output  p50 %6.2f ms  p95 %6.2f ms  max %6.2f ms\n", first[runs / 2], p95, first[runs - 1]);
+    printf("  exit          p50 %6.2f ms  p95 %6.2f ms  max %6.2f ms\n", done[runs / 2],
+           done[(runs * 95 - 1) / 100], done[runs - 1]);
+    printf("  budget        %d ms (p95 of first output): %s\n", STARTUP_BUDGET_MS,
+           p95 <= STARTUP_BUDGET_MS ? "ok" : "over");
+
+    free(first);
+    free(done);
+    return p95 <= STARTUP_BUDGET_MS ? 0 : 1;
+}
+
+#ifndef CEJECT_MINI
+// Writer attribution (--top, or "t" in the menu): processes with files open
+// on each drive's mounts, ranked by how fast they write (write_bytes in
+// /proc/<pid>/io). Processes are tracked from sample to sample. Their fds
+// are read when they first appear, and afterwards only in a rolling slice
+// of TOP_RESCAN_TICKS samples, so a sample costs a /proc listing plus work
+// proportional to new processes and current holders.
+#define TOP_INTERVAL_MS 1000
+#define TOP_RESCAN_TICKS 10
+#define TOP_MAX_ROWS 10
+
+typedef struct {
+    pid_t pid;
+    uint32_t open_mask;    // drives it has files open on
+    uint32_t write_mask;   // drives it has files open for writing on
+    int files;
+    bool sampled;          // write_bytes is from the previous sample
+    unsigned long long write_bytes;
+    double rate;
+    char comm[16];
+} TopProc;
+
+typedef struct {
+    TopProc* procs;
+    TopProc* next;
+    int count;
+    int capacity;
+    pid_t* pids;
+    int pid_capacity;
+    dev_t devs[MAX_DRIVES][8];
+    int dev_count[MAX_DRIVES];
+    unsigned long tick;
+    int scanned;
+} TopState;
+
+int compare_pids(const void* a, const void* b) {
+    pid_t x = *(const pid_t*)a, y = *(const pid_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// All process ids, sorted
+int top_list_pids(TopState* top) {
+    int fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    long buf[1024];
+    long n;
+    int count = 0;
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long off = 0; off < n;) {
+            RawDirent* entry = (RawDirent*)((char*)buf + off);
+            off += entry->d_reclen;
+            if (!isdigit((unsigned char)entry->d_name[0])) continue;
+
+            if (count == top->pid_capacity) {
+                int capacity = top->pid_capacity ? top->pid_capacity * 2 : 4096;
+                pid_t* grown = realloc(top->pids, capacity * sizeof(pid_t));
+                if (grown == NULL) break;
+                top->pids = grown;
+                top->pid_capacity = capacity;
+            }
+            top->pids[count++] = atoi(entry->d_name);
+        }
+    }
+    close(fd);
+
+    qsort(top->pids, count, sizeof(pid_t), compare_pids);
+    return count;
+}
+
+// Which drives a process has files open on, and whether for writing
+void top_scan_fds(TopState* top, TopProc* p) {
+    char path[64], fd_path[96], flags_buf[MAX_LINE], *line;
+    p->open_mask = p->write_mask = 0;
+    p->files = 0;
+    top->scanned++;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int)p->pid);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    long buf[1024];
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long off = 0; off < n;) {
+            RawDirent* entry = (RawDirent*)((char*)buf + off);
+            off += entry->d_reclen;
+            if (entry->d_name[0] == '.') continue;
+
+            struct stat st;
+            snprintf(fd_path, sizeof(fd_path), "%s/%s", path, entry->d_name);
+            if (stat(fd_path, &st) != 0 || S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)) continue;
+
+            for (int d = 0; d < MAX_DRIVES; d++) {
+                bool match = false;
+                for (int i = 0; i < top->dev_count[d] && !match; i++) match = top->devs[d][i] == st.st_dev;
+                if (!match) continue;
+
+                p->open_mask |= 1u << d;
+                p->files++;
+
+                // Only the matching fds are worth a look at their open flags
+                LineReader reader;
+                snprintf(fd_path, sizeof(fd_path), "/proc/%d/fdinfo/%s", (int)p->pid, entry->d_name);
+                if (!line_reader_open(&reader, fd_path, flags_buf, sizeof(flags_buf))) break;
+                unsigned int flags;
+                while ((line = line_reader_next(&reader)) != NULL) {
+                    if (!parse_fdinfo_flags(line, &flags)) continue;
+                    if ((flags & O_ACCMODE) != O_RDONLY) p->write_mask |= 1u << d;
+                    break;
+                }
+                line_reader_close(&reader);
+                break;
+            }
+        }
+    }
+    close(fd);
+
+    if (p->open_mask != 0) {
+        snprintf(path, sizeof(path), "/proc/%d/comm", (int)p->pid);
+        if (!read_sysfs_attr(path, p->comm, sizeof(p->comm))) snprintf(p->comm, sizeof(p->comm), "?");
+    }
+}
+
+// Bytes a process has caused to be written to storage so far
+bool top_read_io(pid_t pid, unsigned long long* write_bytes) {
+    char path[64], buf[MAX_LINE], *line;
+    LineReader reader;
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    if (!line_reader_open(&reader, path, buf, sizeof(buf))) return false;
+
+    bool found = false;
+    while (!found && (line = line_reader_next(&reader)) != NULL) {
+        found = parse_stat_line(line, "write_bytes", write_bytes);
+    }
+    line_reader_close(&reader);
+    return found;
+}
+
+// Filesystems mounted from each drive, as st_dev values of their mountpoints
+void top_set_drives(TopState* top, const DriveModel* model) {
+    memset(top->dev_count, 0, sizeof(top->dev_count));
+    for (int d = 0; d < model->count && d < MAX_DRIVES; d++) {
+        const DriveInfo* drive = &model->drives[d];
+        for (int i = 0; i < drive->mount_count && top->dev_count[d] < 8; i++) {
+            struct stat st;
+            if (stat(drive->mountpoints[i], &st) == 0) top->devs[d][top->dev_count[d]++] = st.st_dev;
+        }
+    }
+}
+
+// Take one sample: merge the current process list into the tracked one,
+// reading fds for new processes and this tick's rescan slice
+void top_sample(TopState* top, double elapsed_ms) {
+    int pid_count = top_list_pids(top);
+    if (pid_count > top->capacity) {
+        TopProc* procs = realloc(top->procs, pid_count * sizeof(TopProc));
+        TopProc* next = procs ? realloc(top->next, pid_count * sizeof(TopProc)) : NULL;
+        if (procs != NULL) top->procs = procs;
+        if (next == NULL) return;
+        top->next = next;
+        top->capacity = pid_count;
+    }
+
+    top->tick++;
+    top->scanned = 0;
+    int old = 0, count = 0;
+    for (int i = 0; i < pid_count; i++) {
+        while (old < top->count && top->procs[old].pid < top->pids[i]) old++;
+        TopProc* p = &top->next[count++];
+
+        bool known = old < top->count && top->procs[old].pid == top->pids[i];
+        if (known) {
+            *p = top->procs[old++];
+            if ((unsigned long)p->pid % TOP_RESCAN_TICKS == top->tick % TOP_RESCAN_TICKS) top_scan_fds(top, p);
+        } else {
+            memset(p, 0, sizeof(*p));
+            p->pid = top->pids[i];
+            top_scan_fds(top, p);
+        }
+
+        // Only holders are sampled; a counter going backwards is a new
+        // process that reused the pid
+        unsigned long long bytes;
+        if (p->open_mask == 0 || !top_read_io(p->pid, &bytes)) {
+            p->rate = 0;
+            p->sampled = false;
+            continue;
+        }
+        if (p->sampled && bytes < p->write_bytes) top_scan_fds(top, p);
+        p->rate = p->sampled && bytes >= p->write_bytes ? (bytes - p->write_bytes) * 1000.0 / elapsed_ms : 0;
+        p->write_bytes = bytes;
+        p->sampled = true;
+    }
+
+    TopProc* swap = top->procs;
+    top->procs = top->next;
+    top->next = swap;
+    top->count = count;
+}
+
+#define READY_INTERVAL_MS 1000
+
+// Sample which processes hold files on each drive, incrementally as --top
+// does, and reassess every drive. True if any drive changed state. The
+// menu does this every READY_INTERVAL_MS, without rediscovering anything.
+
+bool model_sample_readiness(DriveModel* model) {
+    static TopState top;
+    static double last;
+    int open_files[MAX_DRIVES] = {0}, holder_count[MAX_DRIVES] = {0};
+    const TopProc* holder[MAX_DRIVES] = {NULL};
+    char holders[MAX_DRIVES][48];
+
+    double now = now_ms();
+    top_set_drives(&top, model);
+    top_sample(&top, last > 0 ? now - last : TOP_INTERVAL_MS);
+    last = now;
+
+    for (int i = 0; i < top.count; i++) {
+        const TopProc* p = &top.procs[i];
+        for (int d = 0; d < model->count && d < MAX_DRIVES; d++) {
+            if (!(p->open_mask & (1u << d))) continue;
+            open_files[d] += p->files;
+            holder_count[d]++;
+            if (holder[d] == NULL || p->files > holder[d]->files) holder[d] = p;
+        }
+    }
+    for (int d = 0; d < model->count && d < MAX_DRIVES; d++) {
+        if (holder[d] == NULL) holders[d][0] = '\0';
+        else if (holder_count[d] == 1) snprintf(holders[d], sizeof(holders[d]), "%s", holder[d]->comm);
+        else snprintf(holders[d], sizeof(holders[d]), "%s and %d other%s", holder[d]->comm, holder_count[d] - 1,
+                      holder_count[d] == 2 ? "" : "s");
+    }
+    return model_assess(model, open_files, holders);
+}
+
+int compare_top_rate(const void* a, const void* b) {
+    const TopProc* x = *(const TopProc* const*)a;
+    const TopProc* y = *(const TopProc* const*)b;
+    if (x->rate != y->rate) return x->rate < y->rate ? 1 : -1;
+    return x->write_bytes < y->write_bytes ? 1 : x->write_bytes > y->write_bytes ? -1 : 0;
+}
+
+void show_top(const TopState* top, const DriveModel* model, int only, double sample_ms) {
+    show_header();
+    printf("%s%sWriters per drive%s %s(%d processes, %d fd scans, sample took %.1f ms; Enter to return)%s\n",
+           BOLD, GREEN, NC, DIM, top->count, top->scanned, sample_ms, NC);
+    printf("%s" RULE "%s\n\n", DIM, NC);
+
+    for (int d = 0; d < model->count && d < MAX_DRIVES; d++) {
+        if (only >= 0 && d != only) continue;
+        const DriveInfo* drive = &model->drives[d];
+        char name[256], dirty[32], writeback[32];
+        get_friendly_name(drive, name, sizeof(name));
+
+        BdiStats stats;
+        unsigned int major, minor;
+        memset(&stats, 0, sizeof(stats));
+        if (get_block_devnum(dev_name(drive->path), &major, &minor)) read_bdi_stats(major, minor, &stats);
+        format_bytes(stats.dirty, dirty, sizeof(dirty));
+        format_bytes(stats.writeback, writeback, sizeof(writeback));
+        printf("%s%s%s %s %s(%s%s dirty, %s writeback)%s\n", BOLD, drive->path, NC, name, DIM,
+               stats.exact ? "" : "system ", dirty, writeback, NC);
+
+        if (top->dev_count[d] == 0) {
+            printf("    %sNot mounted%s\n\n", DIM, NC);
+            continue;
+        }
+
+        const TopProc* rows[TOP_MAX_ROWS * 4];
+        int row_count = 0, readers = 0;
+        for (int i = 0; i < top->count; i++) {
+            const TopProc* p = &top->procs[i];
+            if (p->write_mask & (1u << d)) {
+                if (row_count < TOP_MAX_ROWS * 4) rows[row_count++] = p;
+            } else if (p->open_mask & (1u << d)) {
+                readers++;
+            }
+        }
+        qsort(rows, row_count, sizeof(rows[0]), compare_top_rate);
+
+        if (row_count == 0) printf("    %sNo process has files open for writing%s\n", DIM, NC);
+        else printf("    %s%7s  %-16s %12s %10s %6s%s\n", DIM, "PID", "COMMAND", "WRITE/s", "WRITTEN", "FILES", NC);
+        for (int i = 0; i < row_count && i < TOP_MAX_ROWS; i++) {
+            char rate[32], total[32];
+            format_bytes((unsigned long long)rows[i]->rate, rate, sizeof(rate));
+            format_bytes(rows[i]->write_bytes, total, sizeof(total));
+            printf("    %7d  %-16s %s%10s/s%s %10s %6d\n", (int)rows[i]->pid, rows[i]->comm,
+                   rows[i]->rate > 0 ? YELLOW : "", rate, NC, total, rows[i]->files);
+        }
+        if (readers > 0) printf("    %s+ %d process%s with files open read-only%s\n", DIM, readers,
+                                readers == 1 ? "" : "es", NC);
+        printf("\n");
+    }
+    printf("%swrite_bytes counts everything a process writes, not only to this drive.%s\n", DIM, NC);
+    fflush(stdout);
+}
+
+// Live writer view until Enter (or end of input)
+int run_top(const char* id) {
+    static DriveModel model;
+    static TopState top;
+    int only = -1;
+
+    model_load(&model);
+    if (id != NULL) {
+        only = resolve_drive(model.drives, model.count, id);
+        if (only < 0) {
+            fprintf(stderr, "ceject: no external drive matches '%s'\n", id);
+            return 1;
+        }
+    }
+    top_set_drives(&top, &model);
+
+    double last = now_ms();
+    top_sample(&top, TOP_INTERVAL_MS);
+    while (true) {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        int ready = poll(&pfd, 1, TOP_INTERVAL_MS);
+        if (ready > 0) {
+            char line[MAX_LINE];
+            read_line(line, sizeof(line));
+            break;
+        }
+        if (ready < 0 && errno != EINTR) break;
+
+        double start = now_ms();
+        top_sample(&top, start - last);
+        last = start;
+        show_top(&top, &model, only, now_ms() - start);
+    }
+    return 0;
+}
+
+// Batch mode: one command per line on stdin, one JSON result line per command
+#define MAX_BATCH_JOBS 64
+#define BATCH_IDLE_TIMEOUT_MS 30000
+
+typedef enum { JOB_FREE, JOB_QUEUED, JOB_RUNNING, JOB_FINISHED } JobState;
+
+typedef struct {
+    JobState state;
+    int seq;
+    char cmd[16];
+    char drive[MAX_PATH];
+    DriveInfo info;
+    EjectPlan plan;
+    int timeout_ms;
+    bool ok;
+    char error[MAX_PATH + 64];
+    double t0;
+    double ms;
+    pthread_t thread;
+    int notify_fd;
+} BatchJob;
+
+static BatchJob batch_jobs[MAX_BATCH_JOBS];
+
+// Wait until a drive has no dirty data and no requests in flight
+bool wait_drive_idle(const char* name, int timeout_ms, char* error, size_t size) {
+    double deadline = now_ms() + timeout_ms;
+
+    while (true) {
+        unsigned long long dirty, inflight;
+        get_drive_pending_io(name, &dirty, &inflight, NULL);
+        if (dirty == 0 && inflight == 0) return true;
+
+        if (now_ms() >= deadline) {
+            snprintf(error, size, "timeout: %llu bytes dirty, %llu requests in flight", dirty, inflight);
+            return false;
+        }
+        usleep(50 * 1000);
+    }
+}
+
+void* batch_worker(void* arg) {
+    BatchJob* job = arg;
+
+    if (strcmp(job->cmd, "wait-idle") == 0) {
+        job->ok = wait_drive_idle(dev_name(job->drive), job->timeout_ms, job->error, sizeof(job->error));
+    } else {
+        job->ok = eject_drive(&job->plan, &job->info, false, job->error, sizeof(job->error));
+    }
+
+    job->ms = now_ms() - job->t0;
+    __atomic_store_n(&job->state, JOB_FINISHED, __ATOMIC_RELEASE);
+    if (write(job->notify_fd, "", 1) < 0) {
+        // The main loop also rescans jobs on every wakeup
+    }
+    return NULL;
+}
+
+// Start a queued job unless another job holds the same drive. The plan is
+// taken from the model at this point, so it reflects earlier commands.
+// Returns true if some job finished without starting.
+bool batch_dispatch(const DriveModel* model) {
+    bool finished = false;
+
+    for (int i = 0; i < MAX_BATCH_JOBS; i++) {
+        BatchJob* job = &batch_jobs[i];
+        if (job->state != JOB_QUEUED) continue;
+
+        bool busy = false;
+        for (int j = 0; j < MAX_BATCH_JOBS && !busy; j++) {
+            busy = __atomic_load_n(&batch_jobs[j].state, __ATOMIC_ACQUIRE) == JOB_RUNNING &&
+                   strcmp(batch_jobs[j].drive, job->drive) == 0;
+        }
+        // Keep submission order per drive
+        for (int j = 0; j < MAX_BATCH_JOBS && !busy; j++) {
+            busy = batch_jobs[j].state == JOB_QUEUED && batch_jobs[j].seq < job->seq &&
+                   strcmp(batch_jobs[j].drive, job->drive) == 0;
+        }
+        if (busy) continue;
+
+        int index = model_find(model, dev_name(job->drive));
+        if (index < 0) {
+            job->ok = false;
+            snprintf(job->error, sizeof(job->error), "drive is gone");
+            job->state = JOB_FINISHED;
+            finished = true;
+            continue;
+        }
+        job->info = model->drives[index];
+        job->plan = model->plans[index];
+
+        // make-safe tears everything down but leaves the drive powered
+        if (strcmp(job->cmd, "make-safe") == 0 && job->plan.node_count > 0 &&
+            step_detaches(job->plan.nodes[job->plan.node_count - 1].type)) {
+            job->plan.node_count--;
+        }
+
+        job->state = JOB_RUNNING;
+        job->t0 = now_ms();
+        if (pthread_create(&job->thread, NULL, batch_worker, job) != 0) {
+            job->ok = false;
+            job->ms = 0;
+            snprintf(job->error, sizeof(job->error), "cannot start worker");
+            job->state = JOB_FINISHED;
+            job->thread = 0;
+            finished = true;
+        }
+    }
+    return finished;
+}
+
+// Print a finished job's result line and free its slot
+void batch_report(BatchJob* job, bool* all_ok) {
+    if (job->thread != 0) pthread_join(job->thread, NULL);
+
+    pthread_mutex_lock(&output_lock);
+    printf("{\"seq\":%d,\"cmd\":\"%s\",\"drive\":", job->seq, job->cmd);
+    json_string(stdout, job->drive);
+    printf(",\"status\":\"%s\",\"ms\":%.1f", job->ok ? "ok" : "error", job->ms);
+    if (strcmp(job->cmd, "wait-idle") != 0) show_step_results_json(stdout, &job->plan);
+    if (!job->ok) {
+        printf(",\"error\":");
+        json_string(stdout, job->error);
+    }
+    printf("}\n");
+    fflush(stdout);
+    pthread_mutex_unlock(&output_lock);
+
+    if (!job->ok) *all_ok = false;
+    job->state = JOB_FREE;
+}
+
+// Print an immediate result line
+void batch_result(int seq, const char* cmd, const char* error) {
+    pthread_mutex_lock(&output_lock);
+    printf("{\"seq\":%d,\"cmd\":", seq);
+    json_string(stdout, cmd);
+    if (error != NULL) {
+        printf(",\"status\":\"error\",\"error\":");
+        json_string(stdout, error);
+    } else {
+        printf(",\"status\":\"ok\"");
+    }
+    printf("}\n");
+    fflush(stdout);
+    pthread_mutex_unlock(&output_lock);
+}
+
+// Split "cmd [drive [timeout_ms]]". Fields too long for cmd or id are
+// rejected rather than cut, so a long drive path cannot resolve to a
+// different drive. Returns an error message, or NULL.
+const char* parse_batch_line(const char* line, char* cmd, size_t cmd_size, char* id, size_t id_size,
+                             int* timeout_ms) {
+    char field[MAX_LINE];
+    cmd[0] = id[0] = '\0';
+    if (!next_field(&line, field, sizeof(field))) return NULL;
+    if (field[0] == '#') return NULL;
+    if (strlen(field) >= cmd_size) return "command too long";
+    strcpy(cmd, field);
+
+    if (!next_field(&line, field, sizeof(field))) return NULL;
+    if (strlen(field) >= id_size) return "drive name too long";
+    strcpy(id, field);
+
+    unsigned long long value;
+    const char* rest = line;
+    if (!next_field(&rest, NULL, 0)) return NULL;
+    if (!next_number(&line, INT_MAX, &value)) return "bad timeout";
+    *timeout_ms = (int)value;
+    return NULL;
+}
+
+// Parse and queue one batch command
+void batch_command(DriveModel* model, int seq, char* line, int notify_fd, bool* all_ok) {
+    char cmd[16], id[MAX_PATH];
+    int timeout_ms = BATCH_IDLE_TIMEOUT_MS;
+
+    const char* error = parse_batch_line(line, cmd, sizeof(cmd), id, sizeof(id), &timeout_ms);
+    if (error != NULL) {
+        batch_result(seq, cmd, error);
+        *all_ok = false;
+        return;
+    }
+    if (cmd[0] == '\0') return;
+
+    if (strcmp(cmd, "list") == 0) {
+        model_sample_readiness(model);
+        pthread_mutex_lock(&output_lock);
+        printf("{\"seq\":%d,\"cmd\":\"list\",\"status\":\"ok\",\"drives\":", seq);
+        show_drives_json(stdout, model);
+        printf("}\n");
+        fflush(stdout);
+        pthread_mutex_unlock(&output_lock);
+        return;
+    }
+
+    if (strcmp(cmd, "eject") != 0 && strcmp(cmd, "make-safe") != 0 && strcmp(cmd, "wait-idle") != 0) {
+        batch_result(seq, cmd, "unknown command");
+        *all_ok = false;
+        return;
+    }
+
+    int index = id[0] ? resolve_drive(model->drives, model->count, id) : -1;
+    if (index < 0) {
+        batch_result(seq, cmd, "no such drive");
+        *all_ok = false;
+        return;
+    }
+
+    BatchJob* job = NULL;
+    for (int i = 0; i < MAX_BATCH_JOBS && job == NULL; i++) {
+        if (batch_jobs[i].state == JOB_FREE) job = &batch_jobs[i];
+    }
+    if (job == NULL) {
+        batch_result(seq, cmd, "too many outstanding commands");
+        *all_ok = false;
+        return;
+    }
+
+    memset(job, 0, sizeof(*job));
+    job->seq = seq;
+    strcpy(job->cmd, cmd);
+    strcpy(job->drive, model->drives[index].path);
+    job->timeout_ms = timeout_ms;
+    job->notify_fd = notify_fd;
+    job->state = JOB_QUEUED;
+}
+
+// Batch mode main loop
+int run_batch(void) {
+    static DriveModel model;
+    int notify[2];
+    if (pipe2(notify, O_CLOEXEC | O_NONBLOCK) != 0) return 1;
+
+    int mounts_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    int swaps_fd = open("/proc/swaps", O_RDONLY | O_CLOEXEC);
+    int uevent_fd = backend == &native_backend ? open_uevent_socket() : -1;
+    bool input_open = true, all_ok = true;
+    int seq = 0;
+
+    event_echo = EVENTS_JSON;
+    tuning_enabled = true;
+    model_load(&model);
+
+    while (true) {
+        bool outstanding = false;
+        for (int i = 0; i < MAX_BATCH_JOBS; i++) {
+            BatchJob* job = &batch_jobs[i];
+            if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) == JOB_FINISHED) batch_report(job, &all_ok);
+            if (job->state != JOB_FREE) outstanding = true;
+        }
+        if (batch_dispatch(&model)) continue;
+        if (!input_open && !outstanding) break;
+
+        struct pollfd fds[5] = {
+            {input_open ? STDIN_FILENO : -1, POLLIN, 0},
+            {mounts_fd, POLLPRI, 0},
+            {swaps_fd, POLLPRI, 0},
+            {uevent_fd, POLLIN, 0},
+            {notify[0], POLLIN, 0},
+        };
+        if (poll(fds, 5, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if ((fds[1].revents | fds[2].revents) & (POLLPRI | POLLERR)) model_tables_changed(&model);
+        if (fds[3].revents & POLLIN) {
+            Uevent ev;
+            while (read_uevent(uevent_fd, &ev)) model_handle_uevent(&model, &ev);
+        }
+        if (fds[4].revents & POLLIN) {
+            char drain[64];
+            while (read(notify[0], drain, sizeof(drain)) > 0) {}
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            char line[MAX_LINE];
+            if (read_line(line, sizeof(line))) batch_command(&model, ++seq, line, notify[1], &all_ok);
+            else input_open = false;
+        }
+    }
+
+    return all_ok ? 0 : 1;
+}
+
+// Scheduler scale benchmark (hidden --bench-sim N): N simultaneous ejects
+// of simulated drives through execute_plan. Hooks and learning are left
+// out; what is measured is the scheduling around the simulated steps.
+typedef struct {
+    EjectPlan* plan;
+    bool ok;
+    double end_ms;
+} SimJob;
+
+static double bench_t0;
+static volatile bool bench_done;
+static int bench_peak_threads, bench_peak_fds;
+
+void* sim_eject_thread(void* arg) {
+    SimJob* job = arg;
+    job->ok = execute_plan(job->plan, false);
+    job->end_ms = now_ms() - bench_t0;
+    return NULL;
+}
+
+// Threads and open file descriptors of this process right now
+void count_process_usage(int* threads, int* fds) {
+    char line[MAX_LINE];
+    FILE* fp = fopen("/proc/self/status", "r");
+    unsigned long long value = 0;
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        if (parse_stat_line(line, "Threads", &value)) break;
+    }
+    *threads = value < INT_MAX ? (int)value : INT_MAX;
+    if (fp != NULL) fclose(fp);
+
+    *fds = 0;
+    DIR* dir = opendir("/proc/self/fd");
+    struct dirent* entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') (*fds)++;
+    }
+    if (dir != NULL) {
+        closedir(dir);
+        (*fds)--;   // the directory itself
+    }
+}
+
+void* bench_monitor(void* arg) {
+    (void)arg;
+    while (!bench_done) {
+        int threads, fds;
+        count_process_usage(&threads, &fds);
+        if (threads > bench_peak_threads) bench_peak_threads = threads;
+        if (fds > bench_peak_fds) bench_peak_fds = fds;
+        usleep(2000);
+    }
+    return NULL;
+}
+
+// Finish time of a node had every step started the moment its
+// prerequisites ended, given the durations the steps actually took
+double ideal_finish(const EjectPlan* plan, int node, double memo[]) {
+    if (memo[node] >= 0) return memo[node];
+
+    const PlanNode* n = &plan->nodes[node];
+    double start = 0;
+    for (int i = 0; i < n->dep_count; i++) {
+        double f = ideal_finish(plan, n->deps[i], memo);
+        if (f > start) start = f;
+    }
+    memo[node] = start + (n->end_ms - n->start_ms);
+    return memo[node];
+}
+
+int run_bench_sim(int count) {
+    sim_init(count);
+    backend = &sim_backend;
+    install_faults();
+    count = sim_config.drives;
+
+    DriveInfo* drives = calloc(count, sizeof(DriveInfo));
+    EjectPlan* plans = calloc(count, sizeof(EjectPlan));
+    SimJob* jobs = calloc(count, sizeof(SimJob));
+    pthread_t* threads = calloc(count, sizeof(pthread_t));
+    bool* started = calloc(count, sizeof(bool));
+    if (!drives || !plans || !jobs || !threads || !started) {
+        fprintf(stderr, "ceject: out of memory\n");
+        return 1;
+    }
+
+    double estimate = 0;
+    for (int i = 0; i < count; i++) {
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "/dev/sim%d", i);
+        backend->get_drive_info(path, &drives[i]);
+        backend->build_plan(&drives[i], &plans[i]);
+        jobs[i].plan = &plans[i];
+        if (plans[i].total_ms > estimate) estimate = plans[i].total_ms;
+    }
+
+    int base_threads, base_fds;
+    count_process_usage(&base_threads, &base_fds);
+    pthread_t monitor;
+    bool monitoring = pthread_create(&monitor, NULL, bench_monitor, NULL) == 0;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, STEP_STACK_SIZE);
+
+    bench_t0 = now_ms();
+    int start_failures = 0;
+    for (int i = 0; i < count; i++) {
+        started[i] = pthread_create(&threads[i], &attr, sim_eject_thread, &jobs[i]) == 0;
+        if (!started[i]) start_failures++;
+    }
+    double launched = now_ms() - bench_t0;
+    for (int i = 0; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+    double total = now_ms() - bench_t0;
+    pthread_attr_destroy(&attr);
+
+    bench_done = true;
+    if (monitoring) pthread_join(monitor, NULL);
+
+    // Completion per drive, how far each finished behind its own ideal
+    // schedule, and how long ready steps waited to be started
+    LatencyHistogram completion = {0}, overhead = {0}, dispatch = {0};
+    int ok = 0, failed_steps = 0, skipped_steps = 0, retries = 0;
+    for (int i = 0; i < count; i++) {
+        EjectPlan* plan = &plans[i];
+        if (!started[i]) continue;
+        histogram_add(&completion, jobs[i].end_ms * 1000);
+
+        double memo[MAX_PLAN_NODES], actual = 0, ideal = 0;
+        for (int j = 0; j < plan->node_count; j++) memo[j] = -1;
+
+        for (int j = 0; j < plan->node_count; j++) {
+            PlanNode* n = &plan->nodes[j];
+            if (n->status == NODE_FAILED) failed_steps++;
+            if (n->status == NODE_SKIPPED) skipped_steps++;
+            retries += n->attempts;
+            if (n->status != NODE_DONE && n->status != NODE_FAILED) continue;
+
+            double ready = 0;
+            for (int k = 0; k < n->dep_count; k++) {
+                if (plan->nodes[n->deps[k]].end_ms > ready) ready = plan->nodes[n->deps[k]].end_ms;
+            }
+            histogram_add(&dispatch, (n->start_ms - ready) * 1000);
+            if (n->end_ms > actual) actual = n->end_ms;
+            double f = ideal_finish(plan, j, memo);
+            if (f > ideal) ideal = f;
+        }
+
+        if (jobs[i].ok) {
+            ok++;
+            histogram_add(&overhead, (actual - ideal) * 1000);
+        }
+    }
+    completion.over_budget = overhead.over_budget = dispatch.over_budget = 0;
+
+    char buf[32];
+    printf("Simulated eject of %d drives (%d partitions, ~%.0f MB dirty at ~%.0f MB/s, fail %.1f%%)\n", count,
+           sim_config.partitions, sim_config.dirty_mb, sim_config.bw_mb, sim_config.fail * 100);
+    format_ms(total, buf, sizeof(buf));
+    printf("  wall time %s (longest planned eject %.0f ms), threads launched in %.1f ms\n", buf, estimate,
+           launched);
+    printf("  %d ok, %d failed, %d could not start; %d steps failed, %d skipped, %d retries\n", ok,
+           count - ok - start_failures, start_failures, failed_steps, skipped_steps, retries);
+    printf("  peak threads %d (%+d), peak fds %d (%+d)\n\n", bench_peak_threads,
+           bench_peak_threads - base_threads, bench_peak_fds, bench_peak_fds - base_fds);
+    show_histogram(stdout, "completion time", &completion);
+    show_histogram(stdout, "scheduler overhead (actual - ideal finish)", &overhead);
+    show_histogram(stdout, "step dispatch delay (ready -> started)", &dispatch);
+
+    free(drives);
+    free(plans);
+    free(jobs);
+    free(threads);
+    free(started);
+    return start_failures == 0 ? 0 : 1;
+}
+
+// Refresh benchmark (hidden --bench-refresh N): the menu's redraw after a
+// mount-table wakeup with nothing changed, and a full rescan ("r"), each
+// timed and with heap allocations counted. The screen goes to /dev/null.
+// Fails if a no-change refresh allocated once warmed up.
+typedef struct {
+    double us;
+    double calls;
+    double bytes;
+} RefreshCost;
+
+RefreshCost bench_refresh_pass(DriveModel* model, int count, bool rescan) {
+    AllocStats before = get_alloc_stats();
+    double t0 = now_ms();
+    for (int i = 0; i < count; i++) {
+        if (rescan) model_load(model);
+        else model_tables_changed(model);
+        if (model->count > 0) show_drives(model->drives, model->ready, model->count, model->incident);
+        show_menu(model->count);
+    }
+    double elapsed = now_ms() - t0;
+    AllocStats after = get_alloc_stats();
+
+    return (RefreshCost){elapsed * 1000 / count, (double)(after.calls - before.calls) / count,
+                         (double)(after.bytes - before.bytes) / count};
+}
+
+int run_bench_refresh(int count) {
+    static DriveModel model;
+    if (count < 1) count = 1;
+
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (saved_stdout < 0 || null_fd < 0) {
+        perror("ceject: /dev/null");
+        return 1;
+    }
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    // Warm up: stdio buffers, the table arena and the drive model
+    model_load(&model);
+    bench_refresh_pass(&model, 3, false);
+    bench_refresh_pass(&model, 3, true);
+
+    RefreshCost idle = bench_refresh_pass(&model, count, false);
+    RefreshCost rescan = bench_refresh_pass(&model, count, true);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    printf("Refresh of %d drive%s, %d mounts, %d iterations\n", model.count, model.count == 1 ? "" : "s",
+           mount_table_count, count);
+    printf("  no-change refresh  %8.1f us  %6.1f allocs  %8.0f bytes\n", idle.us, idle.calls, idle.bytes);
+    printf("  full rescan        %8.1f us  %6.1f allocs  %8.0f bytes\n", rescan.us, rescan.calls, rescan.bytes);
+    printf("  table arena        %8zu KiB\n", arena_capacity(&table_arena) / 1024);
+    if (!ALLOC_STATS) {
+        printf("  (allocation counting needs glibc)\n");
+        return 0;
+    }
+    if (idle.calls > 0) {
+        fprintf(stderr, "ceject: no-change refresh allocated from the heap\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Parser benchmark (hidden --bench-parsers MiB) and fuzz targets. Each
+// replacement parser is run against the sscanf version it replaced, kept
+// here for comparison, on the same input: realistic lines of each kind,
+// repeated to the requested size. Fails if a replacement touches the heap
+// or reads any input differently. Throughput depends on the machine and
+// its load, so a slower replacement is only reported.
+bool legacy_parse_mountinfo_line(const char* line, MountEntry* m) {
+    char root[MAX_PATH];
+    int parent;
+    if (sscanf(line, "%d %d %u:%u %255s %255s", &m->id, &parent, &m->major, &m->minor, root, m->mountpoint) != 6) {
+        return false;
+    }
+    const char* sep = strstr(line, " - ");
+    if (sep == NULL) return false;
+
+    m->fstype[0] = '\0';
+    m->source[0] = '\0';
+    sscanf(sep + 3, "%31s %255s", m->fstype, m->source);
+    unescape_octal(m->mountpoint);
+    unescape_octal(m->source);
+    return true;
+}
+
+bool legacy_parse_swaps_line(const char* line, SwapEntry* sw) {
+    char type[32];
+    unsigned long long size_kb;
+    if (sscanf(line, "%255s %31s %llu %llu", sw->path, type, &size_kb, &sw->used_kb) != 4) return false;
+    unescape_octal(sw->path);
+    return true;
+}
+
+bool legacy_parse_devnum(const char* s, unsigned int* major, unsigned int* minor) {
+    return sscanf(s, "%u:%u", major, minor) == 2;
+}
+
+bool legacy_parse_stat_line(const char* line, const char* key, unsigned long long* value) {
+    char format[64];
+    snprintf(format, sizeof(format), "%s: %%llu", key);
+    return sscanf(line, format, value) == 1;
+}
+
+bool legacy_parse_inflight(const char* s, unsigned long long* reads, unsigned long long* writes) {
+    return sscanf(s, "%llu %llu", reads, writes) == 2;
+}
+
+bool legacy_parse_fdinfo_flags(const char* line, unsigned int* flags) {
+    return sscanf(line, "flags: %o", flags) == 1;
+}
+
+// One parse of an input into a result that can be compared byte for byte
+typedef union {
+    MountEntry mount;
+    SwapEntry swap;
+    unsigned int devnum[2];
+    unsigned long long stat[2];
+    unsigned long long inflight[2];
+    unsigned int flags;
+    Uevent uevent;
+} ParseResult;
+
+typedef bool (*ParseFn)(const char* input, size_t len, ParseResult* out);
+
+bool bench_mountinfo(const char* s, size_t len, ParseResult* r) { (void)len; return parse_mountinfo_line(s, &r->mount); }
+bool bench_mountinfo_legacy(const char* s, size_t len, ParseResult* r) { (void)len; return legacy_parse_mountinfo_line(s, &r->mount); }
+bool bench_swaps(const char* s, size_t len, ParseResult* r) { (void)len; return parse_swaps_line(s, &r->swap); }
+bool bench_swaps_legacy(const char* s, size_t len, ParseResult* r) { (void)len; return legacy_parse_swaps_line(s, &r->swap); }
+bool bench_devnum(const char* s, size_t len, ParseResult* r) { (void)len; return parse_devnum(s, &r->devnum[0], &r->devnum[1]); }
+bool bench_devnum_legacy(const char* s, size_t len, ParseResult* r) { (void)len; return legacy_parse_devnum(s, &r->devnum[0], &r->devnum[1]); }
+bool bench_inflight(const char* s, size_t len, ParseResult* r) { (void)len; return parse_inflight(s, &r->inflight[0], &r->inflight[1]); }
+bool bench_inflight_legacy(const char* s, size_t len, ParseResult* r) { (void)len; return legacy_parse_inflight(s, &r->inflight[0], &r->inflight[1]); }
+bool bench_fdinfo(const char* s, size_t len, ParseResult* r) { (void)len; return parse_fdinfo_flags(s, &r->flags); }
+bool bench_fdinfo_legacy(const char* s, size_t len, ParseResult* r) { (void)len; return legacy_parse_fdinfo_flags(s, &r->flags); }
+bool bench_uevent(const char* s, size_t len, ParseResult* r) { return parse_uevent(s, len, &r->uevent); }
+
+// meminfo as read_bdi_stats reads it: each line tried against both keys
+bool bench_stat(const char* s, size_t len, ParseResult* r) {
+    (void)len;
+    return parse_stat_line(s, "Dirty", &r->stat[0]) || parse_stat_line(s, "Writeback", &r->stat[1]);
+}
+
+bool bench_stat_legacy(const char* s, size_t len, ParseResult* r) {
+    (void)len;
+    return legacy_parse_stat_line(s, "Dirty", &r->stat[0]) || legacy_parse_stat_line(s, "Writeback", &r->stat[1]);
+}
+
+typedef struct {
+    const char* name;
+    ParseFn parse;
+    ParseFn legacy;
+    const char* source;   // file to take sample lines from, if readable
+    const char* samples[6];
+} ParserCase;
+
+static const ParserCase parser_cases[] = {
+    {"mountinfo", bench_mountinfo, bench_mountinfo_legacy, "/proc/self/mountinfo",
+     {"36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue",
+      "412 29 8:17 / /media/user/BACKUP\\040DISK rw,nosuid,nodev,relatime shared:230 - exfat /dev/sdb1 rw"}},
+    {"swaps", bench_swaps, bench_swaps_legacy, "/proc/swaps",
+     {"/dev/sdb2                               partition\t8388604\t\t1024\t\t-2",
+      "/media/user/BACKUP/swap\\040file      file\t\t1048572\t\t0\t\t-3"}},
+    {"meminfo", bench_stat, bench_stat_legacy, "/proc/meminfo",
+     {"MemTotal:       16303136 kB", "Dirty:               812 kB", "Writeback:             0 kB"}},
+    {"devnum", bench_devnum, bench_devnum_legacy, NULL, {"8:16", "259:3", "253:12", "7:0", "43:128"}},
+    {"inflight", bench_inflight, bench_inflight_legacy, NULL, {"       0        0", "      12       34", "    1024        3"}},
+    {"fdinfo", bench_fdinfo, bench_fdinfo_legacy, "/proc/self/fdinfo/0",
+     {"pos:\t0", "flags:\t0100002", "mnt_id:\t29", "ino:\t1034"}},
+    {"uevent", bench_uevent, NULL, NULL, {NULL}},
+};
+
+// Sample uevents, fields separated by NUL as the kernel sends them
+static const char bench_uevent_add[] = "add@/devices/pci0000:00/0000:00:14.0/usb2/2-1/2-1:1.0/host6/target6:0:0/"
+    "6:0:0:0/block/sdb\0ACTION=add\0DEVPATH=/devices/pci0000:00/0000:00:14.0/usb2/2-1/2-1:1.0/host6/target6:0:0/"
+    "6:0:0:0/block/sdb\0SUBSYSTEM=block\0MAJOR=8\0MINOR=16\0DEVNAME=sdb\0DEVTYPE=disk\0DISKSEQ=12\0SEQNUM=4711";
+static const char bench_uevent_change[] = "change@/devices/virtual/block/dm-0\0ACTION=change\0"
+    "DEVPATH=/devices/virtual/block/dm-0\0SUBSYSTEM=block\0MAJOR=253\0MINOR=0\0DEVNAME=dm-0\0DEVTYPE=disk\0"
+    "SEQNUM=4712";
+
+// Fill buf with NUL-separated inputs, cycling through the samples; lengths
+// go to lens. Returns the number of inputs.
+int bench_parser_corpus(const ParserCase* pc, char* buf, size_t size, size_t* lens, int max_inputs) {
+    const char* samples[256];
+    size_t sample_lens[256];
+    int sample_count = 0;
+    char file[65536];
+
+    if (pc->parse == bench_uevent) {
+        samples[0] = bench_uevent_add;
+        sample_lens[0] = sizeof(bench_uevent_add);
+        samples[1] = bench_uevent_change;
+        sample_lens[1] = sizeof(bench_uevent_change);
+        sample_count = 2;
+    } else {
+        for (int i = 0; i < 6 && pc->samples[i] != NULL; i++) {
+            samples[sample_count] = pc->samples[i];
+            sample_lens[sample_count++] = strlen(pc->samples[i]) + 1;
+        }
+
+        // Real lines from this system, the header of /proc/swaps included
+        int fd = pc->source ? open(pc->source, O_RDONLY | O_CLOEXEC) : -1;
+        ssize_t n = 0, got;
+        while (fd >= 0 && (size_t)n < sizeof(file) - 1 && (got = read(fd, file + n, sizeof(file) - 1 - n)) > 0) n += got;
+        if (fd >= 0) close(fd);
+        for (char* line = file; n > 0 && line < file + n && sample_count < 256;) {
+            char* nl = memchr(line, '\n', file + n - line);
+            if (nl == NULL) break;
+            *nl = '\0';
+            samples[sample_count] = line;
+            sample_lens[sample_count++] = nl - line + 1;
+            line = nl + 1;
+        }
+    }
+
+    size_t used = 0;
+    int count = 0;
+    while (count < max_inputs && used + sample_lens[count % sample_count] <= size) {
+        size_t len = sample_lens[count % sample_count];
+        memcpy(buf + used, samples[count % sample_count], len);
+        lens[count++] = len;
+        used += len;
+    }
+    return count;
+}
+
+typedef struct {
+    double mb_per_s;
+    double allocs;
+} ParserCost;
+
+// Best of three passes over the corpus
+ParserCost bench_parser_pass(ParseFn parse, const char* buf, const size_t* lens, int count) {
+    ParserCost best = {0, 0};
+    size_t bytes = 0;
+    for (int i = 0; i < count; i++) bytes += lens[i];
+
+    for (int pass = 0; pass < 3; pass++) {
+        ParseResult r;
+        AllocStats before = get_alloc_stats();
+        double t0 = now_ms();
+        const char* input = buf;
+        for (int i = 0; i < count; i++) {
+            parse(input, lens[i] - 1, &r);
+            input += lens[i];
+        }
+        double ms = now_ms() - t0;
+        AllocStats after = get_alloc_stats();
+
+        double mb_per_s = ms > 0 ? bytes / (1024.0 * 1024) / (ms / 1000) : 0;
+        if (mb_per_s > best.mb_per_s) best.mb_per_s = mb_per_s;
+        best.allocs = (double)(after.calls - before.calls) / count;
+    }
+    return best;
+}
+
+// Inputs the two parsers read differently (one accepts, or the results differ)
+int bench_parser_disagreements(const ParserCase* pc, const char* buf, const size_t* lens, int count) {
+    int disagreements = 0;
+    const char* input = buf;
+    for (int i = 0; i < count; i++) {
+        ParseResult a, b;
+        memset(&a, 0, sizeof(a));
+        memset(&b, 0, sizeof(b));
+        bool ok_a = pc->parse(input, lens[i] - 1, &a), ok_b = pc->legacy(input, lens[i] - 1, &b);
+        if (ok_a != ok_b || (ok_a && memcmp(&a, &b, sizeof(a)) != 0)) disagreements++;
+        input += lens[i];
+    }
+    return disagreements;
+}
+
+int run_bench_parsers(int mib) {
+    if (mib < 1) mib = 1;
+    size_t size = (size_t)mib * 1024 * 1024;
+    int max_inputs = (int)(size / 4);
+    char* buf = malloc(size);
+    size_t* lens = malloc(max_inputs * sizeof(size_t));
+    if (buf == NULL || lens == NULL) {
+        fprintf(stderr, "ceject: out of memory\n");
+        return 1;
+    }
+
+    int failures = 0;
+    printf("Parser throughput, %d MiB of input each\n", mib);
+    printf("  %-10s %9s %12s %12s %8s %15s\n", "parser", "inputs", "legacy MB/s", "MB/s", "speedup", "allocs/input");
+
+    for (size_t c = 0; c < sizeof(parser_cases) / sizeof(parser_cases[0]); c++) {
+        const ParserCase* pc = &parser_cases[c];
+        int count = bench_parser_corpus(pc, buf, size, lens, max_inputs);
+        if (count == 0) continue;
+
+        ParserCost cost = bench_parser_pass(pc->parse, buf, lens, count);
+        if (pc->legacy == NULL) {
+            printf("  %-10s %9d %12s %12.1f %8s %15.2f\n", pc->name, count, "-", cost.mb_per_s, "-", cost.allocs);
+        } else {
+            ParserCost legacy = bench_parser_pass(pc->legacy, buf, lens, count);
+            int disagreements = bench_parser_disagreements(pc, buf, lens, count);
+            printf("  %-10s %9d %12.1f %12.1f %7.1fx %7.2f / %-5.2f\n", pc->name, count, legacy.mb_per_s,
+                   cost.mb_per_s, legacy.mb_per_s > 0 ? cost.mb_per_s / legacy.mb_per_s : 0, legacy.allocs,
+                   cost.allocs);
+            if (disagreements > 0) printf("    %s%d inputs read differently%s\n", RED, disagreements, NC);
+            if (cost.mb_per_s < legacy.mb_per_s) printf("    %sslower than the sscanf version on this run%s\n", YELLOW, NC);
+            if (disagreements > 0) failures++;
+        }
+        if (cost.allocs > 0) failures++;
+    }
+    if (!ALLOC_STATS) printf("  (allocation counting needs glibc)\n");
+
+    free(buf);
+    free(lens);
+    if (failures > 0) fprintf(stderr, "ceject: %d parser%s allocating or disagreeing\n", failures,
+                              failures == 1 ? "" : "s");
+    return failures > 0 ? 1 : 0;
+}
+
+#ifdef CEJECT_FUZZ
+// libFuzzer targets, one per parser:
+//
+//   clang -g -O1 -fsanitize=fuzzer,address -DCEJECT_FUZZ -o ceject-fuzz ceject.c -pthread
+//   CEJECT_FUZZ_TARGET=mountinfo ./ceject-fuzz corpus/
+//
+// Targets: mountinfo, swaps, meminfo, devnum, inflight, fdinfo, uevent; without
+// CEJECT_FUZZ_TARGET the first byte of each input picks one. Every input is
+// parsed from an exactly sized heap copy, so the sanitizer sees overreads,
+// and run through both the replacement and the legacy parser:
+//  - the replacement must never accept what the legacy parser rejects;
+//  - where both accept, the results must be identical.
+// Both checks skip fields of 32 characters or more, which sscanf's width
+// limits split into two, and, for mountinfo, a root or mountpoint of "-",
+// which the legacy parser takes for the separator. Inputs starting with
+// '!' are instead decoded into fields of a well-formed line, which the
+// replacement must read back exactly.
+#define FUZZ_FIELD_MAX 32
+
+void fuzz_fail(const char* target, const char* what, const char* input) {
+    fprintf(stderr, "ceject-fuzz %s: %s\n  input: \"%s\"\n", target, what, input);
+    abort();
+}
+
+// Check whether every whitespace-separated field is short enough that
+// sscanf's widths leave it whole
+bool fuzz_fields_fit(const char* s) {
+    char field[FUZZ_FIELD_MAX];
+    while (next_field(&s, field, sizeof(field))) {}
+    return !next_field(&s, NULL, 0);
+}
+
+// Check whether any of the first n fields is a lone "-"
+bool fuzz_dash_field(const char* s, int n) {
+    char field[FUZZ_FIELD_MAX + 1];
+    for (int i = 0; i < n && next_field(&s, field, sizeof(field)); i++) {
+        if (strcmp(field, "-") == 0) return true;
+    }
+    return false;
+}
+
+// Take a field of 1 to 12 characters from the fuzz input
+void fuzz_take_field(const uint8_t** data, size_t* size, char* out) {
+    static const char alphabet[] = "abz09/_.,:\\-";
+    size_t len = *size > 0 ? 1 + **data % 12 : 1;
+    for (size_t i = 0; i < len; i++) {
+        out[i] = *size > 0 ? alphabet[(*data)[0] % (sizeof(alphabet) - 1)] : 'a';
+        if (*size > 0) {
+            (*data)++;
+            (*size)--;
+        }
+    }
+    out[len] = '\0';
+}
+
+unsigned int fuzz_take_number(const uint8_t** data, size_t* size) {
+    unsigned int n = 0;
+    for (int i = 0; i < 4 && *size > 0; i++, (*data)++, (*size)--) n = n << 8 | **data;
+    return n;
+}
+
+// Well-formed mountinfo, swaps, inflight and fdinfo lines built from fuzz bytes
+void fuzz_generated(const char* target, const uint8_t* data, size_t size) {
+    char a[16], b[16], c[16], d[16], line[256], expect[16];
+    fuzz_take_field(&data, &size, a);
+    fuzz_take_field(&data, &size, b);
+    fuzz_take_field(&data, &size, c);
+    fuzz_take_field(&data, &size, d);
+    unsigned int x = fuzz_take_number(&data, &size) & INT_MAX, y = fuzz_take_number(&data, &size);
+
+    if (strcmp(target, "mountinfo") == 0) {
+        MountEntry m;
+        snprintf(line, sizeof(line), "%u 1 %u:%u /%s %s rw shared:1 - %s %s rw", x, y >> 20, y & 0xfffff, a, b, c, d);
+        if (!parse_mountinfo_line(line, &m)) fuzz_fail(target, "well-formed line rejected", line);
+        snprintf(expect, sizeof(expect), "%s", b);
+        unescape_octal(expect);
+        if (m.id != (int)x || m.major != y >> 20 || m.minor != (y & 0xfffff) || strcmp(m.mountpoint, expect) != 0 ||
+            strcmp(m.fstype, c) != 0) {
+            fuzz_fail(target, "well-formed line misread", line);
+        }
+    } else if (strcmp(target, "swaps") == 0) {
+        SwapEntry sw;
+        snprintf(line, sizeof(line), "%s partition\t%u\t%u\t-2", a, x, y);
+        if (!parse_swaps_line(line, &sw) || sw.used_kb != y) fuzz_fail(target, "well-formed line misread", line);
+    } else if (strcmp(target, "inflight") == 0) {
+        unsigned long long reads, writes;
+        snprintf(line, sizeof(line), "%8u %8u", x, y);
+        if (!parse_inflight(line, &reads, &writes) || reads != x || writes != y) {
+            fuzz_fail(target, "well-formed line misread", line);
+        }
+    } else if (strcmp(target, "fdinfo") == 0) {
+        unsigned int flags;
+        snprintf(line, sizeof(line), "flags:\t0%o", y);
+        if (!parse_fdinfo_flags(line, &flags) || flags != y) fuzz_fail(target, "well-formed line misread", line);
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static const char* targets[] = {"mountinfo", "swaps", "meminfo", "devnum", "inflight", "fdinfo", "uevent"};
+    const char* target = getenv("CEJECT_FUZZ_TARGET");
+    if (target == NULL) {
+        if (size == 0) return 0;
+        target = targets[data[0] % (sizeof(targets) / sizeof(targets[0]))];
+        data++;
+        size--;
+    }
+
+    if (size > 0 && data[0] == '!') {
+        fuzz_generated(target, data + 1, size - 1);
+        return 0;
+    }
+
+    char* input = malloc(size + 1);
+    if (input == NULL) return 0;
+    memcpy(input, data, size);
+    input[size] = '\0';
+
+    if (strcmp(target, "uevent") == 0) {
+        // The message itself, without a terminator the kernel does not send
+        Uevent ev;
+        char* msg = malloc(size > 0 ? size : 1);
+        if (msg != NULL) {
+            memcpy(msg, data, size);
+            if (parse_uevent(msg, size, &ev) && ev.action[0] == '\0') fuzz_fail(target, "accepted without action", input);
+            free(msg);
+        }
+        free(input);
+        return 0;
+    }
+
+    ParseFn parse = NULL, legacy = NULL;
+    for (size_t c = 0; c < sizeof(parser_cases) / sizeof(parser_cases[0]); c++) {
+        if (strcmp(parser_cases[c].name, target) == 0) {
+            parse = parser_cases[c].parse;
+            legacy = parser_cases[c].legacy;
+        }
+    }
+
+    ParseResult a, b;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    bool ok = parse != NULL && parse(input, size, &a);
+    bool legacy_ok = legacy != NULL && legacy(input, size, &b);
+
+    bool comparable = legacy != NULL && fuzz_fields_fit(input) &&
+                      !(strcmp(target, "mountinfo") == 0 && fuzz_dash_field(input, 5));
+    if (comparable && ok && !legacy_ok) fuzz_fail(target, "accepted what the legacy parser rejects", input);
+    if (comparable && ok && memcmp(&a, &b, sizeof(a)) != 0) fuzz_fail(target, "read differently from the legacy parser", input);
+
+    free(input);
+    return 0;
+}
+#endif
+
+#ifdef CEJECT_TEST
+// Behavioural checks, run without touching any drive:
+//
+//   gcc -O2 -DCEJECT_TEST -o ceject-test ceject.c -pthread && ./ceject-test
+//
+// Plans are built over a made-up mount table laid on the first block device
+// in /sys/block; the other checks use the simulated backend and temporary
+// files. Exits non-zero if any check fails.
+static int test_failures;
+
+void test_check(bool ok, const char* group, const char* what) {
+    if (ok) return;
+    fprintf(stderr, "ceject-test %s: %s\n", group, what);
+    test_failures++;
+}
+
+// Index of the node with the given type and target, or -1
+int test_find_node(const EjectPlan* plan, StepType type, const char* target) {
+    for (int i = 0; i < plan->node_count; i++) {
+        if (plan->nodes[i].type == type && strcmp(plan->nodes[i].target, target) == 0) return i;
+    }
+    return -1;
+}
+
+bool test_depends(const EjectPlan* plan, int node, int dep) {
+    if (node < 0 || dep < 0) return false;
+    for (int i = 0; i < plan->nodes[node].dep_count; i++) {
+        if (plan->nodes[node].deps[i] == dep) return true;
+    }
+    return false;
+}
+
+// Any disk the kernel lists will do: only its device number is used
+bool test_pick_disk(char name[64], unsigned int* major, unsigned int* minor) {
+    char disks[64][64];
+    int count = list_dir("/sys/block", disks, 64);
+    for (int i = 0; i < count; i++) {
+        if (get_block_devnum(disks[i], major, minor)) {
+            strcpy(name, disks[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
+void test_plan(void) {
+    static EjectPlan plan;
+    const char* group = "plan";
+
+    // Paths that do not fit a node are left out and reported
+    char long_target[MAX_PATH + 44];
+    memset(long_target, 'a', sizeof(long_target) - 1);
+    long_target[sizeof(long_target) - 1] = '\0';
+    memset(&plan, 0, sizeof(plan));
+    test_check(plan_add(&plan, STEP_UNMOUNT, long_target, "sdz1") < 0 && plan.truncated, group,
+               "over-long target accepted");
+
+    // So are mountinfo lines: the mount is left out, not cut short
+    char line[2 * MAX_PATH + 64];
+    MountEntry m;
+    snprintf(line, sizeof(line), "36 35 8:1 / /media/%s rw shared:1 - ext4 /dev/sdz1 rw", long_target);
+    test_check(!parse_mountinfo_line(line, &m), group, "over-long mountpoint accepted");
+    snprintf(line, sizeof(line), "36 35 8:1 / /media/t\\040x rw shared:1 - ext4 /dev/sdz1 rw");
+    test_check(parse_mountinfo_line(line, &m) && m.id == 36 && m.major == 8 && m.minor == 1 &&
+               strcmp(m.mountpoint, "/media/t x") == 0 && strcmp(m.fstype, "ext4") == 0 &&
+               strcmp(m.source, "/dev/sdz1") == 0, group, "mountinfo line misread");
+
+    // Simulated drives: a flush, an unmount per partition, then power-off
+    sim_init(1);
+    DriveInfo drive;
+    sim_get_drive_info("/dev/sim0", &drive);
+    sim_build_plan(&drive, &plan);
+    test_check(plan.node_count == sim_config.partitions + 2, group, "sim plan has the wrong number of steps");
+    int power_off = test_find_node(&plan, STEP_POWER_OFF, "/dev/sim0");
+    for (int i = 0; i < drive.mount_count; i++) {
+        int unmount = test_find_node(&plan, STEP_UNMOUNT, drive.mountpoints[i]);
+        test_check(test_depends(&plan, unmount, 0), group, "sim unmount does not wait for the flush");
+        test_check(test_depends(&plan, power_off, unmount), group, "sim power-off does not wait for an unmount");
+    }
+
+    char name[64];
+    unsigned int major, minor;
+    if (!test_pick_disk(name, &major, &minor)) {
+        fprintf(stderr, "ceject-test %s: no block device, mount table checks skipped\n", group);
+        return;
+    }
+
+    // The drive mounted with a bind and a nested mount, a tmpfs stacked
+    // on the nested mount and an unrelated filesystem
+    MountEntry mounts[] = {
+        {1, major, minor, "/media/t", "ext4", ""},
+        {2, major, minor, "/media/t/inner", "ext4", ""},
+        {3, 0, 51, "/media/t/inner/cache", "tmpfs", "tmpfs"},
+        {4, 0, 52, "/media/other", "ext4", "/dev/sdz1"},
+        {5, major, minor, "/srv/bind", "ext4", ""},
+    };
+    snprintf(mounts[0].source, sizeof(mounts[0].source), "/dev/%s", name);
+    snprintf(mounts[1].source, sizeof(mounts[1].source), "/dev/%s", name);
+    snprintf(mounts[4].source, sizeof(mounts[4].source), "/dev/%s", name);
+    MountEntry* saved_mounts = mount_table;
+    int saved_count = mount_table_count, saved_swaps = swap_table_count;
+    bool saved_truncated = system_tables_truncated;
+    mount_table = mounts;
+    mount_table_count = sizeof(mounts) / sizeof(mounts[0]);
+    swap_table_count = 0;
+    system_tables_truncated = false;
+
+    memset(&drive, 0, sizeof(drive));
+    snprintf(drive.path, sizeof(drive.path), "/dev/%s", name);
+    snprintf(drive.transport, sizeof(drive.transport), "usb");
+    build_plan(&drive, &plan);
+
+    int outer = test_find_node(&plan, STEP_UNMOUNT, "/media/t");
+    int inner = test_find_node(&plan, STEP_UNMOUNT, "/media/t/inner");
+    int bind = test_find_node(&plan, STEP_UNMOUNT, "/srv/bind");
+    int foreign = test_find_node(&plan, STEP_UNMOUNT, "/media/t/inner/cache");
+    power_off = test_find_node(&plan, STEP_POWER_OFF, drive.path);
+    test_check(outer >= 0 && inner >= 0 && bind >= 0, group, "a mount of the drive is missing");
+    test_check(outer < 0 || strcmp(plan.nodes[outer].device, name) == 0, group, "unmount has the wrong device");
+    test_check(foreign >= 0, group, "foreign mount below the drive is missing");
+    test_check(foreign < 0 || plan.nodes[foreign].device[0] == '\0', group, "foreign mount names a device");
+    test_check(test_find_node(&plan, STEP_UNMOUNT, "/media/other") < 0, group, "unrelated mount planned");
+    test_check(test_depends(&plan, outer, inner), group, "outer mount does not wait for the nested one");
+    test_check(test_depends(&plan, inner, foreign), group, "nested mount does not wait for the foreign one");
+    test_check(!test_depends(&plan, bind, outer), group, "bind mount waits for an unrelated mountpoint");
+    test_check(plan_owns_dev(&plan, makedev(major, minor)), group, "plan does not own the drive");
+    test_check(!plan_owns_dev(&plan, makedev(0, 51)), group, "plan owns the foreign tmpfs");
+    test_check(!plan.truncated, group, "plan truncated");
+    test_check(power_off == plan.node_count - 1, group, "power-off is not the last step");
+
+    // A mount table that had to leave an entry out marks the plan
+    system_tables_truncated = true;
+    build_plan(&drive, &plan);
+    test_check(plan.truncated, group, "plan from a truncated mount table not marked");
+
+    mount_table = saved_mounts;
+    mount_table_count = saved_count;
+    swap_table_count = saved_swaps;
+    system_tables_truncated = saved_truncated;
+}
+
+void test_batch(void) {
+    const char* group = "batch";
+    char cmd[16], id[MAX_PATH], line[MAX_LINE];
+    int timeout_ms = 0;
+
+    test_check(parse_batch_line("  eject sdb 250", cmd, sizeof(cmd), id, sizeof(id), &timeout_ms) == NULL &&
+               strcmp(cmd, "eject") == 0 && strcmp(id, "sdb") == 0 && timeout_ms == 250, group,
+               "well-formed command misread");
+    test_check(parse_batch_line("# eject sdb", cmd, sizeof(cmd), id, sizeof(id), &timeout_ms) == NULL &&
+               cmd[0] == '\0', group, "comment not skipped");
+    test_check(parse_batch_line("   ", cmd, sizeof(cmd), id, sizeof(id), &timeout_ms) == NULL && cmd[0] == '\0',
+               group, "blank line not skipped");
+    test_check(parse_batch_line("eject-everything-now sdb", cmd, sizeof(cmd), id, sizeof(id), &timeout_ms) != NULL,
+               group, "over-long command accepted");
+    test_check(parse_batch_line("wait-idle sdb 10x", cmd, sizeof(cmd), id, sizeof(id), &timeout_ms) != NULL,
+               group, "bad timeout accepted");
+
+    // A drive name cut to 255 characters must not be looked up
+    snprintf(line, sizeof(line), "eject /dev/");
+    memset(line + strlen(line), 'b', MAX_PATH);
+    line[strlen("eject /dev/") + MAX_PATH] = '\0';
+    test_check(parse_batch_line(line, cmd, sizeof(cmd), id, sizeof(id), &timeout_ms) != NULL, group,
+               "over-long drive name accepted");
+
+    // Commands against simulated drives: only well-formed ones are queued
+    static DriveModel model;
+    const Backend* saved_backend = backend;
+    backend = &sim_backend;
+    sim_init(2);
+    model_load(&model);
+
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+
+    bool all_ok = true;
+    snprintf(line, sizeof(line), "eject sim1 500");
+    batch_command(&model, 1, line, -1, &all_ok);
+    test_check(all_ok && batch_jobs[0].state == JOB_QUEUED && strcmp(batch_jobs[0].drive, "/dev/sim1") == 0 &&
+               batch_jobs[0].timeout_ms == 500, group, "eject of a simulated drive not queued");
+    snprintf(line, sizeof(line), "eject /dev/sim1%0*d", MAX_PATH, 0);
+    batch_command(&model, 2, line, -1, &all_ok);
+    test_check(!all_ok && batch_jobs[1].state == JOB_FREE, group, "over-long drive name queued");
+    all_ok = true;
+    snprintf(line, sizeof(line), "eject sim7");
+    batch_command(&model, 3, line, -1, &all_ok);
+    test_check(!all_ok && batch_jobs[1].state == JOB_FREE, group, "unknown drive queued");
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(null_fd);
+    memset(batch_jobs, 0, sizeof(batch_jobs));
+    backend = saved_backend;
+}
+
+// Capture stdout or stderr into a temporary file while a check runs.
+// Returns the saved descriptor, for test_release().
+int test_capture(int target, char* path, size_t size) {
+    snprintf(path, size, "/tmp/ceject-test-XXXXXX");
+    int fd = mkstemp(path);
+    if (fd < 0) return -1;
+    fflush(stdout);
+    fflush(stderr);
+    int saved = dup(target);
+    dup2(fd, target);
+    close(fd);
+    return saved;
+}
+
+// Put the descriptor back and read what was captured into out
+void test_release(int target, int saved, const char* path, char* out, size_t size) {
+    out[0] = '\0';
+    if (saved < 0) return;
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved, target);
+    close(saved);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? read(fd, out, size - 1) : -1;
+    out[n > 0 ? n : 0] = '\0';
+    if (fd >= 0) close(fd);
+    unlink(path);
+}
+
+void test_policy(void) {
+    const char* group = "policy";
+    char dir[] = "/tmp/ceject-test-XXXXXX", path[MAX_PATH + 16];
+    if (mkdtemp(dir) == NULL) {
+        test_check(false, group, "cannot create a configuration directory");
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/policy.conf", dir);
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        test_check(false, group, "cannot write policy.conf");
+        rmdir(dir);
+        return;
+    }
+    fprintf(fp, "[exact]\n"            // 1
+                "transport = usb\n"    // 2
+                "size = 64G\n"         // 3: no bound, rejected
+                "action = hide\n"      // 4
+                "\n"
+                "[small]\n"            // 6
+                "size = <64G\n"
+                "action = preflush\n"
+                "\n"
+                "[large]\n"            // 10
+                "vendor = WD\n"
+                "size = 1T-8T\n"
+                "action = media-eject\n"
+                "\n"
+                "[backwards]\n"        // 15
+                "size = 8T-1T\n");     // 16: empty range, rejected
+    fclose(fp);
+
+    const char* saved_dir = getenv("CEJECT_CONFIG_DIR");
+    char saved_copy[MAX_PATH];
+    snprintf(saved_copy, sizeof(saved_copy), "%s", saved_dir ? saved_dir : "");
+    setenv("CEJECT_CONFIG_DIR", dir, 1);
+
+    char capture[64], errors[MAX_LINE];
+    int saved_stderr = test_capture(STDERR_FILENO, capture, sizeof(capture));
+    DriveInfo small, large;
+    memset(&small, 0, sizeof(small));
+    snprintf(small.path, sizeof(small.path), "/dev/ceject-test-a");
+    snprintf(small.transport, sizeof(small.transport), "usb");
+    small.size_bytes = 32ULL << 30;
+    policy_match(&small);
+    test_release(STDERR_FILENO, saved_stderr, capture, errors, sizeof(errors));
+
+    large = small;
+    snprintf(large.path, sizeof(large.path), "/dev/ceject-test-b");
+    snprintf(large.vendor, sizeof(large.vendor), "wd");
+    large.size_bytes = 2ULL << 40;
+    policy_match(&large);
+
+    test_check(policy_rule_count == 4, group, "rules missing");
+    test_check(strstr(errors, "policy.conf:3:") != NULL, group, "bare size not reported with its line");
+    test_check(strstr(errors, "policy.conf:16:") != NULL, group, "empty size range not reported with its line");
+    test_check(small.policy_actions == POLICY_PREFLUSH, group, "small drive matched the wrong rules");
+    test_check(large.policy_actions == POLICY_MEDIA_EJECT, group, "large drive matched the wrong rules");
+    test_check(!(small.policy_mask & 1) && !(large.policy_mask & 1), group, "rule with a bare size matched");
+
+    if (saved_dir != NULL) setenv("CEJECT_CONFIG_DIR", saved_copy, 1);
+    else unsetenv("CEJECT_CONFIG_DIR");
+    unlink(path);
+    rmdir(dir);
+}
+
+void test_sleep(void) {
+    const char* group = "sleep";
+
+    // State lines keep any mountpoint one field and read back exactly
+    SleepMount m = {MS_NOSUID | MS_NOATIME, "usb:0781:5583:4C53", "/dev/sdb", "/media/a b\tc\\d\ne"}, back;
+    char line[SLEEP_LINE_MAX];
+    test_check(format_sleep_mount(&m, line, sizeof(line)) && strchr(line, '\n') == line + strlen(line) - 1,
+               group, "state line not one line");
+    test_check(strstr(line, "/media/a\\040b\\011c\\134d\\012e") != NULL, group, "mountpoint not escaped");
+    test_check(parse_sleep_mount(line, &back) && back.flags == m.flags && strcmp(back.identity, m.identity) == 0 &&
+               strcmp(back.drive, m.drive) == 0 && strcmp(back.target, m.target) == 0, group,
+               "state line read back differently");
+    test_check(!parse_sleep_mount("2 sim:0 /dev/sim0 /media/a b", &back), group, "unescaped space accepted");
+    test_check(!parse_sleep_mount("x sim:0 /dev/sim0 /media/a", &back), group, "bad flags accepted");
+
+    // Foreign mounts are never remounted: one with no device, or one whose
+    // filesystem is not the drive's whatever the node says
+    static EjectPlan plan;
+    char name[64];
+    unsigned int major, minor;
+    memset(&plan, 0, sizeof(plan));
+    plan_add(&plan, STEP_UNMOUNT, "/tmp", "");
+    test_check(!plan_owns_mount(&plan, &plan.nodes[0]), group, "foreign mount would be remounted");
+    if (test_pick_disk(name, &major, &minor)) {
+        plan_add(&plan, STEP_UNMOUNT, "/proc", name);
+        test_check(!plan_owns_mount(&plan, &plan.nodes[1]), group, "mount of another filesystem would be remounted");
+    }
+
+    // A pre-sleep and post-resume round trip on simulated drives, with the
+    // state kept in a temporary directory
+    char dir[] = "/tmp/ceject-test-XXXXXX", path[MAX_PATH], target[MAX_PATH], capture[64], out[4096];
+    if (mkdtemp(dir) == NULL) {
+        test_check(false, group, "cannot create a state directory");
+        return;
+    }
+    const char* saved_state = getenv("CEJECT_STATE_DIR");
+    char saved_copy[MAX_PATH];
+    snprintf(saved_copy, sizeof(saved_copy), "%s", saved_state ? saved_state : "");
+    setenv("CEJECT_STATE_DIR", dir, 1);
+    const Backend* saved_backend = backend;
+    backend = &sim_backend;
+    sim_config.dirty_mb = 0;
+    sim_init(2);
+
+    int saved_stdout = test_capture(STDOUT_FILENO, capture, sizeof(capture));
+    int rc = run_pre_sleep(true, 5000, true);
+    test_release(STDOUT_FILENO, saved_stdout, capture, out, sizeof(out));
+    test_check(rc == 0 && strstr(out, "\"status\":\"ok\"") != NULL, group, "pre-sleep failed");
+    test_check(strstr(out, "\"filesystems\":2") != NULL, group, "pre-sleep counted the wrong filesystems");
+
+    // A parked mountpoint with a space and a newline in its name, still
+    // writable on resume, is reported and left alone
+    snprintf(target, sizeof(target), "%s/a b\nc", dir);
+    mkdir(target, 0700);
+    SleepMount parked = {0, "sim:0", "/dev/sim0", ""};
+    snprintf(parked.target, sizeof(parked.target), "%s", target);
+    get_state_path("sleep", path, sizeof(path));
+    FILE* fp = fopen(path, "a");
+    if (fp != NULL && format_sleep_mount(&parked, line, sizeof(line))) fputs(line, fp);
+    if (fp != NULL) fclose(fp);
+
+    saved_stdout = test_capture(STDOUT_FILENO, capture, sizeof(capture));
+    rc = run_post_resume(true);
+    test_release(STDOUT_FILENO, saved_stdout, capture, out, sizeof(out));
+    test_check(rc == 0 && strstr(out, "a b\\u000ac\",\"drive\":\"/dev/sim0\",\"status\":\"skipped\"") != NULL, group,
+               "post-resume misread the parked mountpoint");
+
+    // Records of an earlier run are carried over only for filesystems still
+    // read-only (any read-only mount here stands in for one), never undone
+    const char* read_only = NULL;
+    load_system_tables();
+    for (int i = 0; i < mount_table_count && read_only == NULL; i++) {
+        struct statvfs st;
+        if (statvfs(mount_table[i].mountpoint, &st) == 0 && (st.f_flag & ST_RDONLY)) {
+            read_only = mount_table[i].mountpoint;
+        }
+    }
+    fp = fopen(path, "w");
+    if (fp != NULL && format_sleep_mount(&parked, line, sizeof(line))) fputs(line, fp);
+    snprintf(parked.target, sizeof(parked.target), "%s", read_only ? read_only : "");
+    if (fp != NULL && read_only != NULL && format_sleep_mount(&parked, line, sizeof(line))) fputs(line, fp);
+    if (fp != NULL) fclose(fp);
+    test_check(keep_parked_mounts(path) == 0, group, "earlier sleep state not carried over");
+    int state_fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t len = state_fd >= 0 ? read(state_fd, out, sizeof(out) - 1) : -1;
+    if (state_fd >= 0) close(state_fd);
+    out[len > 0 ? len : 0] = '\0';
+    test_check(strstr(out, "a\\040b") == NULL, group, "record of a writable filesystem carried over");
+    char* kept = strtok(out, "\n");
+    test_check(read_only == NULL || (kept != NULL && parse_sleep_mount(kept, &back) && strcmp(back.target, read_only) == 0),
+               group, "record of a read-only filesystem dropped");
+    unlink(path);
+
+    backend = saved_backend;
+    if (saved_state != NULL) setenv("CEJECT_STATE_DIR", saved_copy, 1);
+    else unsetenv("CEJECT_STATE_DIR");
+    char entries[16][64];
+    int count = list_dir(dir, entries, 16);
+    for (int i = 0; i < count; i++) {
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entries[i]) >= (int)sizeof(path)) continue;
+        if (unlink(path) != 0) rmdir(path);
+    }
+    rmdir(dir);
+}
+
+int main(void) {
+    test_plan();
+    test_batch();
+    test_policy();
+    test_sleep();
+
+    if (test_failures > 0) {
+        fprintf(stderr, "ceject-test: %d check%s failed\n", test_failures, test_failures == 1 ? "" : "s");
+        return 1;
+    }
+    printf("ceject-test: all checks passed\n");
+    return 0;
+}
+#endif
+
+#endif
+
+// Command-line usage
+void show_usage(void) {
+#ifdef CEJECT_MINI
+    fprintf(stderr, "Usage: ceject-mini [--list [--json] | --plan [--json] [drive] | --eject [--json] drive]\n");
+#else
+    fprintf(stderr, "Usage: ceject [--plan [--json] [drive] | --eject [--json] drive | --probe [--json] drive |\n");
+    fprintf(stderr, "              --list [--json] | --batch | --top [drive] |\n");
+    fprintf(stderr, "              --pre-sleep [--remount-ro] [--deadline ms] [--json] | --post-resume [--json]]\n");
+#endif
+    fprintf(stderr, "  --plan    Show the teardown steps and time estimate without ejecting\n");
+    fprintf(stderr, "  --eject   Eject a drive and exit\n");
+#ifndef CEJECT_MINI
+    fprintf(stderr, "  --probe   Measure a drive's sequential read speed (a few seconds, read-only)\n");
+#endif
+    fprintf(stderr, "  --list    List external drives and exit\n");
+#ifndef CEJECT_MINI
+    fprintf(stderr, "  --batch   Read commands from stdin: list, eject <drive>, make-safe <drive>,\n");
+    fprintf(stderr, "            wait-idle <drive> [timeout-ms]; one JSON result line each\n");
+    fprintf(stderr, "  --top     Show which processes are writing to the drives, until Enter\n");
+    fprintf(stderr, "  --pre-sleep    Flush all external drives in parallel before suspend\n");
+    fprintf(stderr, "                 (--remount-ro also parks them read-only; default deadline 10 s)\n");
+    fprintf(stderr, "  --post-resume  Make the drives parked by --pre-sleep writable again\n");
+#endif
+    fprintf(stderr, "  --json    Machine-readable output\n");
+}
+
+#if defined(CEJECT_FUZZ) || defined(CEJECT_TEST)
+#define main ceject_main   // libFuzzer and the checks bring their own
+#endif
+int main(int argc, char* argv[]) {
+    bool plan_mode = false, eject_mode = false, probe_mode = false, list_mode = false, batch_mode = false;
+    bool top_mode = false, pre_sleep_mode = false, post_resume_mode = false, remount_ro = false;
+    double deadline_ms = 0;
+    bool json = false;
+    const char* target = NULL;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--plan") == 0) {
+            plan_mode = true;
+        } else if (strcmp(argv[i], "--eject") == 0) {
+            eject_mode = true;
+        } else if (strcmp(argv[i], "--list") == 0) {
+            list_mode = true;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (strcmp(argv[i], "--bench-startup") == 0 && i + 1 < argc) {
+            return run_bench_startup(atoi(argv[++i]));
+#ifndef CEJECT_MINI
+        } else if (strcmp(argv[i], "--probe") == 0) {
+            probe_mode = true;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch_mode = true;
+        } else if (strcmp(argv[i], "--top") == 0) {
+            top_mode = true;
+        } else if (strcmp(argv[i], "--pre-sleep") == 0) {
+            pre_sleep_mode = true;
+        } else if (strcmp(argv[i], "--post-resume") == 0) {
+            post_resume_mode = true;
+        } else if (strcmp(argv[i], "--remount-ro") == 0) {
+            remount_ro = true;
+        } else if (strcmp(argv[i], "--deadline") == 0 && i + 1 < argc) {
+            deadline_ms = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--ui-stats") == 0) {
+            ui_stats.enabled = true;
+        } else if (strcmp(argv[i], "--bench-sim") == 0 && i + 1 < argc) {
+            return run_bench_sim(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--bench-refresh") == 0 && i + 1 < argc) {
+            return run_bench_refresh(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--bench-parsers") == 0 && i + 1 < argc) {
+            return run_bench_parsers(atoi(argv[++i]));
+#endif
+        } else if (argv[i][0] != '-' && target == NULL) {
+            target = argv[i];
+        } else {
+            show_usage();
+            return 2;
+        }
+    }
+    
+#ifdef CEJECT_MINI
+    (void)list_mode, (void)probe_mode, (void)batch_mode, (void)top_mode;
+    (void)pre_sleep_mode, (void)post_resume_mode, (void)remount_ro, (void)deadline_ms;
+#else
+    const char* backend_name = getenv("CEJECT_BACKEND");
+    if (backend_name != NULL && strcmp(backend_name, "sim") == 0) {
+        sim_init(0);
+        backend = &sim_backend;
+    }
+    install_faults();
+#endif
+    
+    if (plan_mode) return run_plan(target, json);
+    if (eject_mode) return run_eject(target, json);
+#ifdef CEJECT_MINI
+    // No interactive menu in the mini build; list by default
+    return run_list(json);
+#else
+    if (probe_mode) return run_probe(target, json);
+    if (list_mode) return run_list(json);
+    if (batch_mode) return run_batch();
+    if (top_mode) return run_top(target);
+    if (pre_sleep_mode) return run_pre_sleep(remount_ro, deadline_ms, json);
+    if (post_resume_mode) return run_post_resume(json);
+    
+    // Stay resident: the kernel tells us when mounts, swaps or block
+    // devices change, so each drive's plan is ready before it is picked
+    int mounts_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    int swaps_fd = open("/proc/swaps", O_RDONLY | O_CLOEXEC);
+    int uevent_fd = backend == &native_backend ? open_uevent_socket() : -1;
+    static DriveModel model;
+    char input[64];
+    bool redraw = true;
+    
+    tuning_enabled = true;
+    model_load(&model);
+    model_sample_readiness(&model);
+    double next_sample = now_ms() + READY_INTERVAL_MS;
+    
+    while (true) {
+        if (redraw) {
+            model_assess(&model, NULL, NULL);
+            show_drives(model.drives, model.ready, model.count, model.incident);
+            show_menu(model.count);
+            ui_stats_frame();
+            redraw = false;
+        }
+        
+        struct pollfd fds[4] = {
+            {STDIN_FILENO, POLLIN, 0},
+            {mounts_fd, POLLPRI, 0},
+            {swaps_fd, POLLPRI, 0},
+            {uevent_fd, POLLIN, 0},
+        };
+        int timeout = (int)(next_sample - now_ms());
+        if (poll(fds, 4, timeout > 0 ? timeout : 0) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        double t_wake = now_ms();
+        
+        // Only a change of state is worth a redraw; figures update with it
+        if (t_wake >= next_sample) {
+            redraw |= model_sample_readiness(&model);
+            next_sample = t_wake + READY_INTERVAL_MS;
+        }
+        if ((fds[1].revents | fds[2].revents) & (POLLPRI | POLLERR)) {
+            redraw |= model_tables_changed(&model);
+        }
+        if (fds[3].revents & POLLIN) {
+            Uevent ev;
+            while (read_uevent(uevent_fd, &ev)) redraw |= model_handle_uevent(&model, &ev);
+        }
+        if (redraw) {
+            ui_stats_input(UI_REFRESH, t_wake);
+            ui_stats_model();
+        }
+        if (!(fds[0].revents & (POLLIN | POLLHUP))) continue;
         
-        // Remove newline
-        char* newline = strchr(input, '\n');
-        if (newline) *newline = '\0';
+        ui_stats_input(UI_KEY, t_wake);
+        if (!read_line(input, sizeof(input))) break;
+        redraw = true;
         
         // Convert to lowercase
         for (int i = 0; input[i]; i++) {
@@ -314,17 +7900,58 @@ int main(void) {
             printf("\n%sGoodbye!%s\n", CYAN, NC);
             break;
         } else if (strcmp(input, "r") == 0) {
-            continue;
+            model_load(&model);
+            ui_stats_model();
+        } else if (strcmp(input, "t") == 0) {
+            run_top(NULL);
+        } else if (strcmp(input, "g") == 0) {
+            show_last_timeline();
+        } else if (input[0] == 'p') {
+            int choice = atoi(input + 1);
+            if (choice < 1 || choice > model.count) {
+                printf("\n%s%s Invalid selection.%s\n", RED, ICON_ERROR, NC);
+                ui_stats_frame();
+                sleep(2);
+                continue;
+            }
+            ui_stats_model();
+            probe_drive(&model.drives[choice - 1], false);
+            model_update_drive(&model, choice - 1);
+            wait_for_enter();
         } else {
-            int choice = atoi(input);
-            if (choice >= 1 && choice <= drive_count) {
-                unmount_drive(drives[choice - 1].path);
+            int choices[MAX_DRIVES];
+            int choice_count = 0;
+            bool seen[MAX_DRIVES] = {false};
+            bool valid = true;
+
+            // A drive named twice ("1 1", "2,2") is ejected once: two workers
+            // must never run the same plan
+            for (char* tok = strtok(input, " ,"); tok != NULL; tok = strtok(NULL, " ,")) {
+                int choice = atoi(tok);
+                if (choice < 1 || choice > model.count) valid = false;
+                else if (!seen[choice - 1]) {
+                    seen[choice - 1] = true;
+                    choices[choice_count++] = choice - 1;
+                }
+            }
+
+            if (valid && choice_count == 1) {
+                ui_stats_model();
+                unmount_drive(&model.plans[choices[0]], &model.drives[choices[0]]);
+                model_tables_changed(&model);
+            } else if (valid && choice_count > 1) {
+                ui_stats_model();
+                unmount_drives(&model, choices, choice_count);
+                model_tables_changed(&model);
             } else {
                 printf("\n%s%s Invalid selection.%s\n", RED, ICON_ERROR, NC);
+                ui_stats_frame();
                 sleep(2);
             }
         }
     }
     
+    show_ui_stats_report();
     return 0;
+#endif
 }